@@ -5,28 +5,115 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
 
 #define NUM_BLOCKS 65536
+#undef BLOCK_SIZE      // linux/fs.h, pulled in by linux/io_uring.h, has its own
 #define BLOCK_SIZE 1024
 #define BLOCKS_PER_FILE 1024
-#define MAX_NUM_FILES 256
-#define FIRST_DATA_BLOCK 1001
+// the inode table in front of the data blocks has room for this many files. a file with data
+// takes a data block and an index block, so a full image holds at most about 32000 of them
+// whatever the table size
+#define MAX_NUM_FILES 16384
 #define MAX_FILE_SIZE 1048576
 
+// image layout: block 0 holds the superblock, blocks 1-16 the free inode map, block 18
+// the snapshot table, the inodes start at block 20, the block checksums at block 660,
+// the sync map at block 1040 and the block reference counts at block 1050. everything
+// from FIRST_DATA_BLOCK to the end of the image holds file data, the block lists of
+// the files, the directory tree and snapshot records
+#define SUPERBLOCK 0
+#define FREE_INODE_BLOCK 1
+#define SNAPSHOT_BLOCK 18
+#define FIRST_INODE_BLOCK 20
+#define CHECKSUM_BLOCK 660
+#define SYNC_MAP_BLOCK 1040
+#define BLOCK_REFS_BLOCK 1050
+#define FIRST_DATA_BLOCK 1114
+#define NUM_DATA_BLOCKS (NUM_BLOCKS - FIRST_DATA_BLOCK)
+
 #define HIDDEN 0x1
 #define READ_ONLY 0x2
 
-uint8_t data[NUM_BLOCKS][BLOCK_SIZE];
+#define IMAGE_SIZE ((size_t)NUM_BLOCKS * BLOCK_SIZE)
+
+// the memory of the current image, IMAGE_SIZE bytes reserved by imageMemory(). each
+// open image has its own
+uint8_t (*data)[BLOCK_SIZE] = NULL;
+
+// one byte per data block of a fully loaded image, set when the block is written and
+// cleared once a flush or savefs has put it in the image file
+uint8_t *dirty_blocks = NULL;
+int32_t dirty_count = 0;
+
+// set by every command that may change the image, the metadata isn't tracked by block
+bool image_changed = false;
 
-// 512 blocks just for free block map
-uint8_t *free_blocks;
+// the background flusher writes the image every flush_interval seconds, or earlier once
+// flush_threshold data blocks are dirty. 0 turns either off
+int flush_interval = 0;
+int32_t flush_threshold = 0;
+pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+
+// 64 blocks of reference counts, one byte per data block. a block is free at 0, used
+// by one file at 1 and shared between a file and snapshots of it above that
+uint8_t *block_refs;
 uint8_t *free_inodes;
 
-// directory structure
+// 252 blocks of CRC32C checksums, one per data block. only the blocks holding file data
+// have a valid checksum, it is set whenever such a block is written
+uint32_t *checksums;
+
+// 8 blocks with a bit per data block, set when the block is written and cleared by
+// sync-to. it holds the blocks changed since the sync super->sync_point names
+uint64_t *sync_map;
+#define SYNC_MAP_WORDS ((NUM_DATA_BLOCKS + 63) / 64)
+
+#define IMAGE_MAGIC 0xd17e0002   // the image has a directory tree and compact inodes
+
+// first block of the image, it locates the root of the directory tree
+struct superblock
+{
+  uint32_t magic;
+  int32_t directory_root;
+  int32_t directory_height;   // levels of inner nodes above the leaves
+  uint32_t flags;             // none are defined yet
+  uint64_t sync_point;        // random number naming the last sync-to, 0 before the first
+};
+
+struct superblock *super;
+
+// directory structure, the entries are kept in the leaves of the directory tree.
+// deleted files keep their entry with inUse cleared until the name is reused
 struct _directoryEntry
 {
   char name[64];
@@ -34,13 +121,14 @@ struct _directoryEntry
   int32_t inode;
 };
 
-// directory array
-struct _directoryEntry *directory;
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int32_t))
+#define INDEX_BLOCKS (BLOCKS_PER_FILE / POINTERS_PER_BLOCK)
 
-// inode structure
+// inode structure. the block list of the file is kept in up to INDEX_BLOCKS index
+// blocks of POINTERS_PER_BLOCK block numbers each
 struct inode
 {
-  int32_t blocks[BLOCKS_PER_FILE];
+  int32_t index_blocks[INDEX_BLOCKS];
   int block_length;
   bool inUse;
   bool hidden;
@@ -52,6 +140,28 @@ struct inode
 // inode structure
 struct inode *inodes;
 
+#define MAX_SNAPSHOTS 16
+#define REFCOUNT_MAGIC 0x53464552   // "REFS", the block map holds reference counts
+
+// a snapshot of the directory and inodes. the record is a chain of blocks starting at
+// first_block, each ending in the number of the next one
+struct snapshot
+{
+  char name[32];
+  int32_t first_block;
+  int32_t block_count;
+  time_t creation_time;
+};
+
+// snapshot table, slots with an empty name are unused
+struct snapshot_table
+{
+  uint32_t magic;
+  struct snapshot entries[MAX_SNAPSHOTS];
+};
+
+struct snapshot_table *snapshots;
+
 // global variables that define the image
 FILE* fp = NULL;
 char image_name[64];
@@ -59,1129 +169,8782 @@ bool image_open;
 
 int fileCount = 0;
 
-#define WHITESPACE " \t\n" // We want to split our command line up into tokens
-                           // so we need to define what delimits our tokens.
-                           // In this case  white space
-                           // will separate the tokens on our command line
+// stream the commands print to, stdout for the shell and a buffer per command that is
+// sent back to the client in mfsd
+__thread FILE *output;
 
-#define MAX_COMMAND_SIZE 255 // The maximum command-line size
+// counters of the allocator, the directory and the block cache, reported by mfs-replay.
+// COUNT() compiles to nothing in mfs and mfsd
+#ifdef MFS_REPLAY
+struct counters
+{
+  uint64_t run_searches;      // allocations looking for a run of free blocks
+  uint64_t run_fallbacks;     // allocations that found no run and took single blocks
+  uint64_t block_searches;    // single free block searches
+  uint64_t block_probes;      // reference counts looked at by both kinds of search
+  uint64_t blocks_allocated;
+  uint64_t inode_searches;
+  uint64_t inode_probes;      // free inode map entries looked at
+  uint64_t directory_walks;   // walks down the directory tree
+  uint64_t directory_nodes;   // inner nodes read on the way down
+  uint64_t directory_splits;  // leaves and inner nodes split by inserts
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+} counters;
+
+#define COUNT(counter, n) __atomic_add_fetch(&counters.counter, (n), __ATOMIC_RELAXED)
+#else
+#define COUNT(counter, n)
+#endif
+
+// spans around the hot paths, to see where a slow command spends its time. SPAN(name)
+// begins a span that ends when the enclosing block is left, on any return. while a
+// profile is written (see profile()) the spans go into it as Chrome trace events. with
+// sys/sdt.h they are also the USDT probes mfs:span__begin and mfs:span__end, with the
+// span name as argument, for perf and bpftrace. otherwise a span is a single branch
+#ifndef DTRACE_PROBE1
+#define DTRACE_PROBE1(provider, name, arg)
+#endif
+
+FILE *profile_file = NULL;
+char profile_name[256];
+struct timespec profile_start;
+
+// writes a begin (B) or end (E) event of the calling thread to the profile
+void spanEvent(const char *name, char phase)
+{
+  static __thread long tid = 0;
+  if(tid == 0)
+  {
+    tid = syscall(SYS_gettid);
+  }
 
-#define MAX_NUM_ARGUMENTS 11 // Mav shell only supports four arguments
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double ts = (now.tv_sec - profile_start.tv_sec) * 1e6
+    + (now.tv_nsec - profile_start.tv_nsec) / 1e3;
+  fprintf(profile_file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld},\n",
+    name, phase, ts, (int)getpid(), tid);
+}
 
-// keep us from being contiguous
-int32_t findFreeInode()
+static inline const char *spanBegin(const char *name)
 {
-  for(int i = 0; i < MAX_NUM_FILES; i++)
+  DTRACE_PROBE1(mfs, span__begin, name);
+  if(__builtin_expect(profile_file != NULL, 0))
   {
-    if(free_inodes[i])
-    {
-      free_inodes[i] = 0;
-      return i;
-    }
+    spanEvent(name, 'B');
   }
-  return -1;
+  return name;
 }
 
-int32_t findFreeBlock()
+static inline void spanEnd(const char **name)
 {
-  for(int i = 0; i < NUM_BLOCKS; i++)
+  DTRACE_PROBE1(mfs, span__end, *name);
+  if(__builtin_expect(profile_file != NULL, 0))
   {
-    if(free_blocks[i] == 1)
-    {
-      free_blocks[i] = 0;
-      return i + FIRST_DATA_BLOCK;
-    }
+    spanEvent(*name, 'E');
   }
-
-  return -1;
 }
 
-int32_t findFreeInodeBlock(int32_t inode)
+#define SPAN(name) const char *span_##name __attribute__((cleanup(spanEnd))) = spanBegin(#name)
+
+// finishes the profile, closing the array of events
+void profileStop()
 {
-  for(int i = 0; i < BLOCKS_PER_FILE; i++)
+  if(profile_file == NULL)
   {
-    if(inodes[inode].blocks[i] == -1)
-    {
-
-      return i;
-    }
+    return;
   }
 
-  return -1;
+  fprintf(profile_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+    "\"args\":{\"name\":\"%s\"}}\n]\n", (int)getpid(), program_invocation_short_name);
+  fclose(profile_file);
+  profile_file = NULL;
 }
 
-// finds the given file and sets the file to not in use and
-// as well as the associated inode and blocks with it
-void delete(char *filename)
+// starts writing the spans to filename, replacing a profile written before.
+// returns false if the file can't be created
+bool profileStart(char *filename)
 {
-  int32_t index_found = -1;
-  int32_t inode_index = -1;
+  static bool registered = false;
+  profileStop();
 
-  // Loops over entire directory until it finds the file and checks that
-  // file is not read-only and that the file is in use 
-  for(int i = 0; i < MAX_NUM_FILES; i++)
+  FILE *file = fopen(filename, "w");
+  if(file == NULL)
   {
-    if(strcmp(directory[i].name, filename) == 0 
-    && !inodes[directory[i].inode].readonly && directory[i].inUse)
-    {
-      index_found = i;
-      inode_index = directory[i].inode;
-      
-      directory[i].inUse = false;
-      inodes[inode_index].inUse = false;
-    }
-    //message if file is read only and exists
-    else if(strcmp(directory[i].name, filename) == 0 
-    && inodes[directory[i].inode].readonly && directory[i].inUse)
-    {
-      printf("File is labeled under READ ONLY, unable to delete\n");
-      return;
-    }
+    return false;
   }
 
-  // The file is not found in the directory
-  if(index_found == -1)
+  // a big buffer so writing the events takes little of the time they measure, the
+  // rest is written when profiling stops or mfs exits
+  setvbuf(file, NULL, _IOFBF, 1 << 20);
+  fprintf(file, "[\n");
+  snprintf(profile_name, sizeof(profile_name), "%s", filename);
+  clock_gettime(CLOCK_MONOTONIC, &profile_start);
+  profile_file = file;
+
+  if(!registered)
   {
-    printf("ERROR: File not found.\n");
-    return;
+    atexit(profileStop);
+    registered = true;
   }
-  
-  // Delete file by setting all blocks used by file to free
-  for(int i = 0; i < inodes[inode_index].block_length; i++)
+  return true;
+}
+
+// MFS_PROFILE=<file> profiles the whole run, for single commands and mfs-replay
+void profileFromEnvironment()
+{
+  char *filename = getenv("MFS_PROFILE");
+  if(filename != NULL && filename[0] != 0 && !profileStart(filename))
   {
-    // the index substracts the offset mapping it back to the array of free_blocks
-    free_blocks[inodes[inode_index].blocks[i] - FIRST_DATA_BLOCK] = 1;
+    fprintf(stderr, "ERROR: Could not open %s for writing.\n", filename);
   }
 }
 
-// finds the given file and sets the file to in use and
-// as well as the associated inode and blocks with it
-void undelete(char* filename)
+// profile <file> writes the spans of the commands that follow to file, profile off
+// finishes it and profile alone tells whether a profile is written
+void profile(char **token, int token_count)
 {
-  int32_t index_found = -1;
-  int32_t inode_index = -1;
-
-  for(int i = 0; i < MAX_NUM_FILES; i++)  //looks for the file name
+  if(token_count == 1 || token[1] == NULL)
   {
-    if(strcmp(directory[i].name, filename) == 0)  //file exists
+    if(profile_file != NULL)
     {
-      if(directory[i].inUse)  //notify if the file wasn't deleted
-      {
-        printf("File %s exists\n", filename);
-      }
-      else  //flip the deleted file back to inuse and it's inode back as well
-      {
-        directory[i].inUse = true;
-        inodes[directory[i].inode].inUse = true;
-        printf("\"%s\" recovered\n", filename); //notify user of success
-      }
-      index_found = i;
-      inode_index = directory[i].inode; //save index
+      fprintf(output, "Profiling to %s.\n", profile_name);
     }
-  }
-
-  if(index_found == -1) //notify user if the file doesn't exist
-  {
-    printf("ERROR: File not found.\n");
-  }
-  else  //if the file is found and was not in use, then flip the file blocks to in use
-  {
-    for(int k = 0; k < inodes[inode_index].block_length; k++)
+    else
     {
-      free_blocks[inodes[inode_index].blocks[k] - FIRST_DATA_BLOCK] = 0;
+      fprintf(output, "Not profiling.\n");
     }
+    return;
   }
-}
-
-// initialize all variables with default valuess
-void init()
-{
-  directory = (struct _directoryEntry*)&data[0][0];
-  inodes = (struct inode*)&data[20][0]; 
-  free_blocks = (uint8_t*)&data[1000][0];
-  free_inodes = (uint8_t*)&data[19][0];
-
-  memset(image_name, 0, 64);
 
-  for(int i = 0; i < MAX_NUM_FILES; i++)
+  if(token_count != 2)
   {
-    directory[i].inUse = false;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
-    memset(directory[i].name, 0, 64);
-
-    for(int j = 0; j < NUM_BLOCKS; j++)
-    {
-      inodes[i].blocks[j] = -1;
-      inodes[i].inUse = false;
-      inodes[i].hidden = false;
-      inodes[i].readonly = false;
-      inodes[i].file_size = 0;
-    }
+    fprintf(output, "ERROR: usage: profile [file|off]\n");
+    return;
   }
 
-  for(int i = 0; i < NUM_BLOCKS; i++)
+  if(strcmp(token[1], "off") == 0)
   {
-    free_blocks[i] = 1;
+    profileStop();
+    return;
   }
-}
 
-// calculate the free space avaialable in the disk image
-uint32_t df()
-{
-  int count = 0;
-
-  for(int i = 0; i < NUM_BLOCKS; i++)
+  if(!profileStart(token[1]))
   {
-    if(free_blocks[i])
-      count++;
+    fprintf(output, "ERROR: Could not open %s for writing.\n", token[1]);
   }
-
-  return count * BLOCK_SIZE;
 }
 
-// create a file structure with the given name by the user
-void createfs(char *filename)
-{
-  init();
-  fp = fopen(filename, "w");
+// file commands share this lock and do their own locking below, commands that work on
+// the image as a whole (open, close, savefs, ...) take it exclusively
+pthread_rwlock_t image_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-  strncpy(image_name, filename, strlen(filename));
+// one reader/writer lock per inode, guarding its attributes, block list and data blocks
+pthread_rwlock_t inode_locks[MAX_NUM_FILES];
 
-  //Set all data in data array to 0
-  memset(data, 0, NUM_BLOCKS * BLOCK_SIZE);
-  image_open = true;
+// guards the shape of the directory tree. lookups, scans and changes that stay inside
+// one leaf share it, an insert that splits a leaf takes it exclusively
+pthread_rwlock_t directory_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-  //Initialize the entire directory
-  for(int i = 0; i < MAX_NUM_FILES; i++)
-  {
-    directory[i].inUse = false;
-    directory[i].inode = -1;
-    free_inodes[i] = 1;
-    memset(directory[i].name, 0, 64);
+// the leaves of the tree are locked through these, picked by block number, so files in
+// different leaves are added and deleted in parallel. a leaf lock is taken holding the
+// directory lock and before an inode lock, and a thread holds at most one of them
+#define LEAF_LOCKS 64
+pthread_rwlock_t leaf_locks[LEAF_LOCKS];
 
-    for(int j = 0; j < NUM_BLOCKS; j++)
-    {
-      inodes[i].blocks[j] = -1;
-      inodes[i].inUse = false;
-      inodes[i].hidden = false;
-      inodes[i].readonly = false;
-      inodes[i].file_size = 0;
-    }
-  }
+// guards the creation time index and the names and times kept with it, taken last
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-  // set all blocks as "free"
-  for(int i = 0; i < NUM_BLOCKS; i++)
-  {
-    free_blocks[i] = 1;
-  }
+#define WHITESPACE " \t\n" // We want to split our command line up into tokens
+                           // so we need to define what delimits our tokens.
+                           // In this case  white space
+                           // will separate the tokens on our command line
 
+#define MAX_COMMAND_SIZE 255 // The maximum command-line size
 
-  fclose(fp);
-}
+#define MAX_NUM_ARGUMENTS 11 // Mav shell only supports four arguments
 
-// save the contents of the disk image to the file
-void savefs()
+// sets up the inode locks, called once at start up
+void init_locks()
 {
-  if(image_open == 0)
+  for(int i = 0; i < MAX_NUM_FILES; i++)
   {
-    printf("ERROR: Disk image is not open.\n");
-    return;
+    pthread_rwlock_init(&inode_locks[i], NULL);
   }
-  
-  fp = fopen(image_name, "w");
 
-  fwrite(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-
-  fclose(fp);
+  for(int i = 0; i < LEAF_LOCKS; i++)
+  {
+    pthread_rwlock_init(&leaf_locks[i], NULL);
+  }
 }
 
-// open the file structure specified by the user
-void openfs(char *filename)
+#define URING_DEPTH 64            // reads or writes kept in flight
+#define IO_CHUNK (256 * BLOCK_SIZE) // transfer size for whole image loads and saves
+
+// one transfer between image memory and a host file
+struct io_request
 {
-  init();
-  fp = fopen(filename, "r");
+  uint8_t *buffer;
+  size_t length;
+  off_t offset;
+};
 
-  if(fp == NULL)
-  {
-    printf("ERROR: File could not be openned.\n");
-    return;
-  }
+// io_uring instance of a thread. fd is -1 until the first batch sets it up and -2 if
+// io_uring isn't available, in which case all batches go through pread/pwrite
+struct uring
+{
+  int fd;
+  bool fixed;       // the data array is registered as fixed buffer 0
+  int generation;   // data_generation the registration was last attempted for
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+};
 
-  strncpy(image_name, filename, strlen(filename));
+__thread struct uring uring = { .fd = -1, .generation = -1 };
 
-  fread(&data[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
+// bumped whenever the pages behind data[] are dropped. a registered buffer keeps the
+// old pages pinned, so each ring registers data[] again once it sees a new generation
+int data_generation = 0;
 
-  image_open = true;
+// images open in the background besides the current one
+int parked_images = 0;
 
-  fclose(fp);
-}
+// defined with the block cache below
+extern bool cache_mode;
 
-// close the current openned file structure, if there is one open
-void closefs()
+// sets up the thread's io_uring and maps its rings. returns false if the kernel
+// doesn't support io_uring
+bool uring_setup()
 {
-  if(image_open == false)
+  if(uring.fd != -1)
   {
-    printf("ERROR: Disk image is not open.\n");
-    return;
+    return uring.fd >= 0;
   }
-  
-  //fclose(fp);
-  
-  image_open = false;
-  memset(image_name, 0, 64);
-}
 
-// lists the file with the creation time, and size. also will print out
-// if the file is hidden or read only if the flag is set
-void list(char* first, char* second)
-{
-  bool not_found = true;
-  bool h = false;
-  bool a = false;
-  printf("%-65s%-15s%-25s", "Directory List", "Byte Size", "Time");
-  //Check if user wants to see hidden files
-  if(strcmp(first, "-h") == 0  || strcmp(second, "-h") == 0)
-  {
-    h = true;
-  }
-  //Check if user wants to see attributes of file
-  if(strcmp(first, "-a") == 0  || strcmp(second, "-a") == 0)
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+  if(fd < 0)
   {
-    a = true;
-    printf("%-15s%-15s", "Hidden", "Read Only");
+    uring.fd = -2;
+    return false;
   }
-  printf("\n");
-  
-  for(int i = 0; i < MAX_NUM_FILES; i++)
-  {
-    if((directory[i].inUse && !inodes[directory[i].inode].hidden) || (directory[i].inUse && h))
-    {
-      not_found = false;
-      char filename[65];
-      memset(filename, 0, 65);
-      strncpy(filename, directory[i].name, strlen(directory[i].name));
-      //Get the size of the file
-      int size = inodes[directory[i].inode].file_size;
-      time_t filetime = inodes[directory[i].inode].creation_time;
-      char str_time[120];
-      //Formats creation time to string from time_t
-      strftime(str_time, sizeof(str_time),"%Y-%m-%d %H:%M:%S",localtime(&filetime));
-      printf("%-65s%-15d%-25s", filename, size, str_time);
 
-      //If user requests attributes, display 1 indicating it hidden or read-only, otherwise 0
-      if(a)
-      {
-        if(inodes[directory[i].inode].hidden)
-        {
-          printf("%-15d", 1);
-        }
-        else
-        {
-          printf("%-15d", 0);
-        }
-        if(inodes[directory[i].inode].readonly)
-        {
-          printf("%-15d", 1);
-        }
-        else
-        {
-          printf("%-15d", 0);
-        }
-      }
-      printf("\n");
-    }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
   }
 
-  if(not_found)
+  uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_SQ_RING);
+  uint8_t *cq = sq;
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
   {
-    printf("No files found.\n");
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_CQ_RING);
   }
-}
+  void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
 
-// inserts the file specified by the user into the disk image
-void insert(char *filename)
-{
-  // verify the filename isn't NULL
-  if(filename == NULL)
+  if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
   {
-    printf("ERROR: Unspecified file.\n");
-    return;
+    close(fd);
+    uring.fd = -2;
+    return false;
   }
 
-  // verify the file exists
-  struct stat buf;
-  int ret = stat(filename, &buf);
+  uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  uring.sqes = (struct io_uring_sqe *)sqes;
+
+  uring.fd = fd;
+  return true;
+}
 
-  if(ret == -1)
+// registers the image memory as a fixed buffer when the memlock limit allows it, which
+// saves pinning the pages on every request. in cache mode it stays unregistered, the
+// registration would fault all of data[] into memory, and so it does while several
+// images are open, each of them would end up fully in memory
+void uring_register()
+{
+  int generation = __atomic_load_n(&data_generation, __ATOMIC_ACQUIRE);
+  if(uring.generation == generation)
   {
-    printf("ERROR: File does not exist.\n");
     return;
   }
 
-  // checks to see if the filename length is 64 or less
-  if(strlen(filename) > 64)
+  if(uring.fixed)
   {
-    printf("ERROR: Filename is too large.\n");
-    return;
+    syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    uring.fixed = false;
   }
 
-  // verify the file isn't too big
-  if(buf.st_size > MAX_FILE_SIZE)
+  if(!cache_mode && parked_images == 0)
   {
-    printf("ERROR: File is too large.\n");
-    return;
+    struct iovec image_memory = { &data[0][0], IMAGE_SIZE };
+    uring.fixed = syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS,
+      &image_memory, 1) == 0;
   }
 
-  // verify there is enough space
-  if(buf.st_size > df())
-  {
-    printf("ERROR: Not enough free disk space.\n");
-    return;
-  }
+  uring.generation = generation;
+}
 
-  // find an empty directory entry
-  int directory_entry = -1;
-  for(int i = 0; i < MAX_NUM_FILES; i++)
+// finishes a request (or the part of it the kernel didn't do) with plain pread/pwrite.
+// returns false on an error or if a read hits the end of the file early
+bool io_sync(int fd, struct io_request *request, size_t done, bool write)
+{
+  while(done < request->length)
   {
-    if(directory[i].inUse == false)
+    ssize_t bytes;
+    if(write)
     {
-      directory_entry = i;
-      break;
+      bytes = pwrite(fd, request->buffer + done, request->length - done,
+        request->offset + done);
+    }
+    else
+    {
+      bytes = pread(fd, request->buffer + done, request->length - done,
+        request->offset + done);
     }
-  }
 
-  if(directory_entry == -1)
-  {
-    printf("ERROR: Could not find a free directory entry.\n");
-    return;
+    if(bytes <= 0)
+    {
+      return false;
+    }
+    done += bytes;
   }
 
-  // open the input file read-only 
-  FILE *ifp = fopen (filename, "r" ); 
-
-  // declaring the time_t variable to store current time
-  time_t now;
-
-  // get the current time and format it
-  time(&now);
-  char str_time[120];
-  strftime(str_time, sizeof(str_time),"%Y-%m-%d %H:%M:%S",localtime(&now));
-
-  // store the file size to keep track of how much is left
-  int32_t copy_size = buf.st_size;
-
-  // use an offset to determine where to start copying 
-  int32_t offset = 0;               
-
-  // store the block index of the next free block
-  int32_t block_index = -1;
+  return true;
+}
 
-  // find a free inode
-  int32_t inode_index = findFreeInode();
+// runs a batch of reads (or writes) against fd. with io_uring up to URING_DEPTH requests
+// are in flight at once and new ones are submitted together with waiting for the next
+// completion, otherwise the requests are done one after the other.
+// returns 0 if every request completed in full, -1 otherwise
+int io_batch(int fd, struct io_request *requests, int count, bool write)
+{
+  SPAN(io_batch);
+  bool ok = true;
 
-  if(inode_index == -1)
+  if(!uring_setup())
   {
-    printf("ERROR: Can not find free inode.\n");
-    return;
+    for(int i = 0; i < count; i++)
+    {
+      ok = io_sync(fd, &requests[i], 0, write) && ok;
+    }
+    return ok ? 0 : -1;
   }
 
-  // place the file info in to directory
-  directory[directory_entry].inUse = 1;
-  directory[directory_entry].inode = inode_index;
-
-  // set the filename to the one specified by the user
-  memset(directory[directory_entry].name, 0, 64);
-  strncpy(directory[directory_entry].name, filename, strlen(filename));
+  uring_register();
 
-  inodes[inode_index].file_size = buf.st_size;
-  inodes[inode_index].block_length = 0;
-  inodes[inode_index].creation_time = now;
-  inodes[inode_index].hidden = false;
-  inodes[inode_index].readonly = false;
+  int next = 0;         // requests put in the submission queue
+  int queued = 0;       // in the submission queue, not taken by the kernel yet
+  int in_flight = 0;    // submitted, their completions not reaped yet
+  bool broken = false;  // the ring can't be entered, only wait for what's in flight
 
-  // copy_size is initialized to the size of the input file so each loop iteration we
-  // will copy BLOCK_SIZE bytes from the file then reduce our copy_size counter by
-  // BLOCK_SIZE number of bytes. When copy_size is less than or equal to zero we know
-  // we have copied all the data from the input file.
-  while(copy_size > 0)
+  while(next < count || queued > 0 || in_flight > 0)
   {
-    // Index into the input file by offset number of bytes.  Initially offset is set to
-    // zero so we copy BLOCK_SIZE number of bytes from the front of the file.  We 
-    // then increase the offset by BLOCK_SIZE and continue the process.  This will
-    // make us copy from offsets 0, BLOCK_SIZE, 2*BLOCK_SIZE, 3*BLOCK_SIZE, etc.
-    fseek( ifp, offset, SEEK_SET );
-
-    // find a free block
-    block_index = findFreeBlock();
-
-    if( block_index == -1)
+    // fill the submission queue
+    unsigned tail = *uring.sq_tail;
+    while(next < count && queued + in_flight < URING_DEPTH)
     {
-      printf("ERROR: Can not find a free block.\n");
-      return;
+      struct io_request *request = &requests[next];
+      unsigned index = tail & *uring.sq_mask;
+      struct io_uring_sqe *sqe = &uring.sqes[index];
+      bool fixed = uring.fixed && request->buffer >= &data[0][0]
+        && request->buffer + request->length <= &data[0][0] + IMAGE_SIZE;
+
+      memset(sqe, 0, sizeof(*sqe));
+      if(write)
+      {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      }
+      else
+      {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      }
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t)request->buffer;
+      sqe->len = request->length;
+      sqe->off = request->offset;
+      sqe->buf_index = 0;
+      sqe->user_data = next;
+
+      uring.sq_array[index] = index;
+      tail++;
+      next++;
+      queued++;
     }
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
 
-    // increases the block length
-    inodes[inode_index].block_length += 1;
-
-    // overrides the data in the block found to 0
-    memset(data[block_index], 0, BLOCK_SIZE);
-
-    // reads the data from the input file and sets it in the block found
-    int bytes  = fread(data[block_index], BLOCK_SIZE, 1, ifp );
-
-    // save the block in the inode
-    int32_t inode_block = findFreeInodeBlock(inode_index);
-    inodes[inode_index].blocks[inode_block] = block_index;
-
-    // If bytes == 0 and we haven't reached the end of the file then something is 
-    // wrong. If 0 is returned and we also have the EOF flag set then that is OK.
-    // It means we've reached the end of our input file.
-    if( bytes == 0 && !feof( ifp ) )
+    // submit what is queued and wait for at least one request to finish. what a short
+    // submit, an interrupt or a busy ring leaves queued goes with the next call
+    if(!broken)
     {
-      printf("ERROR: An error occured reading from the input file.\n");
-      return;
+      int ret = syscall(__NR_io_uring_enter, uring.fd, queued, 1, IORING_ENTER_GETEVENTS,
+        NULL, 0);
+      if(ret >= 0)
+      {
+        queued -= ret;
+        in_flight += ret;
+      }
+      else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      {
+        // take back the entries that were never submitted, they point into this batch.
+        // the requests in flight still complete into our buffers, so wait for them
+        __atomic_store_n(uring.sq_tail, tail - queued, __ATOMIC_RELEASE);
+        queued = 0;
+        next = count;
+        ok = false;
+        broken = true;
+      }
+    }
+    else
+    {
+      // completions still arrive in the ring, the kernel posts them on any syscall
+      sched_yield();
     }
 
-    // Clear the EOF file flag.
-    clearerr( ifp );
-
-    // Reduce copy_size by the BLOCK_SIZE bytes.
-    copy_size -= BLOCK_SIZE;
-    
-    // Increase the offset into our input file by BLOCK_SIZE.  This will allow
-    // the fseek at the top of the loop to position us to the correct spot.
-    offset += BLOCK_SIZE;
-  }
-
-  // We are done copying from the input file so close it out.
-  fclose( ifp );
-}
+    // reap the completions, short transfers are finished synchronously
+    unsigned head = *uring.cq_head;
+    while(head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+      struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+      struct io_request *request = &requests[cqe->user_data];
 
-// retrieves the file specified by the user from the disk image and places
-// the file in the current working directory of the user
-void retrieve(char *filename)
-{
-  bool not_found = true;
-  int directory_index = -1;
+      if(cqe->res < 0)
+      {
+        ok = false;
+      }
+      else if((size_t)cqe->res < request->length)
+      {
+        ok = io_sync(fd, request, cqe->res, write) && ok;
+      }
 
-  for(int i = 0; i < MAX_NUM_FILES; i++)
-  {
-    if(strcmp(directory[i].name, filename) == 0 && directory[i].inUse)
-    {
-      not_found = false;
-      directory_index = i;
-      break;
+      head++;
+      in_flight--;
     }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
   }
 
-  if(not_found)
+  // the thread's next batches go through pread/pwrite instead of a ring that failed
+  if(broken)
   {
-    printf("ERROR: File does not exist in the disk image.\n");
-    return;
+    close(uring.fd);
+    uring.fd = -2;
   }
 
-  printf("File found.\n");
+  return ok ? 0 : -1;
+}
 
-  // Now, open the output file that we are going to write the data to.
-  FILE *ofp;
-  ofp = fopen(filename, "w");
+#define BLOCK_READ 0    // the block is only read
+#define BLOCK_WRITE 1   // the block is changed and has to be written back
+#define BLOCK_NEW 2     // the block is overwritten as a whole, no need to read it first
 
-  if( ofp == NULL )
-  {
-    printf("Could not open output file: %s\n", filename );
-    perror("Opening output file returned");
-    return;
-  }
+#define MIN_CACHE_FRAMES 64
 
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  int starting_inode = directory[directory_index].inode;
-  int copy_size   = inodes[starting_inode].file_size;
-  int block_index = 0;
-  int offset      = 0;
+// a cache frame holding one data block of an image opened in cache mode
+struct frame
+{
+  int32_t block;      // block held by the frame or -1
+  int pins;           // users currently holding the block
+  bool dirty;         // changed since it was read from the image file
+  bool referenced;    // used since the clock hand last passed, gives a second chance
+  uint8_t *buffer;
+};
 
-  int i = 0;
-  // int block_length = inodes[starting_inode].block_length;
+// when an image is opened with a cache size only the metadata in front of
+// FIRST_DATA_BLOCK is kept in data[]. data blocks are read from image_fd into a fixed
+// number of frames on demand, evicted in CLOCK order and written back when dirty
+bool cache_mode = false;
+int image_fd = -1;
+struct frame *frames = NULL;
+uint8_t *frame_memory = NULL;
+int num_frames = 0;
+int clock_hand = 0;
 
-  printf("Writing %d bytes to %s\n", copy_size, filename );
+// the frame each block is cached in, -1 if it isn't
+int32_t *frame_of = NULL;
 
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-  // our stored data to the file fp, then we will increment the offset into the file we are writing
-  // to. On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just
-  // copy how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on
-  // the last iteration we'd end up with gibberish at the end of our file. 
-  while( copy_size > 0 )
-  { 
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
 
-    int num_bytes;
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-    // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-    // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-    // end up with garbage at the end of the file.
-    if( copy_size < BLOCK_SIZE )
-    {
-      num_bytes = copy_size;
-    }
-    else 
-    {
-      num_bytes = BLOCK_SIZE;
-    }
+// size of the pages behind the image memory, HUGE_PAGE_SIZE when it got huge pages
+size_t image_page = 0;
 
-    block_index = inodes[starting_inode].blocks[i++];
+// size rounded up to whole huge pages
+size_t hugeSize(size_t size)
+{
+  return (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+}
 
-    // Write num_bytes number of bytes from our data array into our output file.
-    fwrite( data[block_index], num_bytes, 1, ofp ); 
+// maps hugeSize(size) bytes of zeroed memory on huge pages, so scans over it don't
+// miss the TLB every 4KB. it comes from the hugetlb pool when that has enough pages
+// reserved, otherwise it is aligned to a huge page and transparent huge pages are
+// asked for. without either it is ordinary memory, only reserved until it is used.
+// sets page to the size of the pages it got. free it with munmap(hugeSize(size))
+void *hugeMemory(size_t size, size_t *page)
+{
+  size = hugeSize(size);
+  uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if(memory != MAP_FAILED)
+  {
+    *page = HUGE_PAGE_SIZE;
+    return memory;
+  }
 
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= BLOCK_SIZE;
-    offset    += BLOCK_SIZE;
+  // a huge page more than needed, the ends are trimmed to align it
+  memory = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(memory == MAP_FAILED)
+  {
+    return NULL;
+  }
 
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek( ofp, offset, SEEK_SET );
+  uint8_t *aligned = (uint8_t *)hugeSize((uintptr_t)memory);
+  if(aligned > memory)
+  {
+    munmap(memory, aligned - memory);
   }
+  munmap(aligned + size, memory + HUGE_PAGE_SIZE - aligned);
 
-  // Close the output file, we're done. 
-  fclose( ofp );
+  *page = madvise(aligned, size, MADV_HUGEPAGE) == 0 ? HUGE_PAGE_SIZE
+    : (size_t)sysconf(_SC_PAGESIZE);
+  return aligned;
 }
 
-// works similar to retrive function but with a designated output file
-void retrieve_to_file(char *inFilename, char *outFilename)
+// zeroes length bytes of the image memory from offset without touching them. whole
+// pages are handed back to the kernel and come back as zero pages when used, only the
+// partial pages at the ends are cleared. with huge pages that keeps the ones holding
+// the metadata whole. memory the kernel won't drop is cleared as well
+void dropImageMemory(size_t offset, size_t length)
 {
-  bool not_found = true;
-  int directory_index = -1;
-  for(int i = 0; i < MAX_NUM_FILES; i++)
+  uintptr_t page = image_page;
+  uint8_t *first = &data[0][0] + offset;
+  uint8_t *last = first + length;
+  uint8_t *start = (uint8_t *)(((uintptr_t)first + page - 1) & ~(page - 1));
+  uint8_t *end = (uint8_t *)((uintptr_t)last & ~(page - 1));
+
+  if(start < end)
   {
-    if(strcmp(directory[i].name, inFilename) == 0 && directory[i].inUse)
+    memset(first, 0, start - first);
+    if(madvise(start, end - start, MADV_DONTNEED) != 0)
     {
-      not_found = false;
-      directory_index = i;
-      break;
+      memset(start, 0, end - start);
     }
+    memset(end, 0, last - end);
   }
-
-  if(not_found)
+  else
   {
-    printf("ERROR: File does not exist in the disk image.\n");
-    return;
+    memset(first, 0, length);
   }
 
-  printf("File found.\n");
-
-  // Now, open the output file that we are going to write the data to.
-  FILE *ofp;
-  ofp = fopen(outFilename, "w");
+  // a registered io_uring buffer still pins the dropped pages
+  __atomic_add_fetch(&data_generation, 1, __ATOMIC_RELEASE);
+}
 
-  if( ofp == NULL )
+// sets up a cache of size_kb kilobytes for the image open on fd
+void cache_open(int fd, int size_kb)
+{
+  num_frames = size_kb * 1024 / BLOCK_SIZE;
+  if(num_frames < MIN_CACHE_FRAMES)
   {
-    printf("Could not open output file: %s\n", outFilename );
-    perror("Opening output file returned");
-    return;
+    num_frames = MIN_CACHE_FRAMES;
   }
 
-  // Initialize our offsets and pointers just we did above when reading from the file.
-  int starting_inode = directory[directory_index].inode;
-  int copy_size   = inodes[starting_inode].file_size;
-  int block_index = 0;
-  int offset      = 0;
-
-  int i = 0;
-  // int block_length = inodes[starting_inode].block_length;
-
-  printf("Writing %d bytes to %s\n", copy_size, outFilename );
-
-  // Using copy_size as a count to determine when we've copied enough bytes to the output file.
-  // Each time through the loop, except the last time, we will copy BLOCK_SIZE number of bytes from
-  // our stored data to the file fp, then we will increment the offset into the file we are writing
-  // to. On the last iteration of the loop, instead of copying BLOCK_SIZE number of bytes we just
-  // copy how ever much is remaining ( copy_size % BLOCK_SIZE ).  If we just copied BLOCK_SIZE on
-  // the last iteration we'd end up with gibberish at the end of our file. 
-  while( copy_size > 0 )
-  { 
-
-    int num_bytes;
-
-    // If the remaining number of bytes we need to copy is less than BLOCK_SIZE then
-    // only copy the amount that remains. If we copied BLOCK_SIZE number of bytes we'd
-    // end up with garbage at the end of the file.
-    if( copy_size < BLOCK_SIZE )
-    {
-      num_bytes = copy_size;
-    }
-    else 
-    {
-      num_bytes = BLOCK_SIZE;
-    }
+  frames = (struct frame *)calloc(num_frames, sizeof(struct frame));
+  size_t page;
+  frame_memory = (uint8_t *)hugeMemory((size_t)num_frames * BLOCK_SIZE, &page);
+  for(int i = 0; i < num_frames; i++)
+  {
+    frames[i].block = -1;
+    frames[i].buffer = frame_memory + (size_t)i * BLOCK_SIZE;
+  }
 
-    block_index = inodes[starting_inode].blocks[i++];
+  frame_of = (int32_t *)malloc(NUM_BLOCKS * sizeof(int32_t));
+  for(int i = 0; i < NUM_BLOCKS; i++)
+  {
+    frame_of[i] = -1;
+  }
 
-    // Write num_bytes number of bytes from our data array into our output file.
-    fwrite( data[block_index], num_bytes, 1, ofp ); 
+  // hand the memory behind the data blocks of a previous image back to the kernel,
+  // in cache mode the data region of data[] is never touched
+  dropImageMemory((size_t)FIRST_DATA_BLOCK * BLOCK_SIZE, (size_t)NUM_DATA_BLOCKS * BLOCK_SIZE);
 
-    // Reduce the amount of bytes remaining to copy, increase the offset into the file
-    // and increment the block_index to move us to the next data block.
-    copy_size -= BLOCK_SIZE;
-    offset    += BLOCK_SIZE;
+  clock_hand = 0;
+  image_fd = fd;
+  cache_mode = true;
+}
 
-    // Since we've copied from the point pointed to by our current file pointer, increment
-    // offset number of bytes so we will be ready to copy to the next area of our output file.
-    fseek( ofp, offset, SEEK_SET );
+// drops the cache without writing anything back, like closing an unsaved image
+void cache_close()
+{
+  if(!cache_mode)
+  {
+    return;
   }
 
-  // Close the output file, we're done. 
-  fclose( ofp );
-
+  close(image_fd);
+  free(frames);
+  munmap(frame_memory, hugeSize((size_t)num_frames * BLOCK_SIZE));
+  free(frame_of);
+  frames = NULL;
+  frame_memory = NULL;
+  frame_of = NULL;
+  image_fd = -1;
+  cache_mode = false;
+  __atomic_add_fetch(&data_generation, 1, __ATOMIC_RELEASE);
 }
 
-//reads a file byte by byte starting at the given byte and ending after
-//traversing the provided number of bytes
-void readfile(char* filename, int start, int numbytes)
+// writes a dirty frame back to its block in the image file
+void cache_write_back(struct frame *f)
 {
-  int32_t inode_index = -1;
-  int32_t blocknum;
-
-  if(filename == NULL)    //checks filename for NULL input
+  struct io_request request = { f->buffer, BLOCK_SIZE, (off_t)f->block * BLOCK_SIZE };
+  if(!io_sync(image_fd, &request, 0, true))
   {
-    printf("ERROR: No filename provided.\n");  //print error if filename not given
+    perror("mfs: writing back a cached block failed");
   }
-  else
+  f->dirty = false;
+}
+
+// finds a frame for a new block with the clock hand, skipping pinned frames and
+// giving referenced ones a second chance. the victim is written back if it's dirty.
+// waits for a frame to be unpinned if all of them are in use. needs cache_lock held
+int cache_victim()
+{
+  while(1)
   {
-    for(int i = 0; i < MAX_NUM_FILES; i++)  //looks for inode of file and saves
+    for(int n = 0; n < 2 * num_frames; n++)
     {
-      if(strcmp(directory[i].name, filename) == 0 && directory[i].inUse)
+      struct frame *f = &frames[clock_hand];
+      int index = clock_hand;
+      clock_hand = (clock_hand + 1) % num_frames;
+
+      if(f->pins > 0)
       {
-        inode_index = directory[i].inode; //saves the inode index
+        continue;
       }
-    }
 
-    if(inode_index != -1)   //if file exists, reads
-    {
-      blocknum = start/BLOCK_SIZE;
-      //checks if byte input is within file's used blocks, error message if outside
-      if(inodes[inode_index].block_length - 1 < blocknum)
+      if(f->referenced)
       {
-        printf("ERROR: Start byte outside of file range.\n");
+        f->referenced = false;
+        continue;
       }
-      else
+
+      if(f->block != -1)
       {
-        int startbyte = start % BLOCK_SIZE; //byte number inside block
-        int traverse = numbytes / BLOCK_SIZE + blocknum;  //last block
-        int remainingbytes; //remaining bytes, not whole blocks
-        //determines if end byte passes file end
-        if(traverse >= inodes[inode_index].block_length)
-        {
-          traverse = inodes[inode_index].block_length -1;
-          remainingbytes = BLOCK_SIZE;  //only reaches end of file, no surpassing
-        }
-        else
+        if(f->dirty)
         {
-          remainingbytes = numbytes % BLOCK_SIZE; //end byte < end file
-        }
-        int currblock;
-        printf("File %s (in hexadec), from byte %d for %d bytes::\n", filename, start, numbytes);
-        for(int k = blocknum; k < traverse; k++)    //iterates through every byte within bounds
-        {
-          currblock = inodes[inode_index].blocks[k];
-          for(int j = startbyte; j < BLOCK_SIZE; j++)
-          {
-            if(data[currblock][j] != 0)
-            {
-              printf("%02hhx", data[currblock][j]);   //prints every byte in hexadec
-            }
-          }
-          startbyte = 0;  //resets the start byte after the first block
-        }
-        currblock = inodes[inode_index].blocks[traverse]; //the final "incomplete" block
-        for(int m = startbyte; m < remainingbytes; m++)
-        {
-          if(data[currblock][m] != 0)
-          {
-            printf("%02hhx", data[currblock][m]);   //prints every byte in hexadec
-          }
+          cache_write_back(f);
         }
-        printf("\n----File Reading finished----\n");  //message to signal end
+        frame_of[f->block] = -1;
+        f->block = -1;
       }
+
+      return index;
     }
-    else
+
+    pthread_cond_wait(&cache_cond, &cache_lock);
+  }
+}
+
+// notes that count data blocks of a fully loaded image from block on changed, for the
+// next flush. wakes the flusher when the dirty threshold is reached
+void markDirty(int32_t block, int count)
+{
+  for(int32_t b = block - FIRST_DATA_BLOCK; b < block - FIRST_DATA_BLOCK + count; b++)
+  {
+    if(__atomic_load_n(&dirty_blocks[b], __ATOMIC_RELAXED) == 0
+      && __atomic_exchange_n(&dirty_blocks[b], 1, __ATOMIC_RELAXED) == 0
+      && __atomic_add_fetch(&dirty_count, 1, __ATOMIC_RELAXED) == flush_threshold)
     {
-      printf("ERROR: File not found.\n"); //file not found
+      pthread_mutex_lock(&flusher_mutex);
+      pthread_cond_signal(&flusher_cond);
+      pthread_mutex_unlock(&flusher_mutex);
     }
   }
 }
 
-//encrypts the given file using a XOR encryption and the given key
-void encrypt(char* filename, char* keystr, char which)
+// notes in the sync map that count data blocks from block on changed, for the next
+// sync-to. the map is part of the image, so it lasts until that sync however often the
+// image is saved and opened in between
+void markChanged(int32_t block, int count)
 {
-  int32_t inode_index = -1;
-  char key = keystr[0];
+  for(int32_t b = block - FIRST_DATA_BLOCK; b < block - FIRST_DATA_BLOCK + count; b++)
+  {
+    uint64_t bit = (uint64_t)1 << (b % 64);
+    if(!(__atomic_load_n(&sync_map[b / 64], __ATOMIC_RELAXED) & bit))
+    {
+      __atomic_fetch_or(&sync_map[b / 64], bit, __ATOMIC_RELAXED);
+    }
+  }
+}
 
-  if(filename == NULL)    //checks for NULL filename
+// returns the memory of a block and pins it until putBlock(). metadata blocks and all
+// blocks of a fully loaded image live in data[], in cache mode data blocks are looked
+// up in the cache and read from the image file on a miss. mode is one of BLOCK_READ,
+// BLOCK_WRITE or BLOCK_NEW
+uint8_t *getBlock(int32_t block, int mode)
+{
+  if(mode != BLOCK_READ && block >= FIRST_DATA_BLOCK)
   {
-    printf("ERROR: No filename provided.\n");
+    markChanged(block, 1);
+    if(!cache_mode)
+    {
+      markDirty(block, 1);
+    }
   }
-  else if( key >= 256)  //checks the size of the cipher
+
+  if(!cache_mode || block < FIRST_DATA_BLOCK)
   {
-    printf("ERROR: Cipher surpasses 256 bits.\n");
+    return data[block];
   }
-  else
+
+  pthread_mutex_lock(&cache_lock);
+
+  int index = frame_of[block];
+  if(index == -1)
   {
-    for(int i = 0; i < MAX_NUM_FILES; i++)  //looks for and retrieves file inode
+    COUNT(cache_misses, 1);
+    index = cache_victim();
+    struct frame *f = &frames[index];
+
+    if(mode == BLOCK_NEW)
     {
-      if(strcmp(directory[i].name, filename) == 0 && directory[i].inUse)
-      {
-        inode_index = directory[i].inode;
-      }
+      memset(f->buffer, 0, BLOCK_SIZE);
     }
-    if(inode_index != -1)   //if the file exists, data is transformed byte by byte
+    else
     {
-      int currblock;
-      for(int k = 0; k < inodes[inode_index].block_length; k++)
+      // blocks past the end of a short image file read as zeroes
+      ssize_t bytes = pread(image_fd, f->buffer, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+      if(bytes < BLOCK_SIZE)
       {
-        currblock = inodes[inode_index].blocks[k];
-        for(int j = 0; j < BLOCK_SIZE; j++)
-        {
-          if(data[currblock][j] != 0)
-          {
-            data[currblock][j] = data[currblock][j] ^ key;
-          }
-        }
-      }
-      if(which == 'e')    //checks which if statement called this function for print
-      {
-        printf("Encryption complete.\n");
-      }
-      else
-      {
-        printf("Decryption complete.\n");
+        memset(f->buffer + (bytes > 0 ? bytes : 0), 0, BLOCK_SIZE - (bytes > 0 ? bytes : 0));
       }
     }
-    else
-    {
-      printf("ERROR: File not found.\n");
-    }
+
+    f->block = block;
+    frame_of[block] = index;
+  }
+
+  else
+  {
+    COUNT(cache_hits, 1);
+  }
+
+  struct frame *f = &frames[index];
+  f->pins++;
+  f->referenced = true;
+  if(mode != BLOCK_READ)
+  {
+    f->dirty = true;
   }
+
+  pthread_mutex_unlock(&cache_lock);
+  return f->buffer;
 }
 
-//adds or subtracts an attribute from the file, 
-//depending on the attribute given
-void attribute(char* filename, char* attri)
+// copies a data block into buffer without giving it a frame of the cache: from its frame
+// if it is cached, from the image file otherwise. for passes over many blocks that would
+// push the blocks in use out of the cache
+void peekBlock(int32_t block, uint8_t *buffer)
 {
-  uint32_t inode_index = -1;
-  if(filename == NULL)  //handles the event of if a NULL value gets passed
+  pthread_mutex_lock(&cache_lock);
+  int index = frame_of[block];
+  ssize_t bytes = BLOCK_SIZE;
+  if(index != -1)
   {
-    printf("ERROR: No filename provided.\n");
+    memcpy(buffer, frames[index].buffer, BLOCK_SIZE);
   }
   else
   {
-    for(int i = 0; i < MAX_NUM_FILES; i++)    //attempts to find the file and saves the inode
-    {
-      if(strcmp(directory[i].name, filename) == 0 && directory[i].inUse)
-      {
-        inode_index = directory[i].inode; 
-      }
-    }
+    bytes = pread(image_fd, buffer, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&cache_lock);
 
-    if(inode_index != -1)   //if the index exists, flip appropriate flag accordingly
+  if(bytes < BLOCK_SIZE)
+  {
+    memset(buffer + (bytes > 0 ? bytes : 0), 0, BLOCK_SIZE - (bytes > 0 ? bytes : 0));
+  }
+}
+
+// unpins a block returned by getBlock()
+void putBlock(int32_t block)
+{
+  if(!cache_mode || block < FIRST_DATA_BLOCK)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  frames[frame_of[block]].pins--;
+  pthread_cond_broadcast(&cache_cond);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// makes a hole in the image file on fd for count blocks from block, the file system
+// takes their space back and they read as zeroes. only for blocks whose contents are
+// no longer needed. cached copies are marked clean so evicting them doesn't fill the
+// hole again. file systems without hole punching keep the old contents, which is fine
+void punchBlocks(int fd, int32_t block, int count)
+{
+  fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)block * BLOCK_SIZE,
+    (off_t)count * BLOCK_SIZE);
+
+  if(cache_mode && fd == image_fd)
+  {
+    pthread_mutex_lock(&cache_lock);
+    for(int32_t b = block; b < block + count; b++)
     {
-      if(attri[0] == '-' && attri[1] == 'h')
-      {
-        inodes[inode_index].hidden = false;
-      }
-      else if(attri[0] == '+' && attri[1] == 'h')
-      {
-        inodes[inode_index].hidden = true;
-      }
-      else if(attri[0] == '-' && attri[1] == 'r')
-      {
-        inodes[inode_index].readonly = false;
-      }
-      else if(attri[0] == '+' && attri[1] == 'r')
+      if(frame_of[b] != -1)
       {
-        inodes[inode_index].readonly = true;
+        frames[frame_of[b]].dirty = false;
       }
     }
-    else
-    {
-      printf("ERROR: File not found.\n");
-    }
+    pthread_mutex_unlock(&cache_lock);
   }
 }
 
-int main()
+// sequential readahead, loads the blocks that aren't cached yet with one preadv per
+// run of blocks that are consecutive in the image file instead of a read per miss
+void prefetchBlocks(int32_t *blocks, int count)
 {
-  char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
-
-  init();
-
-  while (1)
+  if(!cache_mode)
   {
-    // Print out the mfs prompt
-    printf("mfs> ");
+    return;
+  }
 
-    // Read the command from the commandline.  The
-    // maximum command that will be read is MAX_COMMAND_SIZE
-    // This while command will wait here until the user
-    // inputs something since fgets returns NULL when there
-    // is no input
-    while (!fgets(command_string, MAX_COMMAND_SIZE, stdin))
-        ;
+  pthread_mutex_lock(&cache_lock);
 
-    // Checks to see if the user entered nothing
-    if(strcmp(command_string, "\n") == 0)
+  int k = 0;
+  while(k < count)
+  {
+    if(frame_of[blocks[k]] != -1)
+    {
+      k++;
       continue;
+    }
 
-    command_string[strlen(command_string) - 1] = 0;
+    struct iovec vectors[URING_DEPTH];
+    int frames_used[URING_DEPTH];
+    int run = 0;
+    while(k + run < count && run < URING_DEPTH && blocks[k + run] == blocks[k] + run
+      && frame_of[blocks[k + run]] == -1)
+    {
+      // pin while the run is collected so the victim search doesn't hand it out twice
+      frames_used[run] = cache_victim();
+      frames[frames_used[run]].pins++;
+      vectors[run].iov_base = frames[frames_used[run]].buffer;
+      vectors[run].iov_len = BLOCK_SIZE;
+      run++;
+    }
 
-    /* Parse input */
-    char *token[MAX_NUM_ARGUMENTS];
+    ssize_t bytes = preadv(image_fd, vectors, run, (off_t)blocks[k] * BLOCK_SIZE);
 
-    // Nulls out the token array
-    for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
+    for(int j = 0; j < run; j++)
     {
-      token[i] = NULL;
+      struct frame *f = &frames[frames_used[j]];
+      ssize_t offset = (ssize_t)j * BLOCK_SIZE;
+      if(bytes < offset + BLOCK_SIZE)
+      {
+        ssize_t valid = bytes > offset ? bytes - offset : 0;
+        memset(f->buffer + valid, 0, BLOCK_SIZE - valid);
+      }
+      f->pins--;
+      f->block = blocks[k + j];
+      f->dirty = false;
+      frame_of[f->block] = frames_used[j];
     }
 
-    int token_count = 0;
+    k += run;
+  }
 
-    // Pointer to point to the token
-    // parsed by strsep
-    char *argument_ptr = NULL;
+  pthread_mutex_unlock(&cache_lock);
+}
 
-    char *working_string = strdup(command_string);
+// writes all dirty frames back to the image file as one batch
+void cache_flush()
+{
+  if(!cache_mode)
+  {
+    return;
+  }
 
-    // we are going to move the working_string pointer so we
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *head_ptr = working_string;
+  pthread_mutex_lock(&cache_lock);
 
-    // Tokenize the input strings with whitespace used as the delimiter
-    while (((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
-           (token_count < MAX_NUM_ARGUMENTS))
+  struct io_request *requests = malloc(num_frames * sizeof(struct io_request));
+  int count = 0;
+  for(int i = 0; i < num_frames; i++)
+  {
+    if(frames[i].block != -1 && frames[i].dirty)
     {
-      token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
-      if (strlen(token[token_count]) == 0)
-      {
-        token[token_count] = NULL;
-      }
-      token_count++;
+      requests[count].buffer = frames[i].buffer;
+      requests[count].length = BLOCK_SIZE;
+      requests[count].offset = (off_t)frames[i].block * BLOCK_SIZE;
+      frames[i].dirty = false;
+      count++;
     }
+  }
 
-    if(strcmp(command_string, "\n") == 0)
-      continue;
+  if(io_batch(image_fd, requests, count, true) == -1)
+  {
+    fprintf(output, "ERROR: Could not write back cached blocks.\n");
+  }
 
-    if(strcmp(token[0], "quit") == 0)
-    {
-      // Cleanup allocated memory
-      for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
-      {
-        if (token[i] != NULL)
-        {
-          free(token[i]);
-        }
-      }
+  free(requests);
+  pthread_mutex_unlock(&cache_lock);
+}
 
-      free(head_ptr);
-      free(command_string);
+// CRC32C (Castagnoli, the polynomial of the SSE4.2 crc32 instruction) in reflected form
+#define CRC32C_POLY 0x82f63b78
 
-      return(EXIT_SUCCESS);
-    }
+// byte at a time table for CPUs without the instruction
+uint32_t crc_table[256];
 
-    if(strcmp(token[0], "open") == 0)
-    {
-      if(token_count != 2)
-      {
-        printf("ERROR: usage open <disk name>.\n");
-        continue;
-      }
-      // open functionality
-      if(token[1] == NULL) //file exists
-      {
-        printf("ERROR: File not found.\n");
-        continue;
-      }
+uint32_t crc32cTable(const uint8_t *buffer, size_t length)
+{
+  uint32_t crc = 0xffffffff;
+  for(size_t i = 0; i < length; i++)
+  {
+    crc = crc_table[(crc ^ buffer[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
 
-      //open
-      openfs(token[1]);
-    }
+#if defined(__x86_64__) || defined(__i386__)
+// eight bytes per instruction, the block is always a multiple of that
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(const uint8_t *buffer, size_t length)
+{
+#if defined(__x86_64__)
+  uint64_t crc = 0xffffffff;
+  for(size_t i = 0; i < length; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, buffer + i, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+#else
+  uint32_t crc = 0xffffffff;
+  for(size_t i = 0; i < length; i += 4)
+  {
+    uint32_t word;
+    memcpy(&word, buffer + i, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+  }
+#endif
+  return ~(uint32_t)crc;
+}
+#endif
+
+// the implementation used, picked once at start up
+uint32_t (*crc32c)(const uint8_t *, size_t) = crc32cTable;
+
+// SHA-256 round constants
+const uint32_t sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// adds a 64 byte chunk to a SHA-256 state, in C for CPUs without the SHA extensions
+void sha256Compress(uint32_t *state, const uint8_t *chunk)
+{
+  uint32_t w[64];
+  for(int i = 0; i < 16; i++)
+  {
+    w[i] = (uint32_t)chunk[4 * i] << 24 | (uint32_t)chunk[4 * i + 1] << 16
+      | (uint32_t)chunk[4 * i + 2] << 8 | chunk[4 * i + 3];
+  }
+  for(int i = 16; i < 64; i++)
+  {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t v[8];
+  memcpy(v, state, sizeof(v));
+  for(int i = 0; i < 64; i++)
+  {
+    uint32_t t1 = v[7] + (ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25))
+      + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22))
+      + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
 
-    if(strcmp(token[0], "createfs") == 0 && token_count == 2)
+  for(int i = 0; i < 8; i++)
+  {
+    state[i] += v[i];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the same with the SHA extensions, four rounds and four message words per step. the
+// state is kept in the ABEF and CDGH order the instructions use
+__attribute__((target("sha,sse4.1")))
+void sha256CompressHardware(uint32_t *state, const uint8_t *chunk)
+{
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&state[0]), 0xb1);
+  __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&state[4]), 0x1b);
+  __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+  __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+  __m128i abef_start = abef;
+  __m128i cdgh_start = cdgh;
+  __m128i w[16];
+
+  for(int g = 0; g < 16; g++)
+  {
+    if(g < 4)
     {
-      // createfs functionality
-      if(token[1] == NULL)
-      {
-        printf("ERROR: File name cannot be NULL.\n");
-        continue;
-      }
+      w[g] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(chunk + 16 * g)), swap);
+    }
+    else
+    {
+      __m128i t = _mm_add_epi32(_mm_sha256msg1_epu32(w[g - 4], w[g - 3]),
+        _mm_alignr_epi8(w[g - 1], w[g - 2], 4));
+      w[g] = _mm_sha256msg2_epu32(t, w[g - 1]);
+    }
+
+    __m128i message = _mm_add_epi32(w[g], _mm_loadu_si128((__m128i *)&sha256_k[4 * g]));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0e));
+  }
 
-      createfs(token[1]);
+  abef = _mm_add_epi32(abef, abef_start);
+  cdgh = _mm_add_epi32(cdgh, cdgh_start);
+  __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+  __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(feba, dchg, 0xf0));
+  _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+// the implementation used, picked once at start up
+void (*sha256Chunk)(uint32_t *, const uint8_t *) = sha256Compress;
+
+// SHA-256 of a block, in the byte order of the standard so sha256sum gives the same
+void sha256Block(const uint8_t *block, uint8_t *digest)
+{
+  uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  for(int i = 0; i < BLOCK_SIZE; i += 64)
+  {
+    sha256Chunk(state, block + i);
+  }
+
+  // the padding is a chunk of its own as the block is a multiple of 64 bytes
+  uint8_t padding[64] = { 0x80 };
+  uint64_t bits = (uint64_t)BLOCK_SIZE * 8;
+  for(int i = 0; i < 8; i++)
+  {
+    padding[63 - i] = bits >> (8 * i);
+  }
+  sha256Chunk(state, padding);
+
+  for(int i = 0; i < 8; i++)
+  {
+    digest[4 * i] = state[i] >> 24;
+    digest[4 * i + 1] = state[i] >> 16;
+    digest[4 * i + 2] = state[i] >> 8;
+    digest[4 * i + 3] = state[i];
+  }
+}
+
+// reads are checked against the checksums unless verify is switched off, scrub still
+// finds a bad block later
+bool verify_reads = true;
+
+// builds the table and picks the crc32 and SHA instructions if the CPU has them
+void checksum_init()
+{
+  for(uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; bit++)
+    {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
     }
+    crc_table[i] = crc;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  if(__builtin_cpu_supports("sse4.2"))
+  {
+    crc32c = crc32cHardware;
+  }
 
-    if(image_open && (strcmp(token[0], "insert") == 0 || strcmp(token[0], "retrieve") == 0 
-    || strcmp(token[0], "read") == 0 || strcmp(token[0], "delete") == 0 
-    || strcmp(token[0], "undel") == 0 || strcmp(token[0], "list") == 0 
-    || strcmp(token[0], "df") == 0 || strcmp(token[0], "close") == 0 
-    || strcmp(token[0], "savefs") == 0 || strcmp(token[0], "attrib") == 0 
-    || strcmp(token[0], "encrypt") == 0 || strcmp(token[0], "decrypt") == 0))
+  // the SHA extensions have no __builtin_cpu_supports name, CPUID leaf 7 tells
+  unsigned eax, ebx, ecx, edx;
+  if(__get_cpuid_max(0, NULL) >= 7 && __builtin_cpu_supports("sse4.1"))
+  {
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    if(ebx & bit_SHA)
     {
-      if(strcmp(token[0], "insert") == 0)
-      {
-        // insert functionality
-        if(token_count != 2)
-        {
-          printf("ERROR: usage: insert <filename>\n");
-          continue;
-        }
+      sha256Chunk = sha256CompressHardware;
+    }
+  }
+#endif
+}
 
-        if(token[1] == NULL)
-        {
-          printf("ERROR: No filename specified.\n");
-          continue;
-        }
+// stores the checksum of the new contents of a data block
+void setChecksum(int32_t block, uint8_t *buffer)
+{
+  checksums[block - FIRST_DATA_BLOCK] = crc32c(buffer, BLOCK_SIZE);
+}
 
-        insert(token[1]);
-      }
+// true if the contents of a data block match its checksum
+bool checksumValid(int32_t block, uint8_t *buffer)
+{
+  return checksums[block - FIRST_DATA_BLOCK] == crc32c(buffer, BLOCK_SIZE);
+}
 
-      if(strcmp(token[0], "retrieve") == 0 && token_count == 2)
-      {
-        // retrieve #1 functionality
-        if(token[1] == NULL)
-        {
-          printf("ERROR: File name cannot be NULL.\n");
-          continue;
-        }
+// defined with the block lists below
+void loadBlockList(int32_t inode, int32_t *blocks);
 
-        retrieve(token[1]);
-      }
-      else if(strcmp(token[0], "retrieve") == 0 && token_count == 3)
-      {
-        // retrieve #2 functionality
-        if(token[1] == NULL || token[2] == NULL)
-        {
-          printf("ERROR: Both files must be specified.\n");
-        }
+// moves the first size bytes of a file between its blocks and the host file fd, from
+// the host file into the blocks or, when write is set, from the blocks to the host file.
+// blocks are pinned a window at a time and each window goes out as one batch with a
+// request per run of consecutive blocks. blocks coming in get their checksums set, blocks
+// going out are verified first. returns 0 on success, -1 on an I/O error and -2 if a
+// block doesn't match its checksum, nothing from that window on is written then
+int file_io(int fd, int32_t inode, uint32_t size, bool write)
+{
+  SPAN(file_io);
+  int32_t blocks[BLOCKS_PER_FILE];
+  int block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  loadBlockList(inode, blocks);
+  int ret = 0;
+
+  // in cache mode a window may only use a part of the frames, since other threads
+  // have blocks pinned as well
+  int window = BLOCKS_PER_FILE;
+  if(cache_mode && window > num_frames / 8)
+  {
+    window = num_frames / 8;
+  }
 
-        retrieve_to_file(token[1], token[2]);
-      }
+  struct io_request requests[BLOCKS_PER_FILE];
+  uint8_t *buffers[BLOCKS_PER_FILE];
+
+  for(int first = 0; first < block_count && ret != -2; first += window)
+  {
+    int last = first + window < block_count ? first + window : block_count;
+    int count = 0;
+
+    if(write)
+    {
+      prefetchBlocks(&blocks[first], last - first);
+    }
 
-      if(strcmp(token[0], "read") == 0 && token_count == 4)
+    for(int k = first; k < last; k++)
+    {
+      uint32_t offset = k * BLOCK_SIZE;
+      size_t length = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+      uint8_t *buffer = getBlock(blocks[k], write ? BLOCK_READ : BLOCK_NEW);
+      buffers[k] = buffer;
+
+      // the last block is only partly filled by the file, zero the rest of it
+      if(!write && length < BLOCK_SIZE)
       {
-        // read functionality
-        readfile(token[1], atoi(token[2]), atoi(token[3]));
+        memset(buffer + length, 0, BLOCK_SIZE - length);
       }
 
-      if(strcmp(token[0], "delete") == 0 && token_count == 2)
+      if(write && verify_reads && !checksumValid(blocks[k], buffer))
       {
-        if(token[1] == NULL) //filename exists && not already deleted
-        {
-          printf("ERROR: File not specified.\n");
-          continue;
-        }
-
-        delete(token[1]);
+        ret = -2;
       }
 
-      if(strcmp(token[0], "undel") == 0 && token_count == 2)
+      if(count > 0 && requests[count - 1].buffer + requests[count - 1].length == buffer
+        && requests[count - 1].length % BLOCK_SIZE == 0)
       {
-        if(token[1] == NULL) //checks if a filename was provided
-        {
-          printf("ERROR: File not specified.\n");
-          continue;
-        }
-        
-        undelete(token[1]);
+        requests[count - 1].length += length;
       }
-
-      if(strcmp(token[0], "list") == 0)
+      else
       {
-        // TODO: add size and time_added to print
-        if(token[1] && (strcmp(token[1], "-h") == 0 || strcmp(token[1], "-a") == 0))
-        {
-          if(token[2] && ((strcmp(token[2], "-h") == 0 || strcmp(token[2], "-a") == 0) && strcmp(token[2], token[1]) != 0))
-          {
-            list(token[1], token[2]);
-          }
-          else
-          {
-            list(token[1], "throw away");
-          }
-        }
-        else
-        {
-          list("hot", "garbage");
-        }
+        requests[count].buffer = buffer;
+        requests[count].length = length;
+        requests[count].offset = offset;
+        count++;
       }
+    }
+
+    if(ret != -2 && io_batch(fd, requests, count, write) == -1)
+    {
+      ret = -1;
+    }
 
-      if(strcmp(token[0], "df") == 0)
+    for(int k = first; k < last; k++)
+    {
+      if(!write)
       {
-        // df functionality
-        printf("%d bytes free.\n", df());
+        setChecksum(blocks[k], buffers[k]);
       }
+      putBlock(blocks[k]);
+    }
+  }
+
+  return ret;
+}
+
+// moves the first size bytes of a file between its blocks and a stream, like file_io()
+// but in order for streams that can't seek, such as pipes. each run of consecutive
+// blocks is read or written with a single call, big runs bypass the stream's buffer.
+// returns 0 on success, -1 on an I/O error or end of the stream and -2 if a block
+// doesn't match its checksum, nothing from that window on is written then
+int stream_io(FILE *stream, int32_t inode, uint32_t size, bool write)
+{
+  SPAN(stream_io);
+  int32_t blocks[BLOCKS_PER_FILE];
+  int block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  loadBlockList(inode, blocks);
+  int ret = 0;
+
+  int window = BLOCKS_PER_FILE;
+  if(cache_mode && window > num_frames / 8)
+  {
+    window = num_frames / 8;
+  }
+
+  uint8_t *buffers[BLOCKS_PER_FILE];
+
+  for(int first = 0; first < block_count && ret == 0; first += window)
+  {
+    int last = first + window < block_count ? first + window : block_count;
+
+    if(write)
+    {
+      prefetchBlocks(&blocks[first], last - first);
+    }
 
-      if(strcmp(token[0], "close") == 0 && token_count == 1)
+    for(int k = first; k < last; k++)
+    {
+      buffers[k] = getBlock(blocks[k], write ? BLOCK_READ : BLOCK_NEW);
+      if(write && verify_reads && !checksumValid(blocks[k], buffers[k]))
       {
-        // close functionality
-        closefs();
+        ret = -2;
       }
+    }
 
-      if(strcmp(token[0], "savefs") == 0)
+    // runs end where the next block isn't right behind the last one in memory
+    for(int k = first; k < last && ret == 0; )
+    {
+      int end = k + 1;
+      while(end < last && buffers[end] == buffers[end - 1] + BLOCK_SIZE)
       {
-        // savefs functionality
-        savefs(image_name);
+        end++;
       }
 
-      if(strcmp(token[0], "attrib") == 0 && token_count == 3)
+      size_t length = (size_t)(end - k) * BLOCK_SIZE;
+      if((uint32_t)end * BLOCK_SIZE > size)
       {
-        // attrib [+attribute][-attribute] functionality
-        if(strcmp(token[1], "-h") == 0 || strcmp(token[1], "+h") == 0 
-        || strcmp(token[1], "-r") == 0 || strcmp(token[1], "+r") == 0)
-        {   //checks provided attributes prior to function call
-          attribute(token[2], token[1]);
-        }
-        else
-        {
-          printf("\nERROR: Invalid attribute entry.\n");
-        }
+        length -= (uint32_t)end * BLOCK_SIZE - size;
       }
 
-      if(strcmp(token[0], "encrypt") == 0 && token_count == 3)
+      size_t moved = write ? fwrite(buffers[k], 1, length, stream)
+        : fread(buffers[k], 1, length, stream);
+      if(moved != length)
       {
-        // encrypt functionality 
-        if(strlen(token[2]) == 1)   //checks if key is a single char
-        {
-          encrypt(token[1], token[2], 'e');
-        }
-        else
-        {
-          printf("\nERROR: Invalid cipher.\n");
-        }
+        ret = -1;
       }
+      k = end;
+    }
 
-      if(strcmp(token[0], "decrypt") == 0 && token_count == 3)
+    for(int k = first; k < last; k++)
+    {
+      if(!write)
       {
-        // decrypt functionality
-        if(strlen(token[2]) == 1) //checks if key is a single char
-        {
-          encrypt(token[1], token[2], 'd');
-        }
-        else
+        // the last block is only partly filled by the file, zero the rest of it
+        uint32_t offset = k * BLOCK_SIZE;
+        if(size - offset < BLOCK_SIZE)
         {
-          printf("\nERROR: invalid cipher.\n");
+          memset(buffers[k] + (size - offset), 0, BLOCK_SIZE - (size - offset));
         }
+        setChecksum(blocks[k], buffers[k]);
       }
+      putBlock(blocks[k]);
+    }
+  }
+
+  return ret;
+}
+
+// calculate the free space avaialable in the disk image
+uint32_t df()
+{
+  int count = 0;
+
+  for(int i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    if(__atomic_load_n(&block_refs[i], __ATOMIC_RELAXED) == 0)
+      count++;
+  }
+
+  return count * BLOCK_SIZE;
+}
+
+// claims an inode in the free inode map by atomically flipping its byte from free to
+// used, so allocations from different threads never need a lock
+bool claim(uint8_t *map_entry)
+{
+  uint8_t expected = 1;
+  return __atomic_compare_exchange_n(map_entry, &expected, 0, false,
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// gives an inode back to the free inode map
+void release(uint8_t *map_entry)
+{
+  __atomic_store_n(map_entry, 1, __ATOMIC_RELEASE);
+}
+
+// takes the first reference to a free block, atomically like claim().
+// returns false if the block is in use
+bool claimBlock(int32_t block)
+{
+  uint8_t expected = 0;
+  return __atomic_compare_exchange_n(&block_refs[block - FIRST_DATA_BLOCK], &expected, 1,
+    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// adds a reference to a block that is in use, a snapshot sharing it with a file
+void retainBlock(int32_t block)
+{
+  __atomic_add_fetch(&block_refs[block - FIRST_DATA_BLOCK], 1, __ATOMIC_RELAXED);
+}
+
+// drops a reference to a block, it is free again once the last one is gone
+void releaseBlock(int32_t block)
+{
+  __atomic_sub_fetch(&block_refs[block - FIRST_DATA_BLOCK], 1, __ATOMIC_RELEASE);
+}
+
+// true if a snapshot shares the block, it has to be copied before it is changed
+bool sharedBlock(int32_t block)
+{
+  return __atomic_load_n(&block_refs[block - FIRST_DATA_BLOCK], __ATOMIC_RELAXED) > 1;
+}
+
+// next-fit cursor for inodes, the inode the next search starts at
+int32_t inode_cursor = 0;
+
+// keep us from being contiguous
+int32_t findFreeInode()
+{
+  SPAN(findFreeInode);
+  int32_t start = __atomic_load_n(&inode_cursor, __ATOMIC_RELAXED);
+  COUNT(inode_searches, 1);
+
+  for(int n = 0; n < MAX_NUM_FILES; n++)
+  {
+    int32_t i = (start + n) % MAX_NUM_FILES;
+    if(__atomic_load_n(&free_inodes[i], __ATOMIC_RELAXED) && claim(&free_inodes[i]))
+    {
+      __atomic_store_n(&inode_cursor, (i + 1) % MAX_NUM_FILES, __ATOMIC_RELAXED);
+      COUNT(inode_probes, n + 1);
+      return i;
     }
-    else if(!image_open && (strcmp(token[0], "insert") == 0 || strcmp(token[0], "retrieve") == 0 
-    || strcmp(token[0], "read") == 0 || strcmp(token[0], "delete") == 0 
-    || strcmp(token[0], "undel") == 0 || strcmp(token[0], "list") == 0 
-    || strcmp(token[0], "df") == 0 || strcmp(token[0], "close") == 0 
-    || strcmp(token[0], "savefs") == 0 || strcmp(token[0], "attrib") == 0 
-    || strcmp(token[0], "encrypt") == 0 || strcmp(token[0], "decrypt") == 0))
+  }
+  COUNT(inode_probes, MAX_NUM_FILES);
+  return -1;
+}
+
+// next-fit cursor, the data block (relative to FIRST_DATA_BLOCK) where the next
+// allocation starts scanning so we don't rescan the full front of the image each time
+int32_t alloc_cursor = 0;
+
+// finds a free block at or after the goal block and marks it used. a goal of -1
+// starts at the allocation cursor instead. the scan wraps around the end of the image
+int32_t findFreeBlock(int32_t goal)
+{
+  SPAN(findFreeBlock);
+  int32_t start = __atomic_load_n(&alloc_cursor, __ATOMIC_RELAXED);
+  if(goal >= FIRST_DATA_BLOCK && goal < NUM_BLOCKS)
+  {
+    start = goal - FIRST_DATA_BLOCK;
+  }
+
+  COUNT(block_searches, 1);
+  for(int n = 0; n < NUM_DATA_BLOCKS; n++)
+  {
+    int32_t i = (start + n) % NUM_DATA_BLOCKS;
+    if(__atomic_load_n(&block_refs[i], __ATOMIC_RELAXED) == 0
+      && claimBlock(i + FIRST_DATA_BLOCK))
     {
-      printf("ERROR: Disk image is not opened.\n");
-      continue;
+      __atomic_store_n(&alloc_cursor, (i + 1) % NUM_DATA_BLOCKS, __ATOMIC_RELAXED);
+      COUNT(block_probes, n + 1);
+      COUNT(blocks_allocated, 1);
+      return i + FIRST_DATA_BLOCK;
     }
   }
 
-  return 0;
-}
\ No newline at end of file
+  COUNT(block_probes, NUM_DATA_BLOCKS);
+  return -1;
+}
+
+// number of index blocks a block list of length blocks takes
+int indexBlocksFor(int length)
+{
+  return (length + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+}
+
+// copies the block list of the inode out of its index blocks. blocks has to hold
+// BLOCKS_PER_FILE entries
+void loadBlockList(int32_t inode, int32_t *blocks)
+{
+  int length = inodes[inode].block_length;
+
+  for(int i = 0; i < indexBlocksFor(length); i++)
+  {
+    int count = length - i * POINTERS_PER_BLOCK;
+    if(count > POINTERS_PER_BLOCK)
+    {
+      count = POINTERS_PER_BLOCK;
+    }
+
+    int32_t index_block = inodes[inode].index_blocks[i];
+    memcpy(&blocks[i * POINTERS_PER_BLOCK], getBlock(index_block, BLOCK_READ),
+      count * sizeof(int32_t));
+    putBlock(index_block);
+  }
+}
+
+// makes blocks the block list of the inode. index blocks are taken for a longer list,
+// right behind the file's last block, and given back if a shorter list doesn't need
+// them. returns -1 with the inode unchanged if there's no free block for an index block
+int storeBlockList(int32_t inode, int32_t *blocks, int length)
+{
+  struct inode *node = &inodes[inode];
+  int needed = indexBlocksFor(length);
+
+  int32_t fresh[INDEX_BLOCKS];
+  int taken = 0;
+  for(int i = 0; i < needed; i++)
+  {
+    if(node->index_blocks[i] != -1)
+    {
+      continue;
+    }
+
+    fresh[taken] = findFreeBlock(blocks[length - 1] + 1);
+    if(fresh[taken] == -1)
+    {
+      while(taken > 0)
+      {
+        releaseBlock(fresh[--taken]);
+      }
+      return -1;
+    }
+    taken++;
+  }
+
+  taken = 0;
+  for(int i = 0; i < INDEX_BLOCKS; i++)
+  {
+    if(i < needed)
+    {
+      if(node->index_blocks[i] == -1)
+      {
+        node->index_blocks[i] = fresh[taken++];
+      }
+
+      int count = length - i * POINTERS_PER_BLOCK;
+      if(count > POINTERS_PER_BLOCK)
+      {
+        count = POINTERS_PER_BLOCK;
+      }
+
+      memcpy(getBlock(node->index_blocks[i], BLOCK_NEW), &blocks[i * POINTERS_PER_BLOCK],
+        count * sizeof(int32_t));
+      putBlock(node->index_blocks[i]);
+    }
+    else if(node->index_blocks[i] != -1)
+    {
+      releaseBlock(node->index_blocks[i]);
+      node->index_blocks[i] = -1;
+    }
+  }
+
+  node->block_length = length;
+  return 0;
+}
+
+// returns the k-th block of the file
+int32_t fileBlock(int32_t inode, int k)
+{
+  int32_t index_block = inodes[inode].index_blocks[k / POINTERS_PER_BLOCK];
+  int32_t block = ((int32_t *)getBlock(index_block, BLOCK_READ))[k % POINTERS_PER_BLOCK];
+  putBlock(index_block);
+  return block;
+}
+
+// points the k-th block of the file at another block
+void setFileBlock(int32_t inode, int k, int32_t block)
+{
+  int32_t index_block = inodes[inode].index_blocks[k / POINTERS_PER_BLOCK];
+  ((int32_t *)getBlock(index_block, BLOCK_WRITE))[k % POINTERS_PER_BLOCK] = block;
+  putBlock(index_block);
+}
+
+// the goal block of a file is the block right behind its last block, so the file
+// keeps growing contiguously. returns -1 for empty files
+int32_t goalBlock(int32_t inode)
+{
+  if(inodes[inode].block_length == 0)
+  {
+    return -1;
+  }
+
+  return fileBlock(inode, inodes[inode].block_length - 1) + 1;
+}
+
+// reserves count more blocks for the inode in one call and appends them to its block
+// list. a contiguous run starting at the file's goal block (or the cursor) is preferred,
+// if free space is too fragmented for that the blocks are taken next-fit one after the
+// other. returns 0 on success or -1 with nothing allocated if the image is too full
+int allocateBlocks(int32_t inode, int32_t count)
+{
+  SPAN(allocateBlocks);
+  int32_t list[BLOCKS_PER_FILE];
+  int length = inodes[inode].block_length;
+  int32_t *blocks = &list[length];
+  int32_t goal = goalBlock(inode);
+
+  if(count <= 0)
+  {
+    return 0;
+  }
+
+  int index_count = indexBlocksFor(length + count) - indexBlocksFor(length);
+  if(length + count > BLOCKS_PER_FILE || (count + index_count) * BLOCK_SIZE > df())
+  {
+    return -1;
+  }
+
+  loadBlockList(inode, list);
+
+  int32_t start = __atomic_load_n(&alloc_cursor, __ATOMIC_RELAXED);
+  if(goal >= FIRST_DATA_BLOCK && goal < NUM_BLOCKS)
+  {
+    start = goal - FIRST_DATA_BLOCK;
+  }
+
+  // look for a free run long enough for the whole request. runs can't wrap around
+  // the end of the image so the run length restarts at block 0
+  bool found = false;
+  int32_t run = 0;
+  int n = 0;
+  for(; n < NUM_DATA_BLOCKS && !found; n++)
+  {
+    int32_t i = (start + n) % NUM_DATA_BLOCKS;
+    if(i == 0)
+    {
+      run = 0;
+    }
+
+    if(__atomic_load_n(&block_refs[i], __ATOMIC_RELAXED) == 0)
+    {
+      run++;
+    }
+    else
+    {
+      run = 0;
+    }
+
+    if(run == count)
+    {
+      // claim the run, if another thread got to one of its blocks first give back
+      // what we took and keep looking behind that block
+      int32_t first = i - count + 1;
+      int j = 0;
+      while(j < count && claimBlock(first + j + FIRST_DATA_BLOCK))
+      {
+        blocks[j] = first + j + FIRST_DATA_BLOCK;
+        j++;
+      }
+
+      if(j == count)
+      {
+        __atomic_store_n(&alloc_cursor, (i + 1) % NUM_DATA_BLOCKS, __ATOMIC_RELAXED);
+        found = true;
+        break;
+      }
+
+      for(int k = 0; k < j; k++)
+      {
+        releaseBlock(first + k + FIRST_DATA_BLOCK);
+      }
+      run = 0;
+    }
+  }
+
+  COUNT(run_searches, 1);
+  COUNT(block_probes, n + 1);
+  if(found)
+  {
+    COUNT(blocks_allocated, count);
+  }
+  else
+  {
+    COUNT(run_fallbacks, 1);
+  }
+
+  // no run is long enough, take the blocks one by one with each block's goal being
+  // the block behind the previous one
+  for(int j = 0; j < count && !found; j++)
+  {
+    blocks[j] = findFreeBlock(j == 0 ? goal : blocks[j - 1] + 1);
+
+    // other threads took the space df() saw, undo the whole allocation
+    if(blocks[j] == -1)
+    {
+      for(int k = 0; k < j; k++)
+      {
+        releaseBlock(blocks[k]);
+      }
+      return -1;
+    }
+  }
+
+  // the list may need another index block, which goes right behind the new blocks
+  if(storeBlockList(inode, list, length + count) == -1)
+  {
+    for(int j = 0; j < count; j++)
+    {
+      releaseBlock(blocks[j]);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+// drops the inode's reference to each of its blocks, blocks a snapshot still shares
+// stay allocated
+void releaseBlocks(int32_t inode)
+{
+  SPAN(releaseBlocks);
+  int32_t blocks[BLOCKS_PER_FILE];
+  loadBlockList(inode, blocks);
+
+  for(int i = 0; i < inodes[inode].block_length; i++)
+  {
+    releaseBlock(blocks[i]);
+  }
+}
+
+// frees an inode no directory entry points at any more, with its index blocks.
+// the blocks of the file have to be released already
+void freeInode(int32_t inode)
+{
+  for(int i = 0; i < INDEX_BLOCKS; i++)
+  {
+    if(inodes[inode].index_blocks[i] != -1)
+    {
+      releaseBlock(inodes[inode].index_blocks[i]);
+      inodes[inode].index_blocks[i] = -1;
+    }
+  }
+
+  inodes[inode].block_length = 0;
+  inodes[inode].inUse = false;
+  release(&free_inodes[inode]);
+}
+
+// gives the file its own copy of block k of its block list if a snapshot shares that
+// block, so the file can be changed without changing the snapshot. the caller stores
+// the changed list with the inode locked exclusively. returns the block to write to or
+// -1 if there is no space for the copy
+int32_t unshareBlock(int32_t *blocks, int k)
+{
+  int32_t old = blocks[k];
+  if(!sharedBlock(old))
+  {
+    return old;
+  }
+
+  int32_t copy = findFreeBlock(k > 0 ? blocks[k - 1] + 1 : old);
+  if(copy == -1)
+  {
+    return -1;
+  }
+
+  uint8_t *from = getBlock(old, BLOCK_READ);
+  uint8_t *to = getBlock(copy, BLOCK_NEW);
+  memcpy(to, from, BLOCK_SIZE);
+  checksums[copy - FIRST_DATA_BLOCK] = checksums[old - FIRST_DATA_BLOCK];
+  putBlock(copy);
+  putBlock(old);
+
+  blocks[k] = copy;
+  releaseBlock(old);
+  return copy;
+}
+
+// the directory is a B+tree with one node per block. the leaves hold the entries in
+// name order and are linked for scans, inner nodes hold separator keys where keys[i]
+// is the smallest name under children[i + 1]. entries are never moved between leaves
+// when they are removed, a leaf may even run empty, defrag builds the tree up again
+#define LEAF_ENTRIES 14
+#define NODE_KEYS 14
+#define MAX_TREE_HEIGHT 8
+
+struct directory_leaf
+{
+  int32_t count;
+  int32_t next;     // next leaf in name order, -1 for the last one
+  struct _directoryEntry entries[LEAF_ENTRIES];
+};
+
+struct directory_node
+{
+  int32_t count;    // number of keys, there is one child more than that
+  int32_t children[NODE_KEYS + 1];
+  char keys[NODE_KEYS][64];
+};
+
+// copies a tree node of size bytes out of (or into) its block
+void readNode(int32_t block, void *node, size_t size)
+{
+  memcpy(node, getBlock(block, BLOCK_READ), size);
+  putBlock(block);
+}
+
+void writeNode(int32_t block, void *node, size_t size)
+{
+  uint8_t *buffer = getBlock(block, BLOCK_NEW);
+  memcpy(buffer, node, size);
+  memset(buffer + size, 0, BLOCK_SIZE - size);
+  putBlock(block);
+}
+
+// walks down the tree to the leaf that holds name, or would hold it
+int32_t findLeaf(char *name)
+{
+  int32_t node = super->directory_root;
+  COUNT(directory_walks, 1);
+  COUNT(directory_nodes, super->directory_height);
+
+  for(int level = super->directory_height; level > 0; level--)
+  {
+    struct directory_node *inner = (struct directory_node *)getBlock(node, BLOCK_READ);
+    int i = 0;
+    while(i < inner->count && strncmp(name, inner->keys[i], 64) >= 0)
+    {
+      i++;
+    }
+    int32_t child = inner->children[i];
+    putBlock(node);
+    node = child;
+  }
+
+  return node;
+}
+
+// finds the leaf that holds name, or would hold it, and locks it shared or exclusive.
+// needs the directory lock
+int32_t lockLeaf(char *name, bool exclusive)
+{
+  int32_t block = findLeaf(name);
+  if(exclusive)
+  {
+    pthread_rwlock_wrlock(&leaf_locks[block % LEAF_LOCKS]);
+  }
+  else
+  {
+    pthread_rwlock_rdlock(&leaf_locks[block % LEAF_LOCKS]);
+  }
+  return block;
+}
+
+void unlockLeaf(int32_t block)
+{
+  pthread_rwlock_unlock(&leaf_locks[block % LEAF_LOCKS]);
+}
+
+// copies the entry for name out of a locked leaf, deleted or not. returns false if
+// the leaf has no entry for the name
+bool leafLookup(int32_t block, char *name, struct _directoryEntry *entry)
+{
+  struct directory_leaf *leaf = (struct directory_leaf *)getBlock(block, BLOCK_READ);
+
+  bool found = false;
+  for(int i = 0; i < leaf->count && !found; i++)
+  {
+    if(strncmp(leaf->entries[i].name, name, 64) == 0)
+    {
+      *entry = leaf->entries[i];
+      found = true;
+    }
+  }
+
+  putBlock(block);
+  return found;
+}
+
+// looks up a name in the directory and copies its entry out, deleted or not.
+// needs the directory lock. returns false if there is no entry for the name
+bool directoryLookup(char *name, struct _directoryEntry *entry)
+{
+  int32_t block = lockLeaf(name, false);
+  bool found = leafLookup(block, name, entry);
+  unlockLeaf(block);
+  return found;
+}
+
+// overwrites the entry with the same name in a leaf locked exclusively
+void leafUpdate(int32_t block, struct _directoryEntry *entry)
+{
+  struct directory_leaf *leaf = (struct directory_leaf *)getBlock(block, BLOCK_WRITE);
+
+  for(int i = 0; i < leaf->count; i++)
+  {
+    if(strncmp(leaf->entries[i].name, entry->name, 64) == 0)
+    {
+      leaf->entries[i] = *entry;
+      break;
+    }
+  }
+
+  putBlock(block);
+}
+
+// adds an entry in name order to a leaf locked exclusively. returns false, leaving the
+// leaf as it is, if the leaf is full and has to be split
+bool leafInsert(int32_t block, struct _directoryEntry *entry)
+{
+  struct directory_leaf *leaf = (struct directory_leaf *)getBlock(block, BLOCK_WRITE);
+  bool room = leaf->count < LEAF_ENTRIES;
+
+  if(room)
+  {
+    int i = 0;
+    while(i < leaf->count && strncmp(leaf->entries[i].name, entry->name, 64) < 0)
+    {
+      i++;
+    }
+    memmove(&leaf->entries[i + 1], &leaf->entries[i],
+      (leaf->count - i) * sizeof(struct _directoryEntry));
+    leaf->entries[i] = *entry;
+    leaf->count++;
+  }
+
+  putBlock(block);
+  return room;
+}
+
+// blocks for the nodes an insert may split off, taken before the tree is changed
+int32_t spare_nodes[MAX_TREE_HEIGHT + 2];
+int spare_count = 0;
+
+// inserts the entry into the subtree of node, level levels above the leaves. if the
+// node had to split, its new right half is returned and the smallest name in it copied
+// to key, otherwise -1
+int32_t insertBelow(int32_t node, int level, struct _directoryEntry *entry, char *key)
+{
+  if(level == 0)
+  {
+    if(leafInsert(node, entry))
+    {
+      return -1;
+    }
+
+    struct directory_leaf leaf;
+    readNode(node, &leaf, sizeof(leaf));
+
+    int i = 0;
+    while(i < leaf.count && strncmp(leaf.entries[i].name, entry->name, 64) < 0)
+    {
+      i++;
+    }
+
+    // all entries in order, with the new one
+    struct _directoryEntry entries[LEAF_ENTRIES + 1];
+    memcpy(entries, leaf.entries, i * sizeof(struct _directoryEntry));
+    entries[i] = *entry;
+    memcpy(&entries[i + 1], &leaf.entries[i], (leaf.count - i) * sizeof(struct _directoryEntry));
+
+    // the leaf is full, split it in half
+    struct directory_leaf right;
+    memset(&right, 0, sizeof(right));
+    int32_t sibling = spare_nodes[--spare_count];
+    COUNT(directory_splits, 1);
+
+    leaf.count = (LEAF_ENTRIES + 1) / 2;
+    right.count = LEAF_ENTRIES + 1 - leaf.count;
+    memcpy(leaf.entries, entries, leaf.count * sizeof(struct _directoryEntry));
+    memcpy(right.entries, &entries[leaf.count], right.count * sizeof(struct _directoryEntry));
+    right.next = leaf.next;
+    leaf.next = sibling;
+
+    writeNode(node, &leaf, sizeof(leaf));
+    writeNode(sibling, &right, sizeof(right));
+    memcpy(key, right.entries[0].name, 64);
+    return sibling;
+  }
+
+  struct directory_node inner;
+  readNode(node, &inner, sizeof(inner));
+
+  int i = 0;
+  while(i < inner.count && strncmp(entry->name, inner.keys[i], 64) >= 0)
+  {
+    i++;
+  }
+
+  char child_key[64];
+  int32_t child = insertBelow(inner.children[i], level - 1, entry, child_key);
+  if(child == -1)
+  {
+    return -1;
+  }
+
+  // all keys and children in order, with the new ones
+  char keys[NODE_KEYS + 1][64];
+  int32_t children[NODE_KEYS + 2];
+  memcpy(keys, inner.keys, i * 64);
+  memcpy(keys[i], child_key, 64);
+  memcpy(keys[i + 1], inner.keys[i], (inner.count - i) * 64);
+  memcpy(children, inner.children, (i + 1) * sizeof(int32_t));
+  children[i + 1] = child;
+  memcpy(&children[i + 2], &inner.children[i + 1], (inner.count - i) * sizeof(int32_t));
+
+  if(inner.count < NODE_KEYS)
+  {
+    inner.count++;
+    memcpy(inner.keys, keys, inner.count * 64);
+    memcpy(inner.children, children, (inner.count + 1) * sizeof(int32_t));
+    writeNode(node, &inner, sizeof(inner));
+    return -1;
+  }
+
+  // split the node, the middle key moves up to the parent
+  struct directory_node right;
+  memset(&right, 0, sizeof(right));
+  int32_t sibling = spare_nodes[--spare_count];
+  COUNT(directory_splits, 1);
+
+  inner.count = (NODE_KEYS + 1) / 2;
+  right.count = NODE_KEYS - inner.count;
+  memcpy(inner.keys, keys, inner.count * 64);
+  memcpy(inner.children, children, (inner.count + 1) * sizeof(int32_t));
+  memcpy(right.keys, keys[inner.count + 1], right.count * 64);
+  memcpy(right.children, &children[inner.count + 1], (right.count + 1) * sizeof(int32_t));
+
+  writeNode(node, &inner, sizeof(inner));
+  writeNode(sibling, &right, sizeof(right));
+  memcpy(key, keys[inner.count], 64);
+  return sibling;
+}
+
+// adds an entry for a name that isn't in the directory yet. needs the directory lock
+// held exclusively. returns -1 if there are no free blocks for the nodes it may split
+int directoryInsert(struct _directoryEntry *entry)
+{
+  // a split can go all the way up and put a new root on top
+  spare_count = 0;
+  for(int i = 0; i < super->directory_height + 2; i++)
+  {
+    int32_t block = findFreeBlock(-1);
+    if(block == -1)
+    {
+      while(spare_count > 0)
+      {
+        releaseBlock(spare_nodes[--spare_count]);
+      }
+      return -1;
+    }
+    spare_nodes[spare_count++] = block;
+  }
+
+  char key[64];
+  int32_t sibling = insertBelow(super->directory_root, super->directory_height, entry, key);
+
+  if(sibling != -1)
+  {
+    struct directory_node root;
+    memset(&root, 0, sizeof(root));
+    root.count = 1;
+    root.children[0] = super->directory_root;
+    root.children[1] = sibling;
+    memcpy(root.keys[0], key, 64);
+
+    int32_t block = spare_nodes[--spare_count];
+    writeNode(block, &root, sizeof(root));
+    super->directory_root = block;
+    super->directory_height++;
+  }
+
+  while(spare_count > 0)
+  {
+    releaseBlock(spare_nodes[--spare_count]);
+  }
+  return 0;
+}
+
+// calls visit for the directory entries in name order, starting with the first one
+// not ordered before start, until visit returns false. needs the directory lock, each
+// leaf is locked shared while its entries are visited
+void directoryScan(char *start, bool (*visit)(struct _directoryEntry *, void *), void *arg)
+{
+  int32_t block = findLeaf(start);
+  bool more = true;
+
+  while(block != -1 && more)
+  {
+    pthread_rwlock_rdlock(&leaf_locks[block % LEAF_LOCKS]);
+    struct directory_leaf *leaf = (struct directory_leaf *)getBlock(block, BLOCK_READ);
+    for(int i = 0; i < leaf->count && more; i++)
+    {
+      if(strncmp(leaf->entries[i].name, start, 64) >= 0)
+      {
+        more = visit(&leaf->entries[i], arg);
+      }
+    }
+
+    int32_t next = leaf->next;
+    putBlock(block);
+    unlockLeaf(block);
+    block = next;
+  }
+}
+
+// the entries of the directory copied out in name order by collectEntry()
+struct entry_list
+{
+  struct _directoryEntry *entries;
+  int count;
+};
+
+bool collectEntry(struct _directoryEntry *entry, void *arg)
+{
+  struct entry_list *list = arg;
+  list->entries[list->count++] = *entry;
+  return true;
+}
+
+// gives back the blocks of a subtree of the directory
+void directoryFree(int32_t node, int level)
+{
+  if(level > 0)
+  {
+    struct directory_node inner;
+    readNode(node, &inner, sizeof(inner));
+    for(int i = 0; i <= inner.count; i++)
+    {
+      directoryFree(inner.children[i], level - 1);
+    }
+  }
+
+  releaseBlock(node);
+}
+
+// replaces the directory with a tree built bottom up from count entries sorted by
+// name, packing the leaves and inner nodes full. a root of -1 means the old tree was
+// freed already. returns -1 if there isn't room for the new tree, the old one is kept then
+int directoryBuild(struct _directoryEntry *entries, int count)
+{
+  int leaves = count > 0 ? (count + LEAF_ENTRIES - 1) / LEAF_ENTRIES : 1;
+
+  // take all blocks of the new tree up front
+  int total = 0;
+  for(int n = leaves; ; n = (n + NODE_KEYS) / (NODE_KEYS + 1))
+  {
+    total += n;
+    if(n == 1)
+    {
+      break;
+    }
+  }
+
+  int32_t *blocks = (int32_t *)malloc(total * sizeof(int32_t));
+  for(int i = 0; i < total; i++)
+  {
+    blocks[i] = findFreeBlock(i > 0 ? blocks[i - 1] + 1 : -1);
+    if(blocks[i] == -1)
+    {
+      while(i > 0)
+      {
+        releaseBlock(blocks[--i]);
+      }
+      free(blocks);
+      return -1;
+    }
+  }
+
+  if(super->directory_root != -1)
+  {
+    directoryFree(super->directory_root, super->directory_height);
+  }
+
+  // the nodes of the level being built and the smallest name below each of them
+  int32_t *nodes = (int32_t *)malloc(leaves * sizeof(int32_t));
+  char (*keys)[64] = malloc(leaves * 64);
+  int used = 0;
+
+  for(int i = 0; i < leaves; i++)
+  {
+    struct directory_leaf leaf;
+    memset(&leaf, 0, sizeof(leaf));
+    leaf.count = count - i * LEAF_ENTRIES < LEAF_ENTRIES ? count - i * LEAF_ENTRIES
+      : LEAF_ENTRIES;
+    memcpy(leaf.entries, &entries[i * LEAF_ENTRIES], leaf.count * sizeof(struct _directoryEntry));
+    leaf.next = i + 1 < leaves ? blocks[used + 1] : -1;
+
+    nodes[i] = blocks[used++];
+    memcpy(keys[i], leaf.entries[0].name, 64);
+    writeNode(nodes[i], &leaf, sizeof(leaf));
+  }
+
+  int height = 0;
+  for(int n = leaves; n > 1; n = (n + NODE_KEYS) / (NODE_KEYS + 1))
+  {
+    for(int p = 0; p * (NODE_KEYS + 1) < n; p++)
+    {
+      int first = p * (NODE_KEYS + 1);
+      int children = n - first < NODE_KEYS + 1 ? n - first : NODE_KEYS + 1;
+
+      struct directory_node inner;
+      memset(&inner, 0, sizeof(inner));
+      inner.count = children - 1;
+      for(int c = 0; c < children; c++)
+      {
+        inner.children[c] = nodes[first + c];
+        if(c > 0)
+        {
+          memcpy(inner.keys[c - 1], keys[first + c], 64);
+        }
+      }
+
+      // the parents of a level are written over the front of the arrays, behind the
+      // entries still to be read
+      nodes[p] = blocks[used++];
+      memcpy(keys[p], keys[first], 64);
+      writeNode(nodes[p], &inner, sizeof(inner));
+    }
+    height++;
+  }
+
+  super->directory_root = nodes[0];
+  super->directory_height = height;
+
+  free(keys);
+  free(nodes);
+  free(blocks);
+  return 0;
+}
+
+// looks up an in-use file and locks its inode, shared for commands that only read the
+// file and exclusive for ones that change it. returns the inode or -1 if not found
+int32_t lockFile(char *filename, bool exclusive)
+{
+  struct _directoryEntry entry;
+  int32_t inode = -1;
+
+  // the leaf stays locked until the inode is, so the file can't be deleted in between
+  pthread_rwlock_rdlock(&directory_lock);
+  int32_t leaf = lockLeaf(filename, false);
+
+  if(leafLookup(leaf, filename, &entry) && entry.inUse)
+  {
+    inode = entry.inode;
+    if(exclusive)
+    {
+      pthread_rwlock_wrlock(&inode_locks[inode]);
+    }
+    else
+    {
+      pthread_rwlock_rdlock(&inode_locks[inode]);
+    }
+  }
+
+  unlockLeaf(leaf);
+  pthread_rwlock_unlock(&directory_lock);
+  return inode;
+}
+
+// releases the inode lock taken by lockFile()
+void unlockInode(int32_t inode)
+{
+  pthread_rwlock_unlock(&inode_locks[inode]);
+}
+
+// the live files in order of creation time, so list by time doesn't have to sort the
+// directory. a file is added when it is published and removed when it is deleted, both
+// holding the leaf of its entry and index_lock exclusively
+int32_t *time_index;
+int32_t index_count = 0;
+
+// name and creation time of each indexed inode, the time formatted for list once
+char (*entry_name)[65];
+time_t *entry_time;
+char (*entry_time_string)[20];
+
+// orders inodes by creation time, equal times by name
+int compareTimes(int32_t a, int32_t b)
+{
+  if(entry_time[a] != entry_time[b])
+  {
+    return entry_time[a] < entry_time[b] ? -1 : 1;
+  }
+
+  int order = strcmp(entry_name[a], entry_name[b]);
+  return order != 0 ? order : a - b;
+}
+
+// binary search for the position of an inode in the time index, or where it belongs
+int indexPosition(int32_t inode)
+{
+  int low = 0;
+  int high = index_count;
+  while(low < high)
+  {
+    int middle = (low + high) / 2;
+    if(compareTimes(time_index[middle], inode) < 0)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// adds the inode of a file that was just published to the index
+void indexAdd(int32_t inode, char *name, time_t creation_time)
+{
+  struct tm tm;
+  char time_string[20];
+  strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S",
+    localtime_r(&creation_time, &tm));
+
+  pthread_rwlock_wrlock(&index_lock);
+  memset(entry_name[inode], 0, sizeof(entry_name[inode]));
+  strncpy(entry_name[inode], name, 64);
+  entry_time[inode] = creation_time;
+  memcpy(entry_time_string[inode], time_string, sizeof(time_string));
+
+  int position = indexPosition(inode);
+  memmove(&time_index[position + 1], &time_index[position],
+    (index_count - position) * sizeof(int32_t));
+  time_index[position] = inode;
+  index_count++;
+  pthread_rwlock_unlock(&index_lock);
+}
+
+// takes the inode of a deleted file out of the index
+void indexRemove(int32_t inode)
+{
+  pthread_rwlock_wrlock(&index_lock);
+  int position = indexPosition(inode);
+  memmove(&time_index[position], &time_index[position + 1],
+    (index_count - position - 1) * sizeof(int32_t));
+  index_count--;
+  pthread_rwlock_unlock(&index_lock);
+}
+
+bool indexEntry(struct _directoryEntry *entry, void *arg)
+{
+  if(entry->inUse)
+  {
+    indexAdd(entry->inode, entry->name, inodes[entry->inode].creation_time);
+  }
+  return true;
+}
+
+// builds the index from scratch after the whole directory was loaded or replaced
+void indexRebuild()
+{
+  index_count = 0;
+  directoryScan("", indexEntry, NULL);
+}
+
+// finds the given file and sets the file to not in use and
+// as well as the associated inode and blocks with it
+void delete(char *filename)
+{
+  struct _directoryEntry entry;
+
+  // find the file, holding its leaf so the entry can be changed
+  pthread_rwlock_rdlock(&directory_lock);
+  int32_t leaf = lockLeaf(filename, true);
+
+  // The file is not found in the directory
+  if(!leafLookup(leaf, filename, &entry) || !entry.inUse)
+  {
+    unlockLeaf(leaf);
+    pthread_rwlock_unlock(&directory_lock);
+    fprintf(output, "ERROR: File not found.\n");
+    return;
+  }
+
+  int32_t inode_index = entry.inode;
+  pthread_rwlock_wrlock(&inode_locks[inode_index]);
+
+  //message if file is read only and exists
+  if(inodes[inode_index].readonly)
+  {
+    fprintf(output, "File is labeled under READ ONLY, unable to delete\n");
+  }
+  else
+  {
+    // the entry stays in the directory so the file can be undeleted
+    entry.inUse = false;
+    leafUpdate(leaf, &entry);
+    indexRemove(inode_index);
+    inodes[inode_index].inUse = false;
+
+    // Delete file by setting all blocks used by file to free
+    releaseBlocks(inode_index);
+  }
+
+  unlockInode(inode_index);
+  unlockLeaf(leaf);
+  pthread_rwlock_unlock(&directory_lock);
+}
+
+// finds the given file and sets the file to in use and
+// as well as the associated inode and blocks with it
+void undelete(char* filename)
+{
+  struct _directoryEntry entry;
+
+  pthread_rwlock_rdlock(&directory_lock);
+  int32_t leaf = lockLeaf(filename, true);
+
+  if(!leafLookup(leaf, filename, &entry)) //notify user if the file doesn't exist
+  {
+    unlockLeaf(leaf);
+    pthread_rwlock_unlock(&directory_lock);
+    fprintf(output, "ERROR: File not found.\n");
+    return;
+  }
+
+  if(entry.inUse) //or wasn't deleted
+  {
+    unlockLeaf(leaf);
+    pthread_rwlock_unlock(&directory_lock);
+    fprintf(output, "File %s exists\n", filename);
+    return;
+  }
+
+  //flip the deleted file back to inuse and it's inode back as well
+  int32_t inode_index = entry.inode; //save index
+  pthread_rwlock_wrlock(&inode_locks[inode_index]);
+
+  entry.inUse = true;
+  leafUpdate(leaf, &entry);
+  inodes[inode_index].inUse = true;
+  indexAdd(inode_index, entry.name, inodes[inode_index].creation_time);
+
+  //take the file's references to its blocks back
+  int32_t blocks[BLOCKS_PER_FILE];
+  loadBlockList(inode_index, blocks);
+  for(int k = 0; k < inodes[inode_index].block_length; k++)
+  {
+    retainBlock(blocks[k]);
+  }
+
+  unlockInode(inode_index);
+  unlockLeaf(leaf);
+  pthread_rwlock_unlock(&directory_lock);
+
+  fprintf(output, "\"%s\" recovered\n", filename); //notify user of success
+}
+
+// gives the current image its memory and time index if it has none yet and points the
+// metadata at its memory. the memory is on huge pages when the kernel has them, the
+// metadata in front of FIRST_DATA_BLOCK fits in the first one
+void imageMemory()
+{
+  if(data == NULL)
+  {
+    data = hugeMemory(IMAGE_SIZE, &image_page);
+    if(data == NULL)
+    {
+      perror("mfs: reserving image memory failed");
+      exit(1);
+    }
+
+    time_index = (int32_t *)malloc(MAX_NUM_FILES * sizeof(int32_t));
+    entry_name = malloc(MAX_NUM_FILES * sizeof(*entry_name));
+    entry_time = (time_t *)malloc(MAX_NUM_FILES * sizeof(time_t));
+    entry_time_string = malloc(MAX_NUM_FILES * sizeof(*entry_time_string));
+    dirty_blocks = (uint8_t *)calloc(NUM_DATA_BLOCKS, 1);
+  }
+
+  super = (struct superblock*)&data[SUPERBLOCK][0];
+  inodes = (struct inode*)&data[FIRST_INODE_BLOCK][0];
+  block_refs = (uint8_t*)&data[BLOCK_REFS_BLOCK][0];
+  checksums = (uint32_t*)&data[CHECKSUM_BLOCK][0];
+  sync_map = (uint64_t*)&data[SYNC_MAP_BLOCK][0];
+  free_inodes = (uint8_t*)&data[FREE_INODE_BLOCK][0];
+  snapshots = (struct snapshot_table*)&data[SNAPSHOT_BLOCK][0];
+}
+
+// initialize all variables with default valuess
+void init()
+{
+  imageMemory();
+
+  memset(image_name, 0, 64);
+  memset(snapshots, 0, BLOCK_SIZE);
+  index_count = 0;
+  inode_cursor = 0;
+  alloc_cursor = 0;
+  snapshots->magic = REFCOUNT_MAGIC;
+
+  for(int i = 0; i < MAX_NUM_FILES; i++)
+  {
+    free_inodes[i] = 1;
+    memset(&inodes[i], 0, sizeof(struct inode));
+
+    for(int j = 0; j < INDEX_BLOCKS; j++)
+    {
+      inodes[i].index_blocks[j] = -1;
+    }
+  }
+
+  for(int i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    block_refs[i] = 0;
+  }
+  memset(sync_map, 0, SYNC_MAP_WORDS * sizeof(uint64_t));
+
+  memset(dirty_blocks, 0, NUM_DATA_BLOCKS);
+  dirty_count = 0;
+}
+
+// marks the data blocks whose contents don't matter and can be holes in the image
+// file: free blocks that no deleted file lists either, deleted files keep their blocks
+// for undelete until the blocks are reused. returns a malloc'ed map, 1 for a hole
+uint8_t *holeMap()
+{
+  uint8_t *holes = (uint8_t *)malloc(NUM_DATA_BLOCKS);
+  for(int32_t i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    holes[i] = block_refs[i] == 0;
+  }
+
+  int32_t blocks[BLOCKS_PER_FILE];
+  for(int32_t inode = 0; inode < MAX_NUM_FILES; inode++)
+  {
+    if(!free_inodes[inode] && !inodes[inode].inUse)
+    {
+      loadBlockList(inode, blocks);
+      for(int k = 0; k < inodes[inode].block_length; k++)
+      {
+        holes[blocks[k] - FIRST_DATA_BLOCK] = 0;
+      }
+    }
+  }
+  return holes;
+}
+
+// makes holes in the image file on fd for the runs of data blocks holes marks
+void punchHoles(int fd, uint8_t *holes)
+{
+  for(int32_t i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    int32_t run = 0;
+    while(i + run < NUM_DATA_BLOCKS && holes[i + run])
+    {
+      run++;
+    }
+
+    if(run > 0)
+    {
+      punchBlocks(fd, i + FIRST_DATA_BLOCK, run);
+      i += run;
+    }
+  }
+}
+
+// adds requests for the image memory from start to end to requests, in large chunks
+int imageRequests(struct io_request *requests, int count, size_t start, size_t end)
+{
+  for(size_t offset = start; offset < end; offset += IO_CHUNK)
+  {
+    requests[count].buffer = &data[0][0] + offset;
+    requests[count].length = end - offset < IO_CHUNK ? end - offset : IO_CHUNK;
+    requests[count].offset = offset;
+    count++;
+  }
+  return count;
+}
+
+#define DIRECT_ALIGN 4096   // O_DIRECT transfers start and end on these boundaries
+
+// full image loads and saves bypass the page cache with O_DIRECT when set
+bool direct_io = false;
+
+// opens an image file for a full load or save, with O_DIRECT when direct_io is set and
+// the file system takes it
+int openImageFile(char *filename, int flags)
+{
+  int fd = direct_io ? open(filename, flags | O_DIRECT, 0666) : -1;
+  if(fd == -1)
+  {
+    fd = open(filename, flags, 0666);
+  }
+  return fd;
+}
+
+// grows the image memory requests to DIRECT_ALIGN boundaries for O_DIRECT, merging the
+// ones that overlap then. the blocks gained are holes, written before they are punched
+// and read as the zeroes the file holds there. returns the new number of requests
+int alignRequests(struct io_request *requests, int count, size_t size)
+{
+  int merged = 0;
+  for(int i = 0; i < count; i++)
+  {
+    off_t start = requests[i].offset & ~(off_t)(DIRECT_ALIGN - 1);
+    off_t end = (requests[i].offset + requests[i].length + DIRECT_ALIGN - 1)
+      & ~(off_t)(DIRECT_ALIGN - 1);
+    if(end > (off_t)size)
+    {
+      end = size;
+    }
+
+    struct io_request *last = &requests[merged - 1];
+    if(merged > 0 && start < last->offset + (off_t)last->length)
+    {
+      if(end > last->offset + (off_t)last->length)
+      {
+        last->length = end - last->offset;
+      }
+      continue;
+    }
+
+    requests[merged].buffer = &data[0][0] + start;
+    requests[merged].length = end - start;
+    requests[merged].offset = start;
+    merged++;
+  }
+  return merged;
+}
+
+// reads (or writes) the first size bytes of the image memory from (or to) fd in large
+// chunks, all of them in flight at once. images are sparse: writes skip the data
+// blocks holeMap() marks and punch holes for them instead, reads find the holes with
+// SEEK_DATA and SEEK_HOLE and zero their memory without reading it
+int image_io(int fd, size_t size, bool write)
+{
+  SPAN(image_io);
+  struct io_request *requests =
+    (struct io_request *)malloc((size / 512 + 2) * sizeof(struct io_request));
+  int count = 0;
+
+  uint8_t *holes = NULL;
+  if(write)
+  {
+    // the whole image is written, or only the metadata in front of the data blocks
+    size_t metadata = (size_t)FIRST_DATA_BLOCK * BLOCK_SIZE;
+    count = imageRequests(requests, count, 0, size < metadata ? size : metadata);
+
+    if(size > metadata)
+    {
+      holes = holeMap();
+      for(int32_t i = 0; i < NUM_DATA_BLOCKS; i++)
+      {
+        int32_t run = 0;
+        while(i + run < NUM_DATA_BLOCKS && !holes[i + run])
+        {
+          run++;
+        }
+
+        if(run > 0)
+        {
+          size_t start = (size_t)(i + FIRST_DATA_BLOCK) * BLOCK_SIZE;
+          count = imageRequests(requests, count, start, start + (size_t)run * BLOCK_SIZE);
+          i += run;
+        }
+      }
+    }
+  }
+  else
+  {
+    struct stat buf;
+    fstat(fd, &buf);
+
+    size_t offset = 0;
+    while(offset < size)
+    {
+      // the next extent holding data, without SEEK_DATA the rest of the file is one
+      off_t start = lseek(fd, offset, SEEK_DATA);
+      off_t end = start == -1 ? -1 : lseek(fd, start, SEEK_HOLE);
+      if(start == -1)
+      {
+        start = errno == ENXIO ? (off_t)size : (off_t)offset;
+        end = errno == ENXIO ? (off_t)size : buf.st_size;
+      }
+      if(end == -1 || end > (off_t)size)
+      {
+        end = size;
+      }
+      if(start > end)
+      {
+        start = end;
+      }
+
+      if((size_t)start > offset)
+      {
+        dropImageMemory(offset, start - offset);
+      }
+      count = imageRequests(requests, count, start, end);
+
+      // an empty extent only happens past the end of the file, the rest is a hole
+      if(start == end && (size_t)end < size)
+      {
+        dropImageMemory(end, size - end);
+        end = size;
+      }
+      offset = end;
+    }
+  }
+
+  // O_DIRECT needs aligned transfers. a file system that took the flag at open but
+  // turns the transfers down gets them again through the page cache, and so does a
+  // file whose size isn't aligned, the last read would come back short
+  struct stat buf;
+  int flags = fcntl(fd, F_GETFL);
+  bool direct = flags != -1 && (flags & O_DIRECT) && fstat(fd, &buf) == 0
+    && (write || buf.st_size % DIRECT_ALIGN == 0);
+  if(direct)
+  {
+    count = alignRequests(requests, count, size);
+  }
+  else if(flags != -1 && (flags & O_DIRECT))
+  {
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+  }
+
+  int ret = io_batch(fd, requests, count, write);
+  if(ret == -1 && direct)
+  {
+    fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    ret = io_batch(fd, requests, count, write);
+  }
+  free(requests);
+
+  // the holes go last, a new image file is extended to its full size around them
+  if(holes != NULL)
+  {
+    punchHoles(fd, holes);
+    free(holes);
+
+    if(fstat(fd, &buf) == 0 && buf.st_size < (off_t)size && ftruncate(fd, size) == -1)
+    {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+#define MAX_IMAGES 64
+
+// an open image in the background. the current image's state is in the globals, its
+// memory, time index, allocation cursors and block cache, the other open images keep
+// theirs here. switching images swaps the two without reading or writing anything
+struct image
+{
+  bool open;
+  char name[64];
+  uint8_t (*data)[BLOCK_SIZE];
+  int32_t *time_index;
+  int32_t index_count;
+  char (*entry_name)[65];
+  time_t *entry_time;
+  char (*entry_time_string)[20];
+  size_t page;
+  int32_t inode_cursor;
+  int32_t alloc_cursor;
+  bool cache_mode;
+  int image_fd;
+  struct frame *frames;
+  uint8_t *frame_memory;
+  int num_frames;
+  int clock_hand;
+  int32_t *frame_of;
+  uint8_t *dirty_blocks;
+  int32_t dirty_count;
+};
+
+struct image images[MAX_IMAGES];
+
+#define SWAP(a, b) do { __typeof__(a) swap = (a); (a) = (b); (b) = swap; } while(0)
+
+// exchanges the state of the current image with the one parked in other. an unused
+// slot swapped in leaves an image that isn't open, with fresh memory
+void swapImage(struct image *other)
+{
+  char name[64];
+  memcpy(name, image_name, sizeof(name));
+  memcpy(image_name, other->name, sizeof(name));
+  memcpy(other->name, name, sizeof(name));
+
+  SWAP(image_open, other->open);
+  SWAP(data, other->data);
+  SWAP(time_index, other->time_index);
+  SWAP(index_count, other->index_count);
+  SWAP(entry_name, other->entry_name);
+  SWAP(entry_time, other->entry_time);
+  SWAP(entry_time_string, other->entry_time_string);
+  SWAP(image_page, other->page);
+  SWAP(inode_cursor, other->inode_cursor);
+  SWAP(alloc_cursor, other->alloc_cursor);
+  SWAP(cache_mode, other->cache_mode);
+  SWAP(image_fd, other->image_fd);
+  SWAP(frames, other->frames);
+  SWAP(frame_memory, other->frame_memory);
+  SWAP(num_frames, other->num_frames);
+  SWAP(clock_hand, other->clock_hand);
+  SWAP(frame_of, other->frame_of);
+  SWAP(dirty_blocks, other->dirty_blocks);
+  SWAP(dirty_count, other->dirty_count);
+
+  parked_images = 0;
+  for(int i = 0; i < MAX_IMAGES; i++)
+  {
+    parked_images += images[i].open;
+  }
+
+  imageMemory();
+  __atomic_add_fetch(&data_generation, 1, __ATOMIC_RELEASE);
+}
+
+// frees the slot of a parked image and everything it holds. unsaved changes are lost,
+// like closing the image
+void releaseImage(struct image *image)
+{
+  if(image->cache_mode)
+  {
+    close(image->image_fd);
+    free(image->frames);
+    munmap(image->frame_memory, hugeSize((size_t)image->num_frames * BLOCK_SIZE));
+    free(image->frame_of);
+  }
+
+  if(image->data != NULL)
+  {
+    munmap(image->data, IMAGE_SIZE);
+    free(image->time_index);
+    free(image->entry_name);
+    free(image->entry_time);
+    free(image->entry_time_string);
+    free(image->dirty_blocks);
+  }
+
+  parked_images -= image->open;
+  memset(image, 0, sizeof(struct image));
+  image->image_fd = -1;
+}
+
+// the slot of the parked image opened from filename, -1 if there is none
+int findImage(char *filename)
+{
+  for(int i = 0; i < MAX_IMAGES; i++)
+  {
+    if(images[i].open && strcmp(images[i].name, filename) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// makes room for opening filename: the image is closed if it is already open and the
+// current image goes to the background unless it is the one opened again. returns
+// false if too many images are open
+bool openImage(char *filename)
+{
+  int slot = findImage(filename);
+  if(slot != -1)
+  {
+    releaseImage(&images[slot]);
+  }
+
+  if(!image_open || strcmp(image_name, filename) == 0)
+  {
+    return true;
+  }
+
+  for(int i = 0; i < MAX_IMAGES; i++)
+  {
+    if(!images[i].open)
+    {
+      releaseImage(&images[i]);
+      swapImage(&images[i]);
+      return true;
+    }
+  }
+
+  fprintf(output, "ERROR: Too many images open, close one first.\n");
+  return false;
+}
+
+// makes an open image the current one. the current image stays open in the background
+void useImage(char *filename)
+{
+  if(image_open && strcmp(image_name, filename) == 0)
+  {
+    return;
+  }
+
+  int slot = findImage(filename);
+  if(slot == -1)
+  {
+    fprintf(output, "ERROR: Image %s is not open.\n", filename);
+    return;
+  }
+
+  swapImage(&images[slot]);
+  if(!images[slot].open)
+  {
+    releaseImage(&images[slot]);
+  }
+}
+
+// prints the open images, the current one marked with a *
+void listImages()
+{
+  int count = 0;
+  if(image_open)
+  {
+    fprintf(output, "* %s%s\n", image_name, cache_mode ? " (cached)" : "");
+    count++;
+  }
+
+  for(int i = 0; i < MAX_IMAGES; i++)
+  {
+    if(images[i].open)
+    {
+      fprintf(output, "  %s%s\n", images[i].name, images[i].cache_mode ? " (cached)" : "");
+      count++;
+    }
+  }
+
+  if(count == 0)
+  {
+    fprintf(output, "No images open.\n");
+  }
+}
+
+// create a file structure with the given name by the user
+void createfs(char *filename)
+{
+  if(!openImage(filename))
+  {
+    return;
+  }
+
+  cache_close();
+  fp = fopen(filename, "w");
+
+  //Set all data in data array to 0
+  dropImageMemory(0, IMAGE_SIZE);
+  init();
+  strncpy(image_name, filename, strlen(filename));
+
+  // an empty directory is a single empty leaf
+  struct directory_leaf root;
+  memset(&root, 0, sizeof(root));
+  root.next = -1;
+
+  super->magic = IMAGE_MAGIC;
+  super->directory_root = findFreeBlock(-1);
+  super->directory_height = 0;
+  super->flags = 0;
+  writeNode(super->directory_root, &root, sizeof(root));
+  image_open = true;
+
+  fclose(fp);
+}
+
+// save the contents of the disk image to the file
+void savefs()
+{
+  SPAN(savefs);
+  if(image_open == 0)
+  {
+    fprintf(output, "ERROR: Disk image is not open.\n");
+    return;
+  }
+  
+  // in cache mode only the metadata and the dirty cached blocks need writing, the
+  // rest of the image file is already up to date. blocks freed since the last save
+  // become holes first, so their dirty copies aren't written
+  if(cache_mode)
+  {
+    uint8_t *holes = holeMap();
+    punchHoles(image_fd, holes);
+    free(holes);
+
+    if(image_io(image_fd, FIRST_DATA_BLOCK * BLOCK_SIZE, true) == -1)
+    {
+      fprintf(output, "ERROR: Could not write the disk image.\n");
+    }
+    cache_flush();
+    return;
+  }
+
+  // the file isn't truncated, image_io() punches holes where blocks were freed
+  int fd = openImageFile(image_name, O_WRONLY | O_CREAT);
+
+  if(fd == -1)
+  {
+    fprintf(output, "ERROR: Could not open %s for writing.\n", image_name);
+    return;
+  }
+
+  if(image_io(fd, IMAGE_SIZE, true) == -1)
+  {
+    fprintf(output, "ERROR: Could not write the disk image.\n");
+  }
+  else
+  {
+    memset(dirty_blocks, 0, NUM_DATA_BLOCKS);
+    dirty_count = 0;
+    image_changed = false;
+  }
+
+  close(fd);
+}
+
+// what a flush writes: the metadata and the data blocks changed since the last flush,
+// copied out of the image so commands can go on changing it while the copy is written
+struct flush
+{
+  int fd;
+  uint8_t *buffer;
+  struct io_request *requests;
+  int count;
+  int32_t blocks;   // data blocks in the copy
+};
+
+// takes the copy for a flush, called with the image lock held exclusively so it is
+// taken between commands. the copied blocks count as clean from here on. in cache mode
+// there is no copy, the metadata and the dirty frames are written right away, at most
+// a cache full. returns false with the error printed if the image file can't be opened
+bool flushCopy(struct flush *f)
+{
+  memset(f, 0, sizeof(struct flush));
+  image_changed = false;
+
+  if(cache_mode)
+  {
+    f->fd = dup(image_fd);
+    for(int i = 0; i < num_frames; i++)
+    {
+      f->blocks += frames[i].block != -1 && frames[i].dirty;
+    }
+
+    bool written = image_io(image_fd, FIRST_DATA_BLOCK * BLOCK_SIZE, true) == 0;
+    cache_flush();
+    if(!written || f->fd == -1)
+    {
+      fprintf(output, "ERROR: Could not write the disk image.\n");
+      close(f->fd);
+      return false;
+    }
+    return true;
+  }
+
+  f->fd = open(image_name, O_WRONLY | O_CREAT, 0666);
+  if(f->fd == -1)
+  {
+    fprintf(output, "ERROR: Could not open %s for writing.\n", image_name);
+    return false;
+  }
+
+  size_t metadata = (size_t)FIRST_DATA_BLOCK * BLOCK_SIZE;
+  f->buffer = (uint8_t *)malloc(metadata + (size_t)dirty_count * BLOCK_SIZE);
+  f->requests = (struct io_request *)malloc((metadata / IO_CHUNK + 1 + dirty_count)
+    * sizeof(struct io_request));
+  memcpy(f->buffer, data, metadata);
+  for(size_t offset = 0; offset < metadata; offset += IO_CHUNK)
+  {
+    f->requests[f->count].buffer = f->buffer + offset;
+    f->requests[f->count].length = metadata - offset < IO_CHUNK ? metadata - offset : IO_CHUNK;
+    f->requests[f->count].offset = offset;
+    f->count++;
+  }
+
+  // runs of dirty blocks are consecutive in the copy as well and go out as one request
+  uint8_t *next = f->buffer + metadata;
+  for(int32_t i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    if(!dirty_blocks[i])
+    {
+      continue;
+    }
+
+    off_t offset = (off_t)(i + FIRST_DATA_BLOCK) * BLOCK_SIZE;
+    struct io_request *last = &f->requests[f->count - 1];
+    memcpy(next, data[i + FIRST_DATA_BLOCK], BLOCK_SIZE);
+    if(last->offset + (off_t)last->length == offset && last->length < IO_CHUNK)
+    {
+      last->length += BLOCK_SIZE;
+    }
+    else
+    {
+      f->requests[f->count].buffer = next;
+      f->requests[f->count].length = BLOCK_SIZE;
+      f->requests[f->count].offset = offset;
+      f->count++;
+    }
+
+    dirty_blocks[i] = 0;
+    next += BLOCK_SIZE;
+    f->blocks++;
+  }
+  dirty_count = 0;
+  return true;
+}
+
+// writes the copy of a flush to the image file and, for durable, waits until it is on
+// the disk. returns 0 on success or -1
+int flushWrite(struct flush *f, bool durable)
+{
+  int ret = io_batch(f->fd, f->requests, f->count, true);
+
+  // a new image file is extended to its full size
+  struct stat buf;
+  if(ret == 0 && fstat(f->fd, &buf) == 0 && buf.st_size < (off_t)IMAGE_SIZE
+    && ftruncate(f->fd, IMAGE_SIZE) == -1)
+  {
+    ret = -1;
+  }
+
+  if(ret == 0 && durable && fsync(f->fd) == -1)
+  {
+    ret = -1;
+  }
+
+  close(f->fd);
+  free(f->buffer);
+  free(f->requests);
+  return ret;
+}
+
+// writes the changes of the current image to its file and waits until they are on the
+// disk. commands wait for it, unlike the background flushes
+void syncImage()
+{
+  if(!image_open)
+  {
+    fprintf(output, "ERROR: Disk image is not open.\n");
+    return;
+  }
+
+  struct flush f;
+  if(!flushCopy(&f))
+  {
+    return;
+  }
+
+  int32_t blocks = f.blocks;
+  if(flushWrite(&f, true) == -1)
+  {
+    fprintf(output, "ERROR: Could not write the disk image.\n");
+    return;
+  }
+
+  fprintf(output, "Synced %s, %d changed blocks written.\n", image_name, blocks);
+}
+
+// held while a flush is written, whole image commands take it as well so they don't run
+// until the image file is up to date
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the background flusher. every flush_interval seconds, or when flush_threshold data
+// blocks are dirty, it copies the changes of the current image between two commands and
+// writes them to the image file while commands go on. only changes are flushed, an
+// image nobody wrote to since the last flush or savefs is left alone
+void *flusher(void *arg)
+{
+  output = stderr;
+  pthread_mutex_lock(&flusher_mutex);
+
+  while(true)
+  {
+    int32_t dirty = __atomic_load_n(&dirty_count, __ATOMIC_RELAXED);
+    if(flush_interval > 0 && !(flush_threshold > 0 && dirty >= flush_threshold))
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += flush_interval;
+      pthread_cond_timedwait(&flusher_cond, &flusher_mutex, &deadline);
+    }
+    else if(!(flush_threshold > 0 && dirty >= flush_threshold))
+    {
+      pthread_cond_wait(&flusher_cond, &flusher_mutex);
+    }
+
+    if(flush_interval == 0 && flush_threshold == 0)
+    {
+      continue;
+    }
+    pthread_mutex_unlock(&flusher_mutex);
+
+    pthread_rwlock_wrlock(&image_lock);
+    char name[64];
+    memcpy(name, image_name, sizeof(name));
+    struct flush f;
+    bool copied = image_open && (image_changed || dirty_count > 0) && flushCopy(&f);
+
+    pthread_mutex_lock(&flush_lock);
+    pthread_rwlock_unlock(&image_lock);
+    if(copied && flushWrite(&f, false) == -1)
+    {
+      fprintf(output, "ERROR: Could not flush %s.\n", name);
+    }
+    pthread_mutex_unlock(&flush_lock);
+
+    pthread_mutex_lock(&flusher_mutex);
+  }
+  return NULL;
+}
+
+// tells when the background flusher runs
+void flushStatus()
+{
+  if(flush_interval > 0 && flush_threshold > 0)
+  {
+    fprintf(output, "Flushing every %d seconds or at %d dirty blocks.\n", flush_interval,
+      flush_threshold);
+  }
+  else if(flush_interval > 0)
+  {
+    fprintf(output, "Flushing every %d seconds.\n", flush_interval);
+  }
+  else if(flush_threshold > 0)
+  {
+    fprintf(output, "Flushing at %d dirty blocks.\n", flush_threshold);
+  }
+  else
+  {
+    fprintf(output, "Background flushing is off.\n");
+  }
+}
+
+// sets how often the background flusher runs and starts it the first time. interval is
+// in seconds and threshold in dirty blocks, both 0 stops flushing
+void flushSettings(int interval, int32_t threshold)
+{
+  static bool started = false;
+
+  pthread_mutex_lock(&flusher_mutex);
+  flush_interval = interval;
+  flush_threshold = threshold;
+  if(!started && (interval > 0 || threshold > 0))
+  {
+    pthread_t thread;
+    started = pthread_create(&thread, NULL, flusher, NULL) == 0;
+    if(started)
+    {
+      pthread_detach(thread);
+    }
+  }
+  pthread_cond_signal(&flusher_cond);
+  pthread_mutex_unlock(&flusher_mutex);
+
+  flushStatus();
+}
+
+// orders directory entries by name, for building the directory tree
+int compareEntryNames(const void *a, const void *b)
+{
+  const struct _directoryEntry *x = a;
+  const struct _directoryEntry *y = b;
+  int order = strncmp(x->name, y->name, 64);
+  return order != 0 ? order : x->inode - y->inode;
+}
+
+// open the file structure specified by the user
+// with a cache size (in KB) greater than 0 only the metadata is loaded and the data
+// blocks are read through the block cache, otherwise the whole image is loaded
+void openfs(char *filename, int cache_kb)
+{
+  SPAN(openfs);
+  // a cache reads single blocks, only a full load can go around the page cache
+  int fd = cache_kb > 0 ? open(filename, O_RDWR) : openImageFile(filename, O_RDONLY);
+
+  if(fd == -1)
+  {
+    fprintf(output, "ERROR: File could not be openned.\n");
+    return;
+  }
+
+  if(!openImage(filename))
+  {
+    close(fd);
+    return;
+  }
+
+  cache_close();
+  init();
+
+  strncpy(image_name, filename, strlen(filename));
+
+  // only the extents of the file holding data are read, holes and anything past the
+  // end of a short file read as zeroes
+  size_t size = cache_kb > 0 ? FIRST_DATA_BLOCK * BLOCK_SIZE : IMAGE_SIZE;
+  if(image_io(fd, size, false) == -1)
+  {
+    fprintf(output, "ERROR: Could not read the disk image.\n");
+  }
+
+  if(cache_kb > 0)
+  {
+    cache_open(fd, cache_kb);
+  }
+  else
+  {
+    close(fd);
+  }
+
+  // anything else, images of the first mfs with their flat directory included, has
+  // block numbers and inodes this layout can't make sense of
+  if(super->magic != IMAGE_MAGIC || snapshots->magic != REFCOUNT_MAGIC)
+  {
+    fprintf(output, "ERROR: %s is not a disk image of this version of mfs.\n", filename);
+    cache_close();
+    init();
+    image_open = false;
+    return;
+  }
+
+  indexRebuild();
+  image_open = true;
+}
+
+// close the current openned file structure, if there is one open
+void closefs()
+{
+  if(image_open == false)
+  {
+    fprintf(output, "ERROR: Disk image is not open.\n");
+    return;
+  }
+  
+  //fclose(fp);
+  cache_close();
+  dropImageMemory(0, IMAGE_SIZE);
+  
+  memset(dirty_blocks, 0, NUM_DATA_BLOCKS);
+  dirty_count = 0;
+  image_open = false;
+  memset(image_name, 0, 64);
+}
+
+#define SORT_NAME 0
+#define SORT_SIZE 1
+#define SORT_TIME 2
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV 2
+
+// what list prints and how
+struct list_options
+{
+  bool hidden;        // -h, list hidden files too
+  bool attributes;    // -a, print the attributes
+  int sort;           // -s name|size|time
+  bool reverse;       // -r
+  int format;         // --json or --csv
+  char *pattern;      // name prefix, or a glob if it has wildcards
+  int offset;         // --offset, entries to skip
+  int limit;          // --limit, entries to print at most, 0 for all
+};
+
+// a listed file, copied out of its inode
+struct list_row
+{
+  int32_t inode;
+  uint32_t size;
+  bool hidden;
+  bool readonly;
+};
+
+// list output is collected here and written with one call
+struct text_buffer
+{
+  char *text;
+  size_t length;
+  size_t size;
+};
+
+void bufferAppend(struct text_buffer *buffer, const char *text, size_t length)
+{
+  if(buffer->length + length > buffer->size)
+  {
+    while(buffer->length + length > buffer->size)
+    {
+      buffer->size *= 2;
+    }
+    buffer->text = (char *)realloc(buffer->text, buffer->size);
+  }
+
+  memcpy(buffer->text + buffer->length, text, length);
+  buffer->length += length;
+}
+
+void bufferString(struct text_buffer *buffer, const char *text)
+{
+  bufferAppend(buffer, text, strlen(text));
+}
+
+// appends text left aligned in a field of width characters, like %-*s
+void bufferPadded(struct text_buffer *buffer, const char *text, int width)
+{
+  static const char spaces[] = "                                                                 ";
+  int length = strlen(text);
+  bufferAppend(buffer, text, length);
+  if(length < width)
+  {
+    bufferAppend(buffer, spaces, width - length);
+  }
+}
+
+// appends a number left aligned in a field of width characters, like %-*u
+void bufferNumber(struct text_buffer *buffer, uint32_t number, int width)
+{
+  char digits[16];
+  int length = 0;
+  do
+  {
+    digits[length++] = '0' + number % 10;
+    number /= 10;
+  } while(number > 0);
+
+  char text[16];
+  for(int i = 0; i < length; i++)
+  {
+    text[i] = digits[length - 1 - i];
+  }
+  text[length] = 0;
+  bufferPadded(buffer, text, width);
+}
+
+// appends a name as a JSON string or CSV field
+void bufferQuoted(struct text_buffer *buffer, const char *name, int format)
+{
+  if(format == FORMAT_CSV && strpbrk(name, ",\"\r\n") == NULL)
+  {
+    bufferAppend(buffer, name, strlen(name));
+    return;
+  }
+
+  bufferAppend(buffer, "\"", 1);
+  for(const char *c = name; *c; c++)
+  {
+    if(*c == '"')
+    {
+      bufferAppend(buffer, format == FORMAT_CSV ? "\"\"" : "\\\"", 2);
+    }
+    else if(format == FORMAT_JSON && *c == '\\')
+    {
+      bufferAppend(buffer, "\\\\", 2);
+    }
+    else if(format == FORMAT_JSON && (unsigned char)*c < 0x20)
+    {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", *c);
+      bufferAppend(buffer, escape, 6);
+    }
+    else
+    {
+      bufferAppend(buffer, c, 1);
+    }
+  }
+  bufferAppend(buffer, "\"", 1);
+}
+
+// qsort orderings of the listed rows
+int compareRowSizes(const void *a, const void *b)
+{
+  const struct list_row *x = a;
+  const struct list_row *y = b;
+  if(x->size != y->size)
+  {
+    return x->size < y->size ? -1 : 1;
+  }
+  return strcmp(entry_name[x->inode], entry_name[y->inode]);
+}
+
+int compareRowTimes(const void *a, const void *b)
+{
+  return compareTimes(((struct list_row *)a)->inode, ((struct list_row *)b)->inode);
+}
+
+// the rows list collects while scanning the directory
+struct list_scan
+{
+  struct list_options *options;
+  struct list_row *rows;
+  int count;
+  size_t prefix_length;
+  bool glob;
+  int wanted;       // rows after which the scan can stop, 0 to scan to the end
+};
+
+// copies what we print out of the inode under its lock, skipping hidden files unless
+// they are asked for
+void listAdd(struct list_scan *scan, int32_t inode)
+{
+  // a file deleted and its inode reused during the scan may come up twice
+  if(scan->count == MAX_NUM_FILES)
+  {
+    return;
+  }
+
+  struct list_row *row = &scan->rows[scan->count];
+
+  pthread_rwlock_rdlock(&inode_locks[inode]);
+  row->inode = inode;
+  row->size = inodes[inode].file_size;
+  row->hidden = inodes[inode].hidden;
+  row->readonly = inodes[inode].readonly;
+  pthread_rwlock_unlock(&inode_locks[inode]);
+
+  if(!row->hidden || scan->options->hidden)
+  {
+    scan->count++;
+  }
+}
+
+bool listEntry(struct _directoryEntry *entry, void *arg)
+{
+  struct list_scan *scan = arg;
+  char *pattern = scan->options->pattern;
+
+  // the names with the prefix are next to each other, the first one past them ends it
+  if(pattern != NULL && strncmp(entry->name, pattern, scan->prefix_length) != 0)
+  {
+    return false;
+  }
+
+  if(entry->inUse && (!scan->glob || fnmatch(pattern, entry->name, 0) == 0))
+  {
+    listAdd(scan, entry->inode);
+  }
+
+  return scan->wanted == 0 || scan->count < scan->wanted;
+}
+
+// lists the file with the creation time, and size. also will print out
+// if the file is hidden or read only if the flag is set.
+// the directory tree is in name order: a prefix (the part of a glob in front of its
+// first wildcard) is looked up in the tree and the scan stops behind the last name with
+// it, and a page of the listing in name order stops the scan once it is filled
+void list(struct list_options *options)
+{
+  struct list_scan scan;
+  memset(&scan, 0, sizeof(scan));
+  scan.options = options;
+
+  // files may be added and deleted while we scan, a listing shows each leaf as it was
+  // when the scan got to it
+  pthread_rwlock_rdlock(&directory_lock);
+
+  scan.rows = (struct list_row *)malloc(MAX_NUM_FILES * sizeof(struct list_row));
+
+  if(options->sort == SORT_TIME && options->pattern == NULL)
+  {
+    // the index is copied first, its lock can't be held while the inodes are locked
+    pthread_rwlock_rdlock(&index_lock);
+    int32_t count = index_count;
+    int32_t *inodes_by_time = (int32_t *)malloc((count + 1) * sizeof(int32_t));
+    memcpy(inodes_by_time, time_index, count * sizeof(int32_t));
+    pthread_rwlock_unlock(&index_lock);
+
+    for(int i = 0; i < count; i++)
+    {
+      listAdd(&scan, inodes_by_time[i]);
+    }
+    free(inodes_by_time);
+  }
+  else
+  {
+    char *start = "";
+    if(options->pattern != NULL)
+    {
+      scan.prefix_length = strcspn(options->pattern, "*?[");
+      scan.glob = options->pattern[scan.prefix_length] != 0;
+      start = strndup(options->pattern, scan.prefix_length);
+    }
+
+    if(options->sort == SORT_NAME && !options->reverse && options->limit > 0)
+    {
+      scan.wanted = options->offset + options->limit;
+    }
+
+    directoryScan(start, listEntry, &scan);
+
+    if(options->pattern != NULL)
+    {
+      free(start);
+    }
+  }
+
+  pthread_rwlock_unlock(&directory_lock);
+
+  // the names and times of the rows are read from the index
+  pthread_rwlock_rdlock(&index_lock);
+  struct list_row *rows = scan.rows;
+  int count = scan.count;
+
+  // the scan is in name (or time) order already
+  if(options->sort == SORT_SIZE)
+  {
+    qsort(rows, count, sizeof(struct list_row), compareRowSizes);
+  }
+  else if(options->sort == SORT_TIME && options->pattern != NULL)
+  {
+    qsort(rows, count, sizeof(struct list_row), compareRowTimes);
+  }
+
+  if(options->reverse)
+  {
+    for(int i = 0; i < count / 2; i++)
+    {
+      struct list_row row = rows[i];
+      rows[i] = rows[count - 1 - i];
+      rows[count - 1 - i] = row;
+    }
+  }
+
+  // the page to print
+  int first = options->offset < count ? options->offset : count;
+  int last = count;
+  if(options->limit > 0 && first + options->limit < count)
+  {
+    last = first + options->limit;
+  }
+
+  struct text_buffer buffer = { (char *)malloc(16384), 0, 16384 };
+
+  if(options->format == FORMAT_TEXT)
+  {
+    bufferPadded(&buffer, "Directory List", 65);
+    bufferPadded(&buffer, "Byte Size", 15);
+    bufferPadded(&buffer, "Time", 25);
+    if(options->attributes)
+    {
+      bufferPadded(&buffer, "Hidden", 15);
+      bufferPadded(&buffer, "Read Only", 15);
+    }
+    bufferAppend(&buffer, "\n", 1);
+  }
+  else if(options->format == FORMAT_JSON)
+  {
+    bufferAppend(&buffer, "[", 1);
+  }
+  else
+  {
+    bufferString(&buffer, "name,size,time,hidden,readonly\n");
+  }
+
+  for(int i = first; i < last; i++)
+  {
+    struct list_row *row = &rows[i];
+    char *name = entry_name[row->inode];
+    char *time_string = entry_time_string[row->inode];
+
+    if(options->format == FORMAT_TEXT)
+    {
+      bufferPadded(&buffer, name, 65);
+      bufferNumber(&buffer, row->size, 15);
+      bufferPadded(&buffer, time_string, 25);
+
+      //If user requests attributes, display 1 indicating it hidden or read-only, otherwise 0
+      if(options->attributes)
+      {
+        bufferNumber(&buffer, row->hidden, 15);
+        bufferNumber(&buffer, row->readonly, 15);
+      }
+      bufferAppend(&buffer, "\n", 1);
+    }
+    else if(options->format == FORMAT_JSON)
+    {
+      bufferString(&buffer, i > first ? ",\n{\"name\":" : "\n{\"name\":");
+      bufferQuoted(&buffer, name, FORMAT_JSON);
+      bufferString(&buffer, ",\"size\":");
+      bufferNumber(&buffer, row->size, 0);
+      bufferString(&buffer, ",\"time\":\"");
+      bufferString(&buffer, time_string);
+      bufferString(&buffer, row->hidden ? "\",\"hidden\":true" : "\",\"hidden\":false");
+      bufferString(&buffer, row->readonly ? ",\"readonly\":true}" : ",\"readonly\":false}");
+    }
+    else
+    {
+      bufferQuoted(&buffer, name, FORMAT_CSV);
+      bufferAppend(&buffer, ",", 1);
+      bufferNumber(&buffer, row->size, 0);
+      bufferAppend(&buffer, ",", 1);
+      bufferString(&buffer, time_string);
+      bufferString(&buffer, row->hidden ? ",1" : ",0");
+      bufferString(&buffer, row->readonly ? ",1\n" : ",0\n");
+    }
+  }
+
+  pthread_rwlock_unlock(&index_lock);
+  free(rows);
+
+  if(options->format == FORMAT_JSON)
+  {
+    bufferString(&buffer, count > 0 ? "\n]\n" : "]\n");
+  }
+  else if(options->format == FORMAT_TEXT && count == 0)
+  {
+    bufferString(&buffer, "No files found.\n");
+  }
+
+  fwrite(buffer.text, 1, buffer.length, output);
+  free(buffer.text);
+}
+
+// reads the list options out of the command line, returns false on a bad option
+bool listOptions(char **token, int token_count, struct list_options *options)
+{
+  memset(options, 0, sizeof(*options));
+
+  for(int i = 1; i < token_count && i < MAX_NUM_ARGUMENTS; i++)
+  {
+    if(token[i] == NULL)
+    {
+      continue;
+    }
+
+    bool has_value = i + 1 < token_count && i + 1 < MAX_NUM_ARGUMENTS && token[i + 1] != NULL;
+
+    if(strcmp(token[i], "-h") == 0)
+    {
+      options->hidden = true;
+    }
+    else if(strcmp(token[i], "-a") == 0)
+    {
+      options->attributes = true;
+    }
+    else if(strcmp(token[i], "-r") == 0)
+    {
+      options->reverse = true;
+    }
+    else if(strcmp(token[i], "--json") == 0)
+    {
+      options->format = FORMAT_JSON;
+    }
+    else if(strcmp(token[i], "--csv") == 0)
+    {
+      options->format = FORMAT_CSV;
+    }
+    else if(strcmp(token[i], "-s") == 0 && has_value)
+    {
+      i++;
+      if(strcmp(token[i], "name") == 0)
+      {
+        options->sort = SORT_NAME;
+      }
+      else if(strcmp(token[i], "size") == 0)
+      {
+        options->sort = SORT_SIZE;
+      }
+      else if(strcmp(token[i], "time") == 0)
+      {
+        options->sort = SORT_TIME;
+      }
+      else
+      {
+        return false;
+      }
+    }
+    else if(strcmp(token[i], "--limit") == 0 && has_value)
+    {
+      options->limit = atoi(token[++i]);
+    }
+    else if(strcmp(token[i], "--offset") == 0 && has_value)
+    {
+      options->offset = atoi(token[++i]);
+    }
+    else if(token[i][0] != '-' && options->pattern == NULL)
+    {
+      options->pattern = token[i];
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  return options->limit >= 0 && options->offset >= 0;
+}
+
+// publishes the inserted file under its name. a deleted file with the same name can't be
+// undeleted any more, its entry is taken over and its inode freed. returns 0 on success,
+// -1 if a file with the name exists and -2 if there's no space for the directory to grow
+int addEntry(char *filename, int32_t inode)
+{
+  struct _directoryEntry entry;
+  struct _directoryEntry old;
+  int ret = 1;
+
+  // set the filename to the one specified by the user
+  memset(&entry, 0, sizeof(entry));
+  strncpy(entry.name, filename, 64);
+  entry.inode = inode;
+  entry.inUse = true;
+
+  // most entries go into a leaf with room and only lock that leaf. when the leaf is
+  // full the tree is locked exclusively for the split and the name looked up again
+  for(int pass = 0; pass < 2 && ret == 1; pass++)
+  {
+    if(pass == 0)
+    {
+      pthread_rwlock_rdlock(&directory_lock);
+    }
+    else
+    {
+      pthread_rwlock_wrlock(&directory_lock);
+    }
+    int32_t leaf = lockLeaf(filename, true);
+
+    if(leafLookup(leaf, filename, &old))
+    {
+      ret = old.inUse ? -1 : 0;
+      if(!old.inUse)
+      {
+        leafUpdate(leaf, &entry);
+        freeInode(old.inode);
+      }
+    }
+    else if(leafInsert(leaf, &entry))
+    {
+      ret = 0;
+    }
+    else if(pass == 1)
+    {
+      ret = directoryInsert(&entry) == 0 ? 0 : -2;
+    }
+
+    if(ret == 0)
+    {
+      indexAdd(inode, entry.name, inodes[inode].creation_time);
+    }
+
+    unlockLeaf(leaf);
+    pthread_rwlock_unlock(&directory_lock);
+  }
+
+  return ret;
+}
+
+// true if a file that isn't deleted has the name
+bool fileExists(char *filename)
+{
+  struct _directoryEntry entry;
+
+  pthread_rwlock_rdlock(&directory_lock);
+  bool exists = directoryLookup(filename, &entry) && entry.inUse;
+  pthread_rwlock_unlock(&directory_lock);
+
+  return exists;
+}
+
+// takes a free inode for a new file of size bytes, created now, and reserves all of its
+// blocks in one go. they are always fresh blocks, a new file never writes to blocks a
+// snapshot shares. the file isn't in the directory until publishFile(). returns the
+// inode or -1 with the error printed
+int32_t createFile(uint32_t size)
+{
+  // find a free inode
+  int32_t inode_index = findFreeInode();
+
+  if(inode_index == -1)
+  {
+    fprintf(output, "ERROR: Can not find free inode.\n");
+    return -1;
+  }
+
+  // a free inode has no block list
+  inodes[inode_index].block_length = 0;
+
+  if(allocateBlocks(inode_index, (size + BLOCK_SIZE - 1) / BLOCK_SIZE) == -1)
+  {
+    fprintf(output, "ERROR: Can not find a free block.\n");
+    freeInode(inode_index);
+    return -1;
+  }
+
+  inodes[inode_index].file_size = size;
+  inodes[inode_index].creation_time = time(NULL);
+  inodes[inode_index].inUse = true;
+  inodes[inode_index].hidden = false;
+  inodes[inode_index].readonly = false;
+  return inode_index;
+}
+
+// gives back the inode and blocks of a file from createFile() that isn't published
+void discardFile(int32_t inode_index)
+{
+  releaseBlocks(inode_index);
+  freeInode(inode_index);
+}
+
+// places a file from createFile() in the directory under filename. if the name is
+// taken or the directory has no room the file is discarded and false returned
+bool publishFile(char *filename, int32_t inode_index)
+{
+  int added = addEntry(filename, inode_index);
+  if(added != 0)
+  {
+    fprintf(output, added == -1 ? "ERROR: File already exists.\n"
+      : "ERROR: Not enough free disk space.\n");
+    discardFile(inode_index);
+    return false;
+  }
+
+  return true;
+}
+
+// inserts a file of unknown length, read from a pipe, a FIFO or stdin, under name. the
+// input is read IO_CHUNK bytes at a time and the blocks for each chunk are allocated as
+// it arrives. input that grows past MAX_FILE_SIZE, runs out of space or fails to read
+// discards everything written so far, the file only appears once it is complete
+void insertStream(FILE *input, char *name)
+{
+  SPAN(insertStream);
+  if(strlen(name) > 64)
+  {
+    fprintf(output, "ERROR: Filename is too large.\n");
+    return;
+  }
+
+  if(fileExists(name))
+  {
+    fprintf(output, "ERROR: File already exists.\n");
+    return;
+  }
+
+  int32_t inode_index = createFile(0);
+  if(inode_index == -1)
+  {
+    return;
+  }
+
+  uint8_t *chunk = (uint8_t *)malloc(IO_CHUNK);
+  int32_t blocks[BLOCKS_PER_FILE];
+  uint32_t size = 0;
+  char *error = NULL;
+
+  // fread only comes back short at the end of the input, so every chunk but the last
+  // fills whole blocks and the next one starts on a fresh block
+  size_t length;
+  while(error == NULL && (length = fread(chunk, 1, IO_CHUNK, input)) > 0)
+  {
+    if(size + length > MAX_FILE_SIZE)
+    {
+      error = "ERROR: File is too large.\n";
+      break;
+    }
+
+    int count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if(allocateBlocks(inode_index, count) == -1)
+    {
+      error = "ERROR: Not enough free disk space.\n";
+      break;
+    }
+
+    loadBlockList(inode_index, blocks);
+    int first = size / BLOCK_SIZE;
+    for(int k = 0; k < count; k++)
+    {
+      size_t offset = (size_t)k * BLOCK_SIZE;
+      size_t bytes = length - offset < BLOCK_SIZE ? length - offset : BLOCK_SIZE;
+      uint8_t *buffer = getBlock(blocks[first + k], BLOCK_NEW);
+      memcpy(buffer, chunk + offset, bytes);
+      setChecksum(blocks[first + k], buffer);
+      putBlock(blocks[first + k]);
+    }
+
+    size += length;
+    inodes[inode_index].file_size = size;
+  }
+
+  if(error == NULL && ferror(input))
+  {
+    error = "ERROR: An error occured reading from the input file.\n";
+  }
+
+  free(chunk);
+
+  if(error != NULL)
+  {
+    fprintf(output, "%s", error);
+    discardFile(inode_index);
+    return;
+  }
+
+  publishFile(name, inode_index);
+}
+
+// creates filename as an empty file with size bytes worth of blocks reserved for it,
+// all taken in one allocateBlocks() call so they form a single run when free space
+// allows. an insert or update of the file later writes into the reserved blocks instead
+// of allocating, and the file keeps them while it is shorter than the reservation
+void reserve(char *filename, uint32_t size)
+{
+  if(strlen(filename) > 64)
+  {
+    fprintf(output, "ERROR: Filename is too large.\n");
+    return;
+  }
+
+  if(size > MAX_FILE_SIZE)
+  {
+    fprintf(output, "ERROR: File is too large.\n");
+    return;
+  }
+
+  if(size > df())
+  {
+    fprintf(output, "ERROR: Not enough free disk space.\n");
+    return;
+  }
+
+  if(fileExists(filename))
+  {
+    fprintf(output, "ERROR: File already exists.\n");
+    return;
+  }
+
+  int32_t inode_index = createFile(size);
+  if(inode_index == -1)
+  {
+    return;
+  }
+
+  // the reserved blocks read as zeroes and pass scrub until something is written to them
+  int32_t blocks[BLOCKS_PER_FILE];
+  int length = inodes[inode_index].block_length;
+  int runs = 0;
+  loadBlockList(inode_index, blocks);
+  for(int k = 0; k < length; k++)
+  {
+    uint8_t *block = getBlock(blocks[k], BLOCK_NEW);
+    memset(block, 0, BLOCK_SIZE);
+    setChecksum(blocks[k], block);
+    putBlock(blocks[k]);
+    runs += k == 0 || blocks[k] != blocks[k - 1] + 1;
+  }
+  inodes[inode_index].file_size = 0;
+
+  if(publishFile(filename, inode_index))
+  {
+    fprintf(output, "Reserved %d blocks for %s in %d run%s.\n", length, filename, runs,
+      runs == 1 ? "" : "s");
+  }
+}
+
+// fills the blocks reserved for filename with size bytes of the host file ifd. blocks are
+// only allocated when the contents outgrow the reservation, reserved blocks a snapshot
+// shares are copied first. returns false if filename is no empty file with reserved
+// blocks, with nothing done
+bool insertReserved(char *filename, int ifd, uint32_t size)
+{
+  int32_t inode = lockFile(filename, true);
+  if(inode == -1)
+  {
+    return false;
+  }
+
+  int length = inodes[inode].block_length;
+  if(inodes[inode].file_size != 0 || length == 0)
+  {
+    unlockInode(inode);
+    return false;
+  }
+
+  if(inodes[inode].readonly)
+  {
+    fprintf(output, "File is labeled under READ ONLY, unable to insert\n");
+    unlockInode(inode);
+    return true;
+  }
+
+  int32_t blocks[BLOCKS_PER_FILE];
+  int needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  bool space = true;
+  loadBlockList(inode, blocks);
+  for(int k = 0; k < needed && k < length && space; k++)
+  {
+    space = unshareBlock(blocks, k) != -1;
+  }
+  storeBlockList(inode, blocks, length);
+
+  if(space && needed > length)
+  {
+    space = allocateBlocks(inode, needed - length) != -1;
+  }
+
+  if(!space)
+  {
+    fprintf(output, "ERROR: Not enough free disk space.\n");
+  }
+  else if(file_io(ifd, inode, size, false) == -1)
+  {
+    fprintf(output, "ERROR: An error occured reading from the input file.\n");
+  }
+  else
+  {
+    inodes[inode].file_size = size;
+  }
+
+  unlockInode(inode);
+  return true;
+}
+
+// inserts the file specified by the user into the disk image
+void insert(char *filename)
+{
+  SPAN(insert);
+  // verify the filename isn't NULL
+  if(filename == NULL)
+  {
+    fprintf(output, "ERROR: Unspecified file.\n");
+    return;
+  }
+
+  // verify the file exists
+  struct stat buf;
+  int ret = stat(filename, &buf);
+
+  if(ret == -1)
+  {
+    fprintf(output, "ERROR: File does not exist.\n");
+    return;
+  }
+
+  // checks to see if the filename length is 64 or less
+  if(strlen(filename) > 64)
+  {
+    fprintf(output, "ERROR: Filename is too large.\n");
+    return;
+  }
+
+  // FIFOs and other files without a size up front are streamed in
+  if(!S_ISREG(buf.st_mode))
+  {
+    FILE *input = fopen(filename, "r");
+    if(input == NULL)
+    {
+      fprintf(output, "ERROR: Could not open the input file.\n");
+      return;
+    }
+
+    insertStream(input, filename);
+    fclose(input);
+    return;
+  }
+
+  // verify the file isn't too big
+  if(buf.st_size > MAX_FILE_SIZE)
+  {
+    fprintf(output, "ERROR: File is too large.\n");
+    return;
+  }
+
+  // open the input file read-only 
+  int ifd = open(filename, O_RDONLY);
+
+  if(ifd == -1)
+  {
+    fprintf(output, "ERROR: Could not open the input file.\n");
+    return;
+  }
+
+  // names are unique, check before copying anything. the entry is only added once the
+  // file is in the image, so nobody sees a half-inserted file. a file made by reserve
+  // takes the contents into its reserved blocks instead
+  if(fileExists(filename))
+  {
+    if(!insertReserved(filename, ifd, buf.st_size))
+    {
+      fprintf(output, "ERROR: File already exists.\n");
+    }
+    close(ifd);
+    return;
+  }
+
+  // verify there is enough space
+  if(buf.st_size > df())
+  {
+    fprintf(output, "ERROR: Not enough free disk space.\n");
+    close(ifd);
+    return;
+  }
+
+  // store the file size to keep track of how much is left
+  int32_t copy_size = buf.st_size;
+
+  int32_t inode_index = createFile(copy_size);
+  if(inode_index == -1)
+  {
+    close(ifd);
+    return;
+  }
+
+  // read the file straight into its blocks, one read per run of consecutive blocks and
+  // all of them in flight at the same time
+  if(file_io(ifd, inode_index, copy_size, false) == -1)
+  {
+    fprintf(output, "ERROR: An error occured reading from the input file.\n");
+    discardFile(inode_index);
+    close(ifd);
+    return;
+  }
+
+  // We are done copying from the input file so close it out.
+  close(ifd);
+
+  // place the file info in to directory
+  publishFile(filename, inode_index);
+}
+
+// brings a file in the disk image up to date with the host file of the same name. the
+// host file is compared with the stored file a block at a time and only the blocks that
+// differ are written, so a small edit of a large file only costs the blocks it touched.
+// a block whose checksum differs from the new contents' checksum is known to differ
+// without reading it, blocks with matching checksums are compared byte for byte. the
+// file grows or shrinks at its end to the new size
+void update(char *filename)
+{
+  struct stat buf;
+  if(stat(filename, &buf) == -1)
+  {
+    fprintf(output, "ERROR: File does not exist.\n");
+    return;
+  }
+
+  if(buf.st_size > MAX_FILE_SIZE)
+  {
+    fprintf(output, "ERROR: File is too large.\n");
+    return;
+  }
+
+  int ifd = open(filename, O_RDONLY);
+  if(ifd == -1)
+  {
+    fprintf(output, "ERROR: Could not open the input file.\n");
+    return;
+  }
+
+  // the new contents, with the last block padded with zeros like a stored block
+  int new_length = (buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint8_t *contents = (uint8_t *)calloc(new_length > 0 ? new_length : 1, BLOCK_SIZE);
+  size_t done = 0;
+  ssize_t got = 1;
+  while(done < (size_t)buf.st_size && got > 0)
+  {
+    got = read(ifd, contents + done, buf.st_size - done);
+    done += got > 0 ? got : 0;
+  }
+  close(ifd);
+
+  if(done < (size_t)buf.st_size)
+  {
+    fprintf(output, "ERROR: An error occured reading from the input file.\n");
+    free(contents);
+    return;
+  }
+
+  int32_t inode = lockFile(filename, true);
+  if(inode == -1)
+  {
+    fprintf(output, "ERROR: File not found.\n");
+    free(contents);
+    return;
+  }
+
+  if(inodes[inode].readonly)
+  {
+    fprintf(output, "File is labeled under READ ONLY, unable to update\n");
+    unlockInode(inode);
+    free(contents);
+    return;
+  }
+
+  int32_t blocks[BLOCKS_PER_FILE];
+  loadBlockList(inode, blocks);
+  int old_length = inodes[inode].block_length;
+  int kept = old_length < new_length ? old_length : new_length;
+
+  // find the blocks that changed. a changed block a snapshot shares gets a new block
+  // instead of being written over, taken up front so running out of space changes nothing
+  bool *changed = (bool *)calloc(BLOCKS_PER_FILE, sizeof(bool));
+  int32_t fresh[BLOCKS_PER_FILE];
+  int written = 0;
+  bool space = true;
+  for(int k = 0; k < kept && space; k++)
+  {
+    uint8_t *chunk = contents + (size_t)k * BLOCK_SIZE;
+    if(crc32c(chunk, BLOCK_SIZE) == checksums[blocks[k] - FIRST_DATA_BLOCK])
+    {
+      changed[k] = memcmp(getBlock(blocks[k], BLOCK_READ), chunk, BLOCK_SIZE) != 0;
+      putBlock(blocks[k]);
+    }
+    else
+    {
+      changed[k] = true;
+    }
+
+    fresh[k] = -1;
+    if(changed[k] && sharedBlock(blocks[k]))
+    {
+      fresh[k] = findFreeBlock(k > 0 ? blocks[k - 1] + 1 : blocks[k]);
+      space = fresh[k] != -1;
+    }
+    written += changed[k];
+  }
+
+  // a longer file gets its new blocks right behind its last one
+  if(space && new_length > old_length)
+  {
+    space = allocateBlocks(inode, new_length - old_length) != -1;
+    loadBlockList(inode, blocks);
+  }
+
+  if(!space)
+  {
+    for(int k = 0; k < kept; k++)
+    {
+      if(changed[k] && fresh[k] != -1)
+      {
+        releaseBlock(fresh[k]);
+      }
+    }
+
+    fprintf(output, "ERROR: Not enough free disk space.\n");
+    unlockInode(inode);
+    free(changed);
+    free(contents);
+    return;
+  }
+
+  for(int k = 0; k < new_length; k++)
+  {
+    if(k < kept && !changed[k])
+    {
+      continue;
+    }
+
+    if(k < kept && fresh[k] != -1)
+    {
+      releaseBlock(blocks[k]);
+      blocks[k] = fresh[k];
+    }
+
+    uint8_t *block = getBlock(blocks[k], BLOCK_NEW);
+    memcpy(block, contents + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+    setChecksum(blocks[k], block);
+    putBlock(blocks[k]);
+  }
+
+  // a shorter file gives back its tail, unless the tail holds blocks reserved for it
+  int used = (inodes[inode].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int length = old_length > used && old_length > new_length ? old_length : new_length;
+  for(int k = length; k < old_length; k++)
+  {
+    releaseBlock(blocks[k]);
+  }
+  storeBlockList(inode, blocks, length);
+  inodes[inode].file_size = buf.st_size;
+
+  fprintf(output, "Updated %s, wrote %d of %d blocks.\n", filename,
+    written + (new_length > old_length ? new_length - old_length : 0), new_length);
+
+  unlockInode(inode);
+  free(changed);
+  free(contents);
+}
+
+// copies a file of the current image into another open image, under newname if one
+// is given. the blocks are copied from one image's memory or cache to the other's
+// with their checksums, nothing goes through a host file. the copy keeps the creation
+// time and attributes of the file
+void copyFile(char *filename, char *target, char *newname)
+{
+  if(newname == NULL)
+  {
+    newname = filename;
+  }
+
+  if(strlen(newname) > 64)
+  {
+    fprintf(output, "ERROR: Filename is too large.\n");
+    return;
+  }
+
+  int slot = findImage(target);
+  if(slot == -1)
+  {
+    fprintf(output, strcmp(target, image_name) == 0 ? "ERROR: %s is the current image.\n"
+      : "ERROR: Image %s is not open.\n", target);
+    return;
+  }
+
+  int32_t inode = lockFile(filename, false);
+  if(inode == -1)
+  {
+    fprintf(output, "ERROR: File not found.\n");
+    return;
+  }
+
+  struct inode source = inodes[inode];
+  int32_t blocks[BLOCKS_PER_FILE];
+  uint32_t crcs[BLOCKS_PER_FILE];
+  loadBlockList(inode, blocks);
+
+  uint8_t *contents = (uint8_t *)malloc((size_t)source.block_length * BLOCK_SIZE);
+  bool corrupt = false;
+  for(int k = 0; k < source.block_length; k++)
+  {
+    uint8_t *block = getBlock(blocks[k], BLOCK_READ);
+    corrupt |= verify_reads && !checksumValid(blocks[k], block);
+    memcpy(contents + (size_t)k * BLOCK_SIZE, block, BLOCK_SIZE);
+    crcs[k] = checksums[blocks[k] - FIRST_DATA_BLOCK];
+    putBlock(blocks[k]);
+  }
+  unlockInode(inode);
+
+  if(corrupt)
+  {
+    fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n", filename);
+    free(contents);
+    return;
+  }
+
+  // the copy is written with the target image current, then the source is switched back
+  swapImage(&images[slot]);
+
+  // a file made by reserve has more blocks than its size needs, the copy gets the whole
+  // reservation so every block copied has a block of its own to go to
+  int32_t copy = createFile((uint32_t)source.block_length * BLOCK_SIZE);
+  if(copy != -1)
+  {
+    inodes[copy].file_size = source.file_size;
+    loadBlockList(copy, blocks);
+    for(int k = 0; k < source.block_length; k++)
+    {
+      memcpy(getBlock(blocks[k], BLOCK_NEW), contents + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+      checksums[blocks[k] - FIRST_DATA_BLOCK] = crcs[k];
+      putBlock(blocks[k]);
+    }
+
+    inodes[copy].creation_time = source.creation_time;
+    inodes[copy].hidden = source.hidden;
+    inodes[copy].readonly = source.readonly;
+    if(publishFile(newname, copy))
+    {
+      fprintf(output, "Copied %s to %s as %s.\n", filename, target, newname);
+    }
+  }
+
+  swapImage(&images[slot]);
+  free(contents);
+}
+
+// works similar to retrive function but with a designated output file
+void retrieve_to_file(char *inFilename, char *outFilename)
+{
+  SPAN(retrieve_to_file);
+  // the file stays locked for reading while we copy it out
+  int starting_inode = lockFile(inFilename, false);
+
+  if(starting_inode == -1)
+  {
+    fprintf(output, "ERROR: File does not exist in the disk image.\n");
+    return;
+  }
+
+  fprintf(output, "File found.\n");
+
+  // Now, open the output file that we are going to write the data to.
+  int ofd = open(outFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if( ofd == -1 )
+  {
+    fprintf(output, "Could not open output file: %s\n", outFilename );
+    perror("Opening output file returned");
+    unlockInode(starting_inode);
+    return;
+  }
+
+  int copy_size = inodes[starting_inode].file_size;
+
+  fprintf(output, "Writing %d bytes to %s\n", copy_size, outFilename );
+
+  // write the file out of its blocks, one write per run of consecutive blocks and all
+  // of them in flight at once. the last block only holds copy_size % BLOCK_SIZE bytes
+  // of the file, anything past that would be gibberish at the end of our file
+  int ret = file_io(ofd, starting_inode, copy_size, true);
+  if(ret == -2)
+  {
+    fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n", inFilename);
+  }
+  else if(ret == -1)
+  {
+    fprintf(output, "ERROR: Could not write to %s.\n", outFilename);
+  }
+
+  // Close the output file, we're done. 
+  close(ofd);
+
+  unlockInode(starting_inode);
+}
+
+// retrieves the file specified by the user from the disk image and places
+// the file in the current working directory of the user
+void retrieve(char *filename)
+{
+  SPAN(retrieve);
+  retrieve_to_file(filename, filename);
+}
+
+#define TAR_BLOCK 512
+#define TAR_HIDDEN "SCHILY.xattr.user.mfs.hidden"   // pax keyword of the hidden attribute
+
+// header of a file in a tar archive, in the ustar format
+struct tar_header
+{
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+// sum of the header bytes with the checksum field counted as spaces
+unsigned int tarChecksum(struct tar_header *header)
+{
+  unsigned int sum = 0;
+  uint8_t *bytes = (uint8_t *)header;
+
+  for(int i = 0; i < TAR_BLOCK; i++)
+  {
+    bool in_checksum = i >= (int)offsetof(struct tar_header, checksum)
+      && i < (int)offsetof(struct tar_header, checksum) + 8;
+    sum += in_checksum ? ' ' : bytes[i];
+  }
+
+  return sum;
+}
+
+// reads a number field of a tar header, octal digits that may fill the whole field
+unsigned long tarNumber(char *field, size_t size)
+{
+  char digits[16];
+  memcpy(digits, field, size);
+  digits[size] = 0;
+  return strtoul(digits, NULL, 8);
+}
+
+// writes a header for an entry of the given type, name and size followed by size bytes
+bool tarWriteHeader(FILE *out, char type, char *name, uint32_t size, time_t mtime,
+  int mode)
+{
+  struct tar_header header;
+  memset(&header, 0, sizeof(header));
+
+  snprintf(header.name, sizeof(header.name), "%s", name);
+  snprintf(header.mode, sizeof(header.mode), "%07o", mode);
+  snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+  snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+  snprintf(header.size, sizeof(header.size), "%011o", size);
+  snprintf(header.mtime, sizeof(header.mtime), "%011lo", (unsigned long)mtime);
+  header.type = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", tarChecksum(&header));
+  header.checksum[7] = ' ';
+
+  return fwrite(&header, TAR_BLOCK, 1, out) == 1;
+}
+
+const uint8_t tar_zeros[2 * TAR_BLOCK];
+
+// the zeros that fill the data of a tar entry up to a whole tar block
+bool tarWritePadding(FILE *out, uint32_t size)
+{
+  size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+  return fwrite(tar_zeros, 1, padding, out) == padding;
+}
+
+// reads past count bytes of a stream that may not be able to seek
+bool tarSkip(FILE *in, size_t count)
+{
+  uint8_t buffer[TAR_BLOCK];
+
+  while(count > 0)
+  {
+    size_t length = count < sizeof(buffer) ? count : sizeof(buffer);
+    if(fread(buffer, 1, length, in) != length)
+    {
+      return false;
+    }
+    count -= length;
+  }
+
+  return true;
+}
+
+// writes every file in the image to a tar archive, or to stdout for "-", in name order.
+// the read-only attribute is kept in the mode and the hidden one in a pax header. the
+// blocks of a file are written straight out of the image, a run of consecutive blocks
+// at a time
+void exportArchive(char *archive)
+{
+  bool to_stdout = strcmp(archive, "-") == 0;
+  FILE *out = to_stdout ? stdout : fopen(archive, "w");
+
+  if(out == NULL)
+  {
+    fprintf(output, "ERROR: Could not open %s for writing.\n", archive);
+    return;
+  }
+
+  // the archive takes stdout, messages go to stderr
+  FILE *messages = output;
+  if(to_stdout)
+  {
+    fflush(stdout);
+    output = stderr;
+  }
+  else
+  {
+    setvbuf(out, NULL, _IOFBF, IO_CHUNK);
+  }
+
+  struct entry_list list;
+  list.entries = (struct _directoryEntry *)malloc(MAX_NUM_FILES * sizeof(struct _directoryEntry));
+  list.count = 0;
+  pthread_rwlock_rdlock(&directory_lock);
+  directoryScan("", collectEntry, &list);
+  pthread_rwlock_unlock(&directory_lock);
+
+  int files = 0;
+  uint32_t bytes = 0;
+  bool ok = true;
+  for(int i = 0; i < list.count && ok; i++)
+  {
+    char name[65];
+    snprintf(name, sizeof(name), "%.64s", list.entries[i].name);
+
+    // the file may be gone by now
+    int32_t inode = list.entries[i].inUse ? lockFile(name, false) : -1;
+    if(inode == -1)
+    {
+      continue;
+    }
+
+    struct inode *node = &inodes[inode];
+    if(node->hidden)
+    {
+      char record[64];
+      char path[100];
+      int length = strlen(TAR_HIDDEN) + 4;
+      length += snprintf(NULL, 0, "%d", length);
+      snprintf(record, sizeof(record), "%d %s=1\n", length, TAR_HIDDEN);
+      snprintf(path, sizeof(path), "PaxHeaders/%s", name);
+
+      ok = tarWriteHeader(out, 'x', path, length, node->creation_time, 0644)
+        && fwrite(record, 1, length, out) == (size_t)length && tarWritePadding(out, length);
+    }
+
+    ok = ok && tarWriteHeader(out, '0', name, node->file_size, node->creation_time,
+      node->readonly ? 0444 : 0644);
+
+    int ret = ok ? stream_io(out, inode, node->file_size, true) : -1;
+    ok = ret == 0 && tarWritePadding(out, node->file_size);
+    if(ret == -2)
+    {
+      fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n", name);
+    }
+
+    files += ok;
+    bytes += ok ? node->file_size : 0;
+    unlockInode(inode);
+  }
+
+  // the archive ends with two zero blocks
+  ok = ok && fwrite(tar_zeros, 2 * TAR_BLOCK, 1, out) == 1;
+  ok = (to_stdout ? fflush(out) : fclose(out)) == 0 && ok;
+
+  if(ok)
+  {
+    fprintf(output, "Exported %d files, %u bytes.\n", files, bytes);
+  }
+  else
+  {
+    fprintf(output, "ERROR: Could not write the archive, %d files were exported.\n", files);
+  }
+
+  free(list.entries);
+  output = messages;
+}
+
+// adds the files of a tar archive, or of stdin for "-", to the image. regular files are
+// put in new blocks through createFile() and read straight into them, their names,
+// modification times and read-only and hidden attributes kept. other entries and files
+// that can't be added are skipped
+void importArchive(char *archive)
+{
+  bool from_stdin = strcmp(archive, "-") == 0;
+  FILE *in = from_stdin ? stdin : fopen(archive, "r");
+
+  if(in == NULL)
+  {
+    fprintf(output, "ERROR: Could not open %s.\n", archive);
+    return;
+  }
+
+  if(!from_stdin)
+  {
+    setvbuf(in, NULL, _IOFBF, IO_CHUNK);
+  }
+
+  struct tar_header header;
+  bool hidden = false;
+  bool ok = true;
+  int files = 0;
+
+  while(ok && fread(&header, TAR_BLOCK, 1, in) == 1 && header.name[0] != 0)
+  {
+    if(tarNumber(header.checksum, sizeof(header.checksum)) != tarChecksum(&header))
+    {
+      fprintf(output, "ERROR: The archive is damaged.\n");
+      ok = false;
+      break;
+    }
+
+    uint32_t size = tarNumber(header.size, sizeof(header.size));
+    size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    // a pax header for the next file, only the hidden attribute is used
+    if(header.type == 'x')
+    {
+      char *records = (char *)malloc(size + padding + 1);
+      ok = fread(records, 1, size + padding, in) == size + padding;
+      records[size] = 0;
+      hidden = ok && strstr(records, " " TAR_HIDDEN "=1\n") != NULL;
+      free(records);
+      continue;
+    }
+
+    char name[101];
+    snprintf(name, sizeof(name), "%.100s", header.name);
+    char *base = strncmp(name, "./", 2) == 0 ? name + 2 : name;
+
+    bool skip = true;
+    if(header.type != '0' && header.type != 0)
+    {
+      // directories, links and the like have no place in the image
+    }
+    else if(header.prefix[0] != 0 || strlen(base) > 64 || base[0] == 0)
+    {
+      fprintf(output, "ERROR: %s: File name too long, skipped.\n", base);
+    }
+    else if(strchr(base, '/') != NULL)
+    {
+      fprintf(output, "ERROR: %s: The image has no subdirectories, skipped.\n", base);
+    }
+    else if(size > MAX_FILE_SIZE)
+    {
+      fprintf(output, "ERROR: %s: File is too large, skipped.\n", base);
+    }
+    else if(fileExists(base))
+    {
+      fprintf(output, "ERROR: %s: File already exists, skipped.\n", base);
+    }
+    else
+    {
+      skip = false;
+    }
+
+    int32_t inode = skip ? -1 : createFile(size);
+    if(inode == -1)
+    {
+      ok = tarSkip(in, size + padding);
+      hidden = false;
+      continue;
+    }
+
+    ok = stream_io(in, inode, size, false) == 0 && tarSkip(in, padding);
+    if(!ok)
+    {
+      discardFile(inode);
+      break;
+    }
+
+    inodes[inode].creation_time = tarNumber(header.mtime, sizeof(header.mtime));
+    inodes[inode].readonly = (tarNumber(header.mode, sizeof(header.mode)) & 0222) == 0;
+    inodes[inode].hidden = hidden;
+    hidden = false;
+
+    files += publishFile(base, inode);
+  }
+
+  if(!from_stdin)
+  {
+    fclose(in);
+  }
+
+  if(!ok)
+  {
+    fprintf(output, "ERROR: Could not read the archive, %d files were imported.\n", files);
+  }
+  else
+  {
+    fprintf(output, "Imported %d files.\n", files);
+  }
+}
+
+#define SUMS_MAGIC 0x324d5553       // "SUM2", a sync-to digest file
+#define DELTA_MAGIC "MFSDELTA"      // starts a sync-to delta stream
+#define DELTA_END 0xffffffff        // block number of the record ending a delta
+#define DELTA_DATA 0                // the record is followed by the block
+#define DELTA_HOLE 1                // the block is free and becomes a hole
+#define SUM_HOLE 0x00               // every byte of the digest of a hole
+#define SUM_UNKNOWN 0xff            // every byte of the digest of a block that isn't known
+
+// what a backup held at its last sync-to: a digest per block, and for a backup file
+// its size and modification time then, so changes made to it since are noticed. the
+// sync point is the one the image got at that sync, while it is still the image's the
+// sync map holds every data block written since
+struct sync_sums
+{
+  uint32_t magic;
+  uint32_t blocks;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t sync_point;
+};
+
+// SHA-256 digest of a block for sync-to. a block is sent when its digest changed, so a
+// change is only missed if it keeps the digest, which takes a SHA-256 collision. the
+// digests of holes and unknown blocks are all SUM_HOLE or SUM_UNKNOWN bytes, a block
+// hashing to one of them would take a preimage
+struct block_sum
+{
+  uint8_t digest[32];
+};
+
+// true if the digest is all fill bytes
+bool sumIs(struct block_sum *sum, uint8_t fill)
+{
+  for(size_t i = 0; i < sizeof(sum->digest); i++)
+  {
+    if(sum->digest[i] != fill)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// digests the current image into sums and returns how many blocks it digested. the
+// metadata is always digested, it is small and isn't tracked by block. with tracked set
+// base is what the image held at its last sync point, a data block the sync map doesn't
+// have written since keeps its digest from base then. the blocks holeMap() marks get
+// the digest of a hole. in cache mode blocks are read past the cache, so a sync doesn't
+// push the blocks in use out of it
+int imageSums(struct block_sum *sums, struct block_sum *base, bool tracked)
+{
+  uint8_t *holes = holeMap();
+  uint8_t buffer[BLOCK_SIZE];
+  int digested = 0;
+  for(int32_t b = 0; b < NUM_BLOCKS; b++)
+  {
+    int32_t i = b - FIRST_DATA_BLOCK;
+    if(b >= FIRST_DATA_BLOCK && holes[i])
+    {
+      memset(&sums[b], SUM_HOLE, sizeof(struct block_sum));
+      continue;
+    }
+
+    if(b >= FIRST_DATA_BLOCK && tracked && !(sync_map[i / 64] & (uint64_t)1 << (i % 64))
+      && !sumIs(&base[b], SUM_HOLE) && !sumIs(&base[b], SUM_UNKNOWN))
+    {
+      sums[b] = base[b];
+      continue;
+    }
+
+    uint8_t *block = data[b];
+    if(cache_mode && b >= FIRST_DATA_BLOCK)
+    {
+      peekBlock(b, buffer);
+      block = buffer;
+    }
+    sha256Block(block, sums[b].digest);
+    digested++;
+  }
+  free(holes);
+  return digested;
+}
+
+// reads the digests of the last sync from path, and the sync point they were taken at.
+// target is the backup file, its size and modification time have to be the ones
+// recorded. returns false if there is no usable file, sums are all SUM_UNKNOWN then
+bool loadSums(char *path, struct block_sum *sums, struct stat *target, uint64_t *point)
+{
+  struct sync_sums header;
+  FILE *in = fopen(path, "r");
+  bool valid = in != NULL && fread(&header, sizeof(header), 1, in) == 1
+    && header.magic == SUMS_MAGIC && header.blocks == NUM_BLOCKS
+    && fread(sums, sizeof(struct block_sum), NUM_BLOCKS, in) == NUM_BLOCKS;
+
+  if(valid && target != NULL)
+  {
+    valid = header.size == target->st_size && header.mtime_sec == target->st_mtim.tv_sec
+      && header.mtime_nsec == target->st_mtim.tv_nsec;
+  }
+
+  if(in != NULL)
+  {
+    fclose(in);
+  }
+
+  if(!valid)
+  {
+    memset(sums, SUM_UNKNOWN, NUM_BLOCKS * sizeof(struct block_sum));
+  }
+  *point = valid ? header.sync_point : 0;
+  return valid;
+}
+
+// writes the digests of a finished sync and its sync point to path, through a new file
+// renamed over the old one. returns false if it couldn't be written
+bool storeSums(char *path, struct block_sum *sums, struct stat *target, uint64_t point)
+{
+  struct sync_sums header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SUMS_MAGIC;
+  header.blocks = NUM_BLOCKS;
+  header.sync_point = point;
+  if(target != NULL)
+  {
+    header.size = target->st_size;
+    header.mtime_sec = target->st_mtim.tv_sec;
+    header.mtime_nsec = target->st_mtim.tv_nsec;
+  }
+
+  char temp[PATH_MAX];
+  snprintf(temp, sizeof(temp), "%s.new", path);
+  FILE *out = fopen(temp, "w");
+  bool ok = out != NULL && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(sums, sizeof(struct block_sum), NUM_BLOCKS, out) == NUM_BLOCKS;
+  ok = out != NULL && fclose(out) == 0 && ok;
+  return ok && rename(temp, path) == 0;
+}
+
+// brings a backup image file up to date with the current image, or with "-" writes the
+// changes to stdout as a delta stream for apply. the SHA-256 digests of what the backup
+// holds are kept in <backup>.sums, or in the given file for a stream. only blocks whose
+// digest changed are sent, the data blocks before the metadata. when the digests are
+// from the image's last sync only the data blocks the sync map has are digested, so a
+// sync costs about what changed since. digests from an older sync or another image
+// take a pass over every block, without them, or when the backup changed since,
+// everything is sent
+void syncTo(char *target, char *sums_path)
+{
+  bool to_stdout = strcmp(target, "-") == 0;
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%s", to_stdout ? sums_path : target,
+    to_stdout ? "" : ".sums");
+
+  // the delta takes stdout, messages go to stderr
+  FILE *messages = output;
+  if(to_stdout)
+  {
+    fflush(stdout);
+    output = stderr;
+  }
+
+  int fd = to_stdout ? -1 : open(target, O_RDWR | O_CREAT, 0666);
+  struct stat buf;
+  if(!to_stdout && (fd == -1 || fstat(fd, &buf) == -1))
+  {
+    fprintf(output, "ERROR: Could not open %s for writing.\n", target);
+    output = messages;
+    return;
+  }
+
+  struct block_sum *sums = (struct block_sum *)malloc(NUM_BLOCKS * sizeof(struct block_sum));
+  struct block_sum *base = (struct block_sum *)malloc(NUM_BLOCKS * sizeof(struct block_sum));
+  uint64_t point;
+  bool incremental = loadSums(path, base, to_stdout ? NULL : &buf, &point);
+  int digested = imageSums(sums, base, incremental && point != 0 && point == super->sync_point);
+
+  // a sync that stops halfway leaves the backup unlike any digests, the next one
+  // sends everything
+  unlink(path);
+
+  bool ok = !to_stdout || fwrite(DELTA_MAGIC, 8, 1, stdout) == 1;
+  uint32_t geometry[2] = { BLOCK_SIZE, NUM_BLOCKS };
+  ok = ok && (!to_stdout || fwrite(geometry, sizeof(geometry), 1, stdout) == 1);
+
+  struct io_request *requests = NULL;
+  if(!to_stdout)
+  {
+    requests = (struct io_request *)malloc(NUM_BLOCKS * sizeof(struct io_request));
+  }
+
+  // the data blocks go first and the metadata pointing at them last, a backup file
+  // gets them in two batches. runs of changed blocks of the same kind are one record
+  int sent = 0;
+  int holes = 0;
+  for(int pass = 0; pass < 2 && ok; pass++)
+  {
+    int32_t from = pass == 0 ? FIRST_DATA_BLOCK : 0;
+    int32_t to = pass == 0 ? NUM_BLOCKS : FIRST_DATA_BLOCK;
+    int count = 0;
+
+    for(int32_t b = from; b < to && ok; )
+    {
+      if(memcmp(&sums[b], &base[b], sizeof(struct block_sum)) == 0)
+      {
+        b++;
+        continue;
+      }
+
+      bool hole = sumIs(&sums[b], SUM_HOLE);
+      int32_t end = b + 1;
+      while(end < to && memcmp(&sums[end], &base[end], sizeof(struct block_sum)) != 0
+        && sumIs(&sums[end], SUM_HOLE) == hole)
+      {
+        end++;
+      }
+
+      uint32_t record[3] = { b, hole ? DELTA_HOLE : DELTA_DATA, end - b };
+      ok = !to_stdout || fwrite(record, sizeof(record), 1, stdout) == 1;
+      if(hole)
+      {
+        if(!to_stdout)
+        {
+          punchBlocks(fd, b, end - b);
+        }
+        holes += end - b;
+      }
+      else if(to_stdout || cache_mode)
+      {
+        // cached blocks can't stay pinned for a batch, they go one at a time and are
+        // read past the cache
+        uint8_t buffer[BLOCK_SIZE];
+        for(int32_t k = b; k < end && ok; k++)
+        {
+          uint8_t *block = data[k];
+          if(cache_mode && k >= FIRST_DATA_BLOCK)
+          {
+            peekBlock(k, buffer);
+            block = buffer;
+          }
+          ok = to_stdout ? fwrite(block, BLOCK_SIZE, 1, stdout) == 1
+            : pwrite(fd, block, BLOCK_SIZE, (off_t)k * BLOCK_SIZE) == BLOCK_SIZE;
+        }
+        sent += end - b;
+      }
+      else
+      {
+        for(int32_t k = b; k < end; k += IO_CHUNK / BLOCK_SIZE)
+        {
+          int32_t last = k + IO_CHUNK / BLOCK_SIZE < end ? k + IO_CHUNK / BLOCK_SIZE : end;
+          requests[count].buffer = data[k];
+          requests[count].length = (size_t)(last - k) * BLOCK_SIZE;
+          requests[count].offset = (off_t)k * BLOCK_SIZE;
+          count++;
+        }
+        sent += end - b;
+      }
+      b = end;
+    }
+
+    ok = ok && (to_stdout || io_batch(fd, requests, count, true) == 0);
+  }
+
+  if(to_stdout)
+  {
+    uint32_t record[3] = { DELTA_END, DELTA_END, 0 };
+    ok = ok && fwrite(record, sizeof(record), 1, stdout) == 1 && fflush(stdout) == 0;
+  }
+  else
+  {
+    // a new backup file is extended to the full image size, what isn't written is a hole
+    ok = ok && (buf.st_size >= (off_t)IMAGE_SIZE || ftruncate(fd, IMAGE_SIZE) == 0)
+      && fsync(fd) == 0 && fstat(fd, &buf) == 0;
+    close(fd);
+  }
+
+  // the image gets a new sync point and the sync map starts over, the digests are
+  // stored with the point so the next sync knows they go with the map. without random
+  // numbers the point only has to differ from the last one
+  if(getrandom(&point, sizeof(point), 0) != sizeof(point) || point == 0)
+  {
+    point = super->sync_point + (uint64_t)time(NULL);
+  }
+
+  if(!ok)
+  {
+    fprintf(output, "ERROR: Could not write to %s, the next sync sends everything.\n",
+      to_stdout ? "stdout" : target);
+  }
+  else if(!storeSums(path, sums, to_stdout ? NULL : &buf, point))
+  {
+    fprintf(output, "ERROR: Could not write %s, the next sync sends everything.\n", path);
+  }
+  else
+  {
+    super->sync_point = point;
+    memset(sync_map, 0, SYNC_MAP_WORDS * sizeof(uint64_t));
+    __atomic_store_n(&image_changed, true, __ATOMIC_RELAXED);
+    fprintf(output, "Synced %d blocks and %d holes to %s", sent, holes, target);
+    if(incremental)
+    {
+      fprintf(output, ", %d blocks were digested.\n", digested);
+    }
+    else
+    {
+      fprintf(output, ", all of them as there were no digests.\n");
+    }
+  }
+
+  free(requests);
+  free(sums);
+  free(base);
+  output = messages;
+}
+
+// applies a delta stream written by sync-to -, from a file or stdin for "-", to the
+// backup image file target. the image file is changed directly, without loading it
+void applyDelta(char *target, char *delta)
+{
+  bool from_stdin = strcmp(delta, "-") == 0;
+  FILE *in = from_stdin ? stdin : fopen(delta, "r");
+  if(in == NULL)
+  {
+    fprintf(output, "ERROR: Could not open %s.\n", delta);
+    return;
+  }
+
+  char magic[8];
+  uint32_t geometry[2];
+  if(fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, DELTA_MAGIC, 8) != 0
+    || fread(geometry, sizeof(geometry), 1, in) != 1 || geometry[0] != BLOCK_SIZE
+    || geometry[1] != NUM_BLOCKS)
+  {
+    fprintf(output, "ERROR: %s is not a delta of an image.\n", delta);
+    if(!from_stdin)
+    {
+      fclose(in);
+    }
+    return;
+  }
+
+  int fd = open(target, O_RDWR | O_CREAT, 0666);
+  if(fd == -1)
+  {
+    fprintf(output, "ERROR: Could not open %s for writing.\n", target);
+    if(!from_stdin)
+    {
+      fclose(in);
+    }
+    return;
+  }
+
+  uint8_t *chunk = (uint8_t *)malloc(IO_CHUNK);
+  int blocks = 0;
+  int holes = 0;
+  bool ok = true;
+  bool ended = false;
+
+  uint32_t record[3];
+  while(ok && !ended && fread(record, sizeof(record), 1, in) == 1)
+  {
+    ended = record[0] == DELTA_END;
+    uint32_t first = record[0];
+    uint32_t count = record[2];
+    ok = ended || (first < NUM_BLOCKS && count <= NUM_BLOCKS - first
+      && (record[1] == DELTA_DATA || (record[1] == DELTA_HOLE && first >= FIRST_DATA_BLOCK)));
+
+    if(ok && !ended && record[1] == DELTA_HOLE)
+    {
+      punchBlocks(fd, first, count);
+      holes += count;
+    }
+
+    // the blocks of a data record are read and written a chunk at a time
+    for(uint32_t k = 0; ok && !ended && record[1] == DELTA_DATA && k < count; )
+    {
+      uint32_t n = count - k < IO_CHUNK / BLOCK_SIZE ? count - k : IO_CHUNK / BLOCK_SIZE;
+      ok = fread(chunk, BLOCK_SIZE, n, in) == n && pwrite(fd, chunk, (size_t)n * BLOCK_SIZE,
+        (off_t)(first + k) * BLOCK_SIZE) == (ssize_t)n * BLOCK_SIZE;
+      blocks += ok ? n : 0;
+      k += n;
+    }
+  }
+
+  struct stat buf;
+  ok = ok && ended && fstat(fd, &buf) == 0
+    && (buf.st_size >= (off_t)IMAGE_SIZE || ftruncate(fd, IMAGE_SIZE) == 0) && fsync(fd) == 0;
+  close(fd);
+  free(chunk);
+  if(!from_stdin)
+  {
+    fclose(in);
+  }
+
+  if(!ok)
+  {
+    fprintf(output, "ERROR: The delta is damaged or incomplete, %d blocks were applied.\n",
+      blocks);
+    return;
+  }
+
+  fprintf(output, "Applied %d blocks and %d holes to %s.\n", blocks, holes, target);
+}
+
+//reads a file byte by byte starting at the given byte and ending after
+//traversing the provided number of bytes
+void readfile(char* filename, int start, int numbytes)
+{
+  SPAN(readfile);
+  int32_t inode_index = -1;
+  int32_t blocknum;
+
+  if(filename == NULL)    //checks filename for NULL input
+  {
+    fprintf(output, "ERROR: No filename provided.\n");  //print error if filename not given
+  }
+  else
+  {
+    inode_index = lockFile(filename, false); //looks for inode of file and locks it
+
+    if(inode_index != -1)   //if file exists, reads
+    {
+      blocknum = start/BLOCK_SIZE;
+      //blocks reserved behind the end of the file aren't part of it
+      int used = (inodes[inode_index].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      //checks if byte input is within file's used blocks, error message if outside
+      if(used - 1 < blocknum)
+      {
+        fprintf(output, "ERROR: Start byte outside of file range.\n");
+      }
+      else
+      {
+        int startbyte = start % BLOCK_SIZE; //byte number inside block
+        int traverse = numbytes / BLOCK_SIZE + blocknum;  //last block
+        int remainingbytes; //remaining bytes, not whole blocks
+        //determines if end byte passes file end
+        if(traverse >= used)
+        {
+          traverse = used -1;
+          remainingbytes = BLOCK_SIZE;  //only reaches end of file, no surpassing
+        }
+        else
+        {
+          remainingbytes = numbytes % BLOCK_SIZE; //end byte < end file
+        }
+        int currblock;
+
+        //checks the blocks in range against their checksums before printing any of them
+        bool intact = true;
+        for(int k = blocknum; k <= traverse && verify_reads && intact; k++)
+        {
+          currblock = fileBlock(inode_index, k);
+          intact = checksumValid(currblock, getBlock(currblock, BLOCK_READ));
+          putBlock(currblock);
+        }
+
+        if(!intact)
+        {
+          fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n",
+            filename);
+          unlockInode(inode_index);
+          return;
+        }
+
+        SPAN(print);
+        fprintf(output, "File %s (in hexadec), from byte %d for %d bytes::\n",
+          filename, start, numbytes);
+        for(int k = blocknum; k < traverse; k++)    //iterates through every byte within bounds
+        {
+          currblock = fileBlock(inode_index, k);
+          uint8_t *block = getBlock(currblock, BLOCK_READ);
+          for(int j = startbyte; j < BLOCK_SIZE; j++)
+          {
+            if(block[j] != 0)
+            {
+              fprintf(output, "%02hhx", block[j]);   //prints every byte in hexadec
+            }
+          }
+          putBlock(currblock);
+          startbyte = 0;  //resets the start byte after the first block
+        }
+        currblock = fileBlock(inode_index, traverse); //the final "incomplete" block
+        uint8_t *block = getBlock(currblock, BLOCK_READ);
+        for(int m = startbyte; m < remainingbytes; m++)
+        {
+          if(block[m] != 0)
+          {
+            fprintf(output, "%02hhx", block[m]);   //prints every byte in hexadec
+          }
+        }
+        putBlock(currblock);
+        fprintf(output, "\n----File Reading finished----\n");  //message to signal end
+      }
+      unlockInode(inode_index);
+    }
+    else
+    {
+      fprintf(output, "ERROR: File not found.\n"); //file not found
+    }
+  }
+}
+
+// writes all of count bytes from buffer to fd, returns false on a write error
+bool writeRaw(int fd, uint8_t *buffer, size_t count)
+{
+  while(count > 0)
+  {
+    ssize_t written = write(fd, buffer, count);
+    if(written <= 0)
+    {
+      return false;
+    }
+    buffer += written;
+    count -= written;
+  }
+  return true;
+}
+
+// moves count bytes at offset in the image file to fd without copying them through user
+// space, splice() for a pipe and sendfile() for anything else. cached blocks that are
+// newer than the file are written back first. returns the bytes moved
+size_t spliceBlocks(int fd, bool pipe, int32_t block, int blocks, off_t offset, size_t count)
+{
+  pthread_mutex_lock(&cache_lock);
+  for(int32_t b = block; b < block + blocks; b++)
+  {
+    struct frame *f = frame_of[b] != -1 ? &frames[frame_of[b]] : NULL;
+    if(f != NULL && f->dirty
+      && pwrite(image_fd, f->buffer, BLOCK_SIZE, (off_t)b * BLOCK_SIZE) == BLOCK_SIZE)
+    {
+      f->dirty = false;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  size_t moved = 0;
+  while(moved < count)
+  {
+    ssize_t n = pipe ? splice(image_fd, &offset, fd, NULL, count - moved, SPLICE_F_MOVE)
+      : sendfile(fd, image_fd, &offset, count - moved);
+    if(n <= 0)
+    {
+      break;
+    }
+    moved += n;
+  }
+  return moved;
+}
+
+// writes length bytes of a file from offset on to stdout as they are, for piping a file
+// into another program. the blocks are located from the offset directly and written a
+// run of consecutive blocks at a time, straight from image memory or, with a cache, from
+// the image file into the pipe by the kernel. mfsd writes them to the client instead
+void catFile(char *filename, uint32_t offset, uint32_t length)
+{
+  // the bytes take stdout, messages go to stderr
+  FILE *messages = output;
+  bool to_stdout = output == stdout;
+  if(to_stdout)
+  {
+    fflush(stdout);
+    output = stderr;
+  }
+
+  int32_t inode = lockFile(filename, false);
+  if(inode == -1)
+  {
+    fprintf(output, "ERROR: File not found.\n");
+    output = messages;
+    return;
+  }
+
+  uint32_t size = inodes[inode].file_size;
+  if(offset > size)
+  {
+    fprintf(output, "ERROR: Start byte outside of file range.\n");
+    unlockInode(inode);
+    output = messages;
+    return;
+  }
+  if(length > size - offset)
+  {
+    length = size - offset;
+  }
+
+  int32_t blocks[BLOCKS_PER_FILE];
+  loadBlockList(inode, blocks);
+  int first = offset / BLOCK_SIZE;
+  int last = length > 0 ? (offset + length - 1) / BLOCK_SIZE : first - 1;
+
+  bool intact = true;
+  for(int k = first; k <= last && verify_reads && intact; k++)
+  {
+    intact = checksumValid(blocks[k], getBlock(blocks[k], BLOCK_READ));
+    putBlock(blocks[k]);
+  }
+  if(!intact)
+  {
+    fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n", filename);
+    unlockInode(inode);
+    output = messages;
+    return;
+  }
+
+  struct stat out;
+  bool fifo = to_stdout && fstat(STDOUT_FILENO, &out) == 0 && S_ISFIFO(out.st_mode);
+  bool ok = true;
+
+  for(int k = first; k <= last && ok; )
+  {
+    // a run ends where the next block isn't right behind the last one in the image,
+    // cached blocks are copied one at a time as their frames are apart
+    int end = k + 1;
+    while(end <= last && blocks[end] == blocks[end - 1] + 1 && !(cache_mode && !to_stdout))
+    {
+      end++;
+    }
+
+    uint32_t from = k == first ? offset % BLOCK_SIZE : 0;
+    uint32_t upto = end - 1 == last ? (offset + length - 1) % BLOCK_SIZE + 1 : BLOCK_SIZE;
+    size_t count = (size_t)(end - k - 1) * BLOCK_SIZE + upto - from;
+
+    size_t moved = 0;
+    if(cache_mode && to_stdout)
+    {
+      off_t position = (off_t)blocks[k] * BLOCK_SIZE + from;
+      moved = spliceBlocks(STDOUT_FILENO, fifo, blocks[k], end - k, position, count);
+      ok = moved == 0 || moved == count;
+    }
+
+    if(!cache_mode)
+    {
+      ok = to_stdout ? writeRaw(STDOUT_FILENO, data[blocks[k]] + from, count)
+        : fwrite(data[blocks[k]] + from, 1, count, output) == count;
+    }
+    else if(moved == 0)
+    {
+      // not every kind of stdout takes sendfile(), those get a copy
+      for(int j = k; j < end && ok; j++)
+      {
+        uint32_t start = j == k ? from : 0;
+        uint32_t stop = j == end - 1 ? upto : BLOCK_SIZE;
+        uint8_t *block = getBlock(blocks[j], BLOCK_READ);
+        ok = to_stdout ? writeRaw(STDOUT_FILENO, block + start, stop - start)
+          : fwrite(block + start, 1, stop - start, output) == stop - start;
+        putBlock(blocks[j]);
+      }
+    }
+    k = end;
+  }
+
+  unlockInode(inode);
+  if(!ok)
+  {
+    fprintf(output, "ERROR: Could not write %s to stdout.\n", filename);
+  }
+  output = messages;
+}
+
+//encrypts the given file using a XOR encryption and the given key
+void encrypt(char* filename, char* keystr, char which)
+{
+  SPAN(encrypt);
+  int32_t inode_index = -1;
+  char key = keystr[0];
+
+  if(filename == NULL)    //checks for NULL filename
+  {
+    fprintf(output, "ERROR: No filename provided.\n");
+  }
+  else if( key >= 256)  //checks the size of the cipher
+  {
+    fprintf(output, "ERROR: Cipher surpasses 256 bits.\n");
+  }
+  else
+  {
+    inode_index = lockFile(filename, true); //looks for and locks the file inode
+    if(inode_index != -1)   //if the file exists, data is transformed byte by byte
+    {
+      //blocks shared with a snapshot are copied before anything is changed, so running
+      //out of space leaves the file as it was
+      int32_t blocks[BLOCKS_PER_FILE];
+      loadBlockList(inode_index, blocks);
+      //blocks reserved behind the end of the file aren't part of it and stay as they are
+      int used = (inodes[inode_index].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+      //a corrupt block would get a valid checksum for its bad contents, check first
+      bool intact = true;
+      for(int k = 0; k < used && verify_reads && intact; k++)
+      {
+        intact = checksumValid(blocks[k], getBlock(blocks[k], BLOCK_READ));
+        putBlock(blocks[k]);
+      }
+
+      bool copied = intact;
+      for(int k = 0; k < used && copied; k++)
+      {
+        copied = unshareBlock(blocks, k) != -1;
+      }
+      storeBlockList(inode_index, blocks, inodes[inode_index].block_length);
+
+      int currblock;
+      for(int k = 0; k < used && copied; k++)
+      {
+        currblock = blocks[k];
+        uint8_t *block = getBlock(currblock, BLOCK_WRITE);
+        for(int j = 0; j < BLOCK_SIZE; j++)
+        {
+          if(block[j] != 0)
+          {
+            block[j] = block[j] ^ key;
+          }
+        }
+        setChecksum(currblock, block);
+        putBlock(currblock);
+      }
+      if(!intact)
+      {
+        fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n",
+          filename);
+      }
+      else if(!copied)
+      {
+        fprintf(output, "ERROR: Not enough free disk space.\n");
+      }
+      else if(which == 'e')    //checks which if statement called this function for print
+      {
+        fprintf(output, "Encryption complete.\n");
+      }
+      else
+      {
+        fprintf(output, "Decryption complete.\n");
+      }
+      unlockInode(inode_index);
+    }
+    else
+    {
+      fprintf(output, "ERROR: File not found.\n");
+    }
+  }
+}
+
+//adds or subtracts an attribute from the file, 
+//depending on the attribute given
+void attribute(char* filename, char* attri)
+{
+  int32_t inode_index = -1;
+  if(filename == NULL)  //handles the event of if a NULL value gets passed
+  {
+    fprintf(output, "ERROR: No filename provided.\n");
+  }
+  else
+  {
+    inode_index = lockFile(filename, true); //attempts to find the file and lock the inode
+
+    if(inode_index != -1)   //if the index exists, flip appropriate flag accordingly
+    {
+      if(attri[0] == '-' && attri[1] == 'h')
+      {
+        inodes[inode_index].hidden = false;
+      }
+      else if(attri[0] == '+' && attri[1] == 'h')
+      {
+        inodes[inode_index].hidden = true;
+      }
+      else if(attri[0] == '-' && attri[1] == 'r')
+      {
+        inodes[inode_index].readonly = false;
+      }
+      else if(attri[0] == '+' && attri[1] == 'r')
+      {
+        inodes[inode_index].readonly = true;
+      }
+      unlockInode(inode_index);
+    }
+    else
+    {
+      fprintf(output, "ERROR: File not found.\n");
+    }
+  }
+}
+
+// owner of every data block while defragmenting: the position of the block in the
+// block lists of all files, or -1 if no live file points at the block
+int32_t block_owner[NUM_DATA_BLOCKS];
+
+// scratch block used to swap two blocks that are both in use
+uint8_t swap_block[BLOCK_SIZE];
+
+// copies count consecutive blocks from source down to target. the runs may overlap, a
+// fully loaded image moves them with one memmove, in cache mode they go block by block
+void moveBlocks(int32_t target, int32_t source, int count)
+{
+  memmove(&checksums[target - FIRST_DATA_BLOCK], &checksums[source - FIRST_DATA_BLOCK],
+    count * sizeof(uint32_t));
+
+  if(!cache_mode)
+  {
+    memmove(data[target], data[source], count * BLOCK_SIZE);
+    markDirty(target, count);
+    markChanged(target, count);
+    return;
+  }
+
+  for(int j = 0; j < count; j++)
+  {
+    uint8_t *from = getBlock(source + j, BLOCK_READ);
+    uint8_t *to = getBlock(target + j, BLOCK_NEW);
+    memcpy(to, from, BLOCK_SIZE);
+    putBlock(target + j);
+    putBlock(source + j);
+  }
+}
+
+// relocates the blocks of every file so each file is contiguous, packing the files in
+// name order from the first data block on and leaving the free space as one run at the
+// end of the image. the index blocks and the directory tree are given up while the data
+// moves and written again behind the files. budget caps the number of blocks moved (0
+// means no cap) so the command can be run incrementally, placed files are skipped on
+// the next pass. deleted files are discarded, their blocks are reused, and how many
+// were is printed. returns the number of blocks moved
+int defrag(int budget)
+{
+  int moved = 0;
+  int discarded = 0;
+
+  struct entry_list list;
+  list.entries = (struct _directoryEntry *)malloc(MAX_NUM_FILES * sizeof(struct _directoryEntry));
+  list.count = 0;
+  directoryScan("", collectEntry, &list);
+  directoryFree(super->directory_root, super->directory_height);
+  super->directory_root = -1;
+
+  // the block lists of all live files one after the other, starts[i] is where the list of
+  // the i-th file begins. deleted entries still point at blocks that are about to be
+  // reused, so they can no longer be undeleted. reclaim them and their inodes
+  int32_t *file_blocks = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  int32_t *starts = (int32_t *)malloc(MAX_NUM_FILES * sizeof(int32_t));
+  struct _directoryEntry *entries = list.entries;
+  int count = 0;
+  int used = 0;
+
+  for(int i = 0; i < list.count; i++)
+  {
+    int32_t inode_index = entries[i].inode;
+    if(!entries[i].inUse)
+    {
+      freeInode(inode_index);
+      discarded++;
+      continue;
+    }
+
+    entries[count] = entries[i];
+    starts[count++] = used;
+    loadBlockList(inode_index, &file_blocks[used]);
+    used += inodes[inode_index].block_length;
+
+    for(int j = 0; j < INDEX_BLOCKS; j++)
+    {
+      if(inodes[inode_index].index_blocks[j] != -1)
+      {
+        releaseBlock(inodes[inode_index].index_blocks[j]);
+        inodes[inode_index].index_blocks[j] = -1;
+      }
+    }
+  }
+
+  // build the reverse map from blocks to the files that own them. blocks shared with
+  // snapshots are left without an owner, the snapshot records point at them as well so
+  // they can't be moved
+  for(int i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    block_owner[i] = -1;
+  }
+
+  for(int p = 0; p < used; p++)
+  {
+    if(!sharedBlock(file_blocks[p]))
+    {
+      block_owner[file_blocks[p] - FIRST_DATA_BLOCK] = p;
+    }
+  }
+
+  // cursor is the data block (relative to FIRST_DATA_BLOCK) the next file block goes to
+  int32_t cursor = 0;
+  bool done = false;
+
+  for(int i = 0; i < count && !done; i++)
+  {
+    int32_t inode_index = entries[i].inode;
+    int32_t *blocks = &file_blocks[starts[i]];
+    int k = 0;
+
+    while(k < inodes[inode_index].block_length)
+    {
+      // blocks in use that no file owns can't be moved, step over them
+      while(cursor < NUM_DATA_BLOCKS && block_refs[cursor] && block_owner[cursor] == -1)
+      {
+        cursor++;
+      }
+
+      // nothing behind the cursor is free, the rest of the files stay where they are
+      if(cursor == NUM_DATA_BLOCKS)
+      {
+        done = true;
+        break;
+      }
+
+      int32_t source = blocks[k] - FIRST_DATA_BLOCK;
+
+      // shared blocks stay where they are
+      if(block_owner[source] == -1)
+      {
+        k++;
+        continue;
+      }
+
+      // already in place
+      if(source == cursor)
+      {
+        cursor++;
+        k++;
+        continue;
+      }
+
+      if(budget > 0 && moved >= budget)
+      {
+        done = true;
+        break;
+      }
+
+      // find the longest run of the file that is contiguous at the source and whose
+      // target blocks are free or part of the run itself, so it moves in one memmove
+      int run = 0;
+      while(k + run < inodes[inode_index].block_length
+        && blocks[k + run] - FIRST_DATA_BLOCK == source + run
+        && cursor + run < NUM_DATA_BLOCKS
+        && block_owner[source + run] != -1
+        && (!block_refs[cursor + run] || cursor + run >= source))
+      {
+        if(budget > 0 && moved + run >= budget)
+        {
+          break;
+        }
+        run++;
+      }
+
+      if(run > 0)
+      {
+        moveBlocks(cursor + FIRST_DATA_BLOCK, source + FIRST_DATA_BLOCK, run);
+
+        // release the old run first since it may overlap the new one
+        for(int j = 0; j < run; j++)
+        {
+          block_refs[source + j] = 0;
+          block_owner[source + j] = -1;
+        }
+
+        for(int j = 0; j < run; j++)
+        {
+          block_refs[cursor + j] = 1;
+          block_owner[cursor + j] = starts[i] + k + j;
+          blocks[k + j] = cursor + j + FIRST_DATA_BLOCK;
+        }
+
+        moved += run;
+        cursor += run;
+        k += run;
+      }
+      else
+      {
+        // the target block belongs to another file (or a later block of this one),
+        // swap the two blocks and point the other owner at our old block
+        int32_t other = block_owner[cursor];
+
+        uint8_t *target_block = getBlock(cursor + FIRST_DATA_BLOCK, BLOCK_WRITE);
+        uint8_t *source_block = getBlock(source + FIRST_DATA_BLOCK, BLOCK_WRITE);
+        memcpy(swap_block, target_block, BLOCK_SIZE);
+        memcpy(target_block, source_block, BLOCK_SIZE);
+        memcpy(source_block, swap_block, BLOCK_SIZE);
+        putBlock(source + FIRST_DATA_BLOCK);
+        putBlock(cursor + FIRST_DATA_BLOCK);
+
+        uint32_t checksum = checksums[cursor];
+        checksums[cursor] = checksums[source];
+        checksums[source] = checksum;
+
+        file_blocks[other] = source + FIRST_DATA_BLOCK;
+        block_owner[source] = other;
+
+        blocks[k] = cursor + FIRST_DATA_BLOCK;
+        block_owner[cursor] = starts[i] + k;
+
+        moved += 2;
+        cursor++;
+        k++;
+      }
+    }
+  }
+
+  // the index blocks and the tree take exactly the blocks given up above, so they can't
+  // run out of space. they fill the free blocks from the end of the packed files on
+  alloc_cursor = cursor % NUM_DATA_BLOCKS;
+  for(int i = 0; i < count; i++)
+  {
+    int32_t inode_index = entries[i].inode;
+    if(inodes[inode_index].block_length > 0)
+    {
+      storeBlockList(inode_index, &file_blocks[starts[i]], inodes[inode_index].block_length);
+    }
+  }
+  directoryBuild(entries, count);
+
+  if(discarded > 0)
+  {
+    fprintf(output, "Discarded %d deleted file%s, they can no longer be undeleted.\n",
+      discarded, discarded == 1 ? "" : "s");
+  }
+
+  free(starts);
+  free(file_blocks);
+  free(entries);
+  return moved;
+}
+
+// one file in a snapshot record, followed by its block_length block numbers
+struct snapshot_file
+{
+  char name[64];
+  int32_t block_length;
+  uint32_t file_size;
+  time_t creation_time;
+  bool hidden;
+  bool readonly;
+};
+
+// bytes of a snapshot record held by each of its blocks, the rest is the next pointer
+#define RECORD_PAYLOAD (BLOCK_SIZE - (int)sizeof(int32_t))
+
+// returns the slot of the named snapshot or -1 if there is none
+int findSnapshot(char *name)
+{
+  for(int i = 0; i < MAX_SNAPSHOTS; i++)
+  {
+    if(snapshots->entries[i].name[0] != 0 && strcmp(snapshots->entries[i].name, name) == 0)
+    {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// writes size bytes of record into a chain of newly allocated blocks and returns the
+// first of them, or -1 if the image is too full
+int32_t writeRecord(uint8_t *record, size_t size, int32_t *block_count)
+{
+  int count = (size + RECORD_PAYLOAD - 1) / RECORD_PAYLOAD;
+  int32_t *chain = (int32_t *)malloc(count * sizeof(int32_t));
+
+  for(int i = 0; i < count; i++)
+  {
+    chain[i] = findFreeBlock(i > 0 ? chain[i - 1] + 1 : -1);
+    if(chain[i] == -1)
+    {
+      for(int j = 0; j < i; j++)
+      {
+        releaseBlock(chain[j]);
+      }
+      free(chain);
+      return -1;
+    }
+  }
+
+  for(int i = 0; i < count; i++)
+  {
+    size_t offset = (size_t)i * RECORD_PAYLOAD;
+    size_t length = size - offset < RECORD_PAYLOAD ? size - offset : RECORD_PAYLOAD;
+    int32_t next = i + 1 < count ? chain[i + 1] : -1;
+
+    uint8_t *block = getBlock(chain[i], BLOCK_NEW);
+    memcpy(block, record + offset, length);
+    memcpy(block + RECORD_PAYLOAD, &next, sizeof(next));
+    putBlock(chain[i]);
+  }
+
+  int32_t first = chain[0];
+  *block_count = count;
+  free(chain);
+  return first;
+}
+
+// reads the record of a snapshot back into memory, the caller frees it
+uint8_t *readRecord(struct snapshot *snap)
+{
+  uint8_t *record = (uint8_t *)malloc((size_t)snap->block_count * RECORD_PAYLOAD);
+  int32_t block = snap->first_block;
+
+  for(int i = 0; i < snap->block_count; i++)
+  {
+    uint8_t *buffer = getBlock(block, BLOCK_READ);
+    memcpy(record + (size_t)i * RECORD_PAYLOAD, buffer, RECORD_PAYLOAD);
+    int32_t next;
+    memcpy(&next, buffer + RECORD_PAYLOAD, sizeof(next));
+    putBlock(block);
+    block = next;
+  }
+
+  return record;
+}
+
+// calls fn on every file in a snapshot record with its position in the record, its
+// block list and arg
+void forEachSnapshotFile(uint8_t *record,
+  void (*fn)(int32_t, struct snapshot_file *, int32_t *, void *), void *arg)
+{
+  int32_t count;
+  memcpy(&count, record, sizeof(count));
+  uint8_t *position = record + sizeof(count);
+
+  for(int i = 0; i < count; i++)
+  {
+    struct snapshot_file file;
+    memcpy(&file, position, sizeof(file));
+    position += sizeof(file);
+
+    int32_t blocks[BLOCKS_PER_FILE];
+    memcpy(blocks, position, file.block_length * sizeof(int32_t));
+    position += file.block_length * sizeof(int32_t);
+
+    fn(i, &file, blocks, arg);
+  }
+}
+
+// adds (or drops) a reference to each block of a file in a snapshot record
+void retainFile(int32_t index, struct snapshot_file *file, int32_t *blocks, void *arg)
+{
+  for(int k = 0; k < file->block_length; k++)
+  {
+    retainBlock(blocks[k]);
+  }
+}
+
+void releaseFile(int32_t index, struct snapshot_file *file, int32_t *blocks, void *arg)
+{
+  for(int k = 0; k < file->block_length; k++)
+  {
+    releaseBlock(blocks[k]);
+  }
+}
+
+// adds up the index blocks the files of a snapshot record need when they are restored
+void countIndexBlocks(int32_t index, struct snapshot_file *file, int32_t *blocks, void *arg)
+{
+  *(int *)arg += indexBlocksFor(file->block_length);
+}
+
+// puts a file of a snapshot record back into the inode at its position and adds its
+// directory entry to the entry_list in arg. the file takes a reference to each of its
+// blocks next to the snapshot's own
+void restoreFile(int32_t i, struct snapshot_file *file, int32_t *blocks, void *arg)
+{
+  struct entry_list *list = arg;
+
+  inodes[i].file_size = file->file_size;
+  inodes[i].creation_time = file->creation_time;
+  inodes[i].hidden = file->hidden;
+  inodes[i].readonly = file->readonly;
+  inodes[i].inUse = true;
+  free_inodes[i] = 0;
+  if(file->block_length > 0)
+  {
+    storeBlockList(i, blocks, file->block_length);
+  }
+  retainFile(i, file, blocks, NULL);
+
+  struct _directoryEntry *entry = &list->entries[list->count++];
+  memset(entry, 0, sizeof(*entry));
+  memcpy(entry->name, file->name, 64);
+  entry->inode = i;
+  entry->inUse = true;
+}
+
+// captures the directory and inodes under the given name. only the metadata is copied,
+// into a record in the data blocks, and the snapshot takes a reference to every block
+// of every file so the blocks are shared copy-on-write until a file changes them
+void snapshot(char *name)
+{
+  if(strlen(name) >= sizeof(snapshots->entries[0].name))
+  {
+    fprintf(output, "ERROR: Snapshot name is too long.\n");
+    return;
+  }
+
+  if(findSnapshot(name) != -1)
+  {
+    fprintf(output, "ERROR: Snapshot %s exists.\n", name);
+    return;
+  }
+
+  int slot = -1;
+  for(int i = 0; i < MAX_SNAPSHOTS && slot == -1; i++)
+  {
+    if(snapshots->entries[i].name[0] == 0)
+    {
+      slot = i;
+    }
+  }
+
+  if(slot == -1)
+  {
+    fprintf(output, "ERROR: Too many snapshots, delete one first.\n");
+    return;
+  }
+
+  struct entry_list list;
+  list.entries = (struct _directoryEntry *)malloc(MAX_NUM_FILES * sizeof(struct _directoryEntry));
+  list.count = 0;
+  directoryScan("", collectEntry, &list);
+
+  // the record holds the number of files and then each file with its block list
+  int32_t count = 0;
+  size_t size = sizeof(count);
+  for(int i = 0; i < list.count; i++)
+  {
+    if(list.entries[i].inUse)
+    {
+      count++;
+      size += sizeof(struct snapshot_file)
+        + inodes[list.entries[i].inode].block_length * sizeof(int32_t);
+    }
+  }
+
+  uint8_t *record = (uint8_t *)calloc(1, size);
+  memcpy(record, &count, sizeof(count));
+  uint8_t *position = record + sizeof(count);
+  int32_t blocks[BLOCKS_PER_FILE];
+
+  for(int i = 0; i < list.count; i++)
+  {
+    if(!list.entries[i].inUse)
+    {
+      continue;
+    }
+
+    struct inode *node = &inodes[list.entries[i].inode];
+    struct snapshot_file file;
+    memset(&file, 0, sizeof(file));
+    memcpy(file.name, list.entries[i].name, 64);
+    file.block_length = node->block_length;
+    file.file_size = node->file_size;
+    file.creation_time = node->creation_time;
+    file.hidden = node->hidden;
+    file.readonly = node->readonly;
+
+    memcpy(position, &file, sizeof(file));
+    position += sizeof(file);
+    loadBlockList(list.entries[i].inode, blocks);
+    memcpy(position, blocks, node->block_length * sizeof(int32_t));
+    position += node->block_length * sizeof(int32_t);
+  }
+  free(list.entries);
+
+  struct snapshot *snap = &snapshots->entries[slot];
+  snap->first_block = writeRecord(record, size, &snap->block_count);
+
+  if(snap->first_block == -1)
+  {
+    fprintf(output, "ERROR: Not enough free disk space.\n");
+    free(record);
+    return;
+  }
+
+  forEachSnapshotFile(record, retainFile, NULL);
+  free(record);
+
+  strncpy(snap->name, name, sizeof(snap->name) - 1);
+  snap->creation_time = time(NULL);
+
+  fprintf(output, "Snapshot %s created.\n", name);
+}
+
+// puts the directory and inodes back the way they were when the snapshot was taken.
+// current files drop their block references, blocks only they used become free. the
+// snapshot is kept, so it can be rolled back to again
+void rollback(char *name)
+{
+  int slot = findSnapshot(name);
+  if(slot == -1)
+  {
+    fprintf(output, "ERROR: Snapshot not found.\n");
+    return;
+  }
+
+  uint8_t *record = readRecord(&snapshots->entries[slot]);
+  int32_t count;
+  memcpy(&count, record, sizeof(count));
+
+  struct entry_list list;
+  list.entries = (struct _directoryEntry *)malloc(MAX_NUM_FILES * sizeof(struct _directoryEntry));
+  list.count = 0;
+  directoryScan("", collectEntry, &list);
+
+  // the restored files need index blocks and a directory tree. make sure they fit in
+  // the free space plus what the current files give up, not counting their tree
+  int needed = 2 * (count / LEAF_ENTRIES + 2);
+  forEachSnapshotFile(record, countIndexBlocks, &needed);
+
+  int freed = 0;
+  int32_t blocks[BLOCKS_PER_FILE];
+  for(int i = 0; i < list.count; i++)
+  {
+    int32_t inode_index = list.entries[i].inode;
+    freed += indexBlocksFor(inodes[inode_index].block_length);
+    loadBlockList(inode_index, blocks);
+    for(int k = 0; k < inodes[inode_index].block_length && list.entries[i].inUse; k++)
+    {
+      freed += block_refs[blocks[k] - FIRST_DATA_BLOCK] == 1;
+    }
+  }
+
+  if(needed > (int)(df() / BLOCK_SIZE) + freed)
+  {
+    fprintf(output, "ERROR: Not enough free disk space.\n");
+    free(list.entries);
+    free(record);
+    return;
+  }
+
+  // deleted entries can't be undeleted any more, their blocks already went back
+  for(int i = 0; i < list.count; i++)
+  {
+    if(list.entries[i].inUse)
+    {
+      releaseBlocks(list.entries[i].inode);
+    }
+    freeInode(list.entries[i].inode);
+  }
+  directoryFree(super->directory_root, super->directory_height);
+  super->directory_root = -1;
+
+  // the files come back in the inodes at their record positions
+  list.count = 0;
+  forEachSnapshotFile(record, restoreFile, &list);
+  qsort(list.entries, list.count, sizeof(struct _directoryEntry), compareEntryNames);
+  directoryBuild(list.entries, list.count);
+  free(list.entries);
+  free(record);
+  indexRebuild();
+
+  fprintf(output, "Rolled back to snapshot %s.\n", name);
+}
+
+// drops a snapshot, its record blocks and its references to the file blocks
+void deleteSnapshot(char *name)
+{
+  int slot = findSnapshot(name);
+  if(slot == -1)
+  {
+    fprintf(output, "ERROR: Snapshot not found.\n");
+    return;
+  }
+
+  struct snapshot *snap = &snapshots->entries[slot];
+  uint8_t *record = readRecord(snap);
+  forEachSnapshotFile(record, releaseFile, NULL);
+  free(record);
+
+  int32_t block = snap->first_block;
+  for(int i = 0; i < snap->block_count; i++)
+  {
+    uint8_t *buffer = getBlock(block, BLOCK_READ);
+    int32_t next;
+    memcpy(&next, buffer + RECORD_PAYLOAD, sizeof(next));
+    putBlock(block);
+    releaseBlock(block);
+    block = next;
+  }
+
+  memset(snap, 0, sizeof(*snap));
+  fprintf(output, "Snapshot %s deleted.\n", name);
+}
+
+// lists the snapshots with the time they were taken
+void listSnapshots()
+{
+  bool not_found = true;
+
+  for(int i = 0; i < MAX_SNAPSHOTS; i++)
+  {
+    struct snapshot *snap = &snapshots->entries[i];
+    if(snap->name[0] == 0)
+    {
+      continue;
+    }
+
+    not_found = false;
+    char str_time[120];
+    struct tm tm;
+    strftime(str_time, sizeof(str_time), "%Y-%m-%d %H:%M:%S",
+      localtime_r(&snap->creation_time, &tm));
+    fprintf(output, "%-33s%-25s\n", snap->name, str_time);
+  }
+
+  if(not_found)
+  {
+    fprintf(output, "No snapshots found.\n");
+  }
+}
+
+#define MAX_SCRUB_THREADS 16
+#define SCRUB_CHUNK 64        // blocks a scrub thread takes at a time
+
+// a file whose blocks scrub checks, from the directory or from a snapshot
+struct scrub_file
+{
+  char name[64];
+  char *snapshot;      // name of the snapshot, NULL for the files in the directory
+};
+
+// the blocks scrub checks, each block once, and where they belong
+struct scrub_job
+{
+  int32_t *blocks;
+  int32_t *owners;     // file of each block in files
+  int32_t *indexes;    // position of each block in its file's block list
+  int count;
+  struct scrub_file *files;
+  int file_count;
+  int file_size;
+  uint8_t *seen;       // blocks already added, they may be shared with snapshots
+  char *snapshot;      // snapshot whose files are being added
+  int chunk;           // blocks a thread takes at a time
+  int next;            // first block no thread took yet
+  int32_t *bad;        // positions of the blocks that failed
+  int bad_count;
+};
+
+// adds the blocks of a file that aren't in the job yet
+void scrubAdd(struct scrub_job *job, char *name, int32_t *blocks, int length)
+{
+  if(job->file_count == job->file_size)
+  {
+    job->file_size *= 2;
+    job->files = (struct scrub_file *)realloc(job->files,
+      job->file_size * sizeof(struct scrub_file));
+  }
+
+  struct scrub_file *file = &job->files[job->file_count];
+  memcpy(file->name, name, 64);
+  file->snapshot = job->snapshot;
+
+  for(int k = 0; k < length; k++)
+  {
+    if(!job->seen[blocks[k] - FIRST_DATA_BLOCK])
+    {
+      job->seen[blocks[k] - FIRST_DATA_BLOCK] = 1;
+      job->blocks[job->count] = blocks[k];
+      job->owners[job->count] = job->file_count;
+      job->indexes[job->count] = k;
+      job->count++;
+    }
+  }
+  job->file_count++;
+}
+
+void scrubSnapshotFile(int32_t index, struct snapshot_file *file, int32_t *blocks, void *arg)
+{
+  scrubAdd(arg, file->name, blocks, file->block_length);
+}
+
+// scrub thread, checks chunks of blocks against their checksums until none are left
+void *scrubWorker(void *arg)
+{
+  struct scrub_job *job = arg;
+  int first;
+
+  while((first = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED)) < job->count)
+  {
+    int last = first + job->chunk < job->count ? first + job->chunk : job->count;
+    prefetchBlocks(&job->blocks[first], last - first);
+
+    for(int i = first; i < last; i++)
+    {
+      if(!checksumValid(job->blocks[i], getBlock(job->blocks[i], BLOCK_READ)))
+      {
+        job->bad[__atomic_fetch_add(&job->bad_count, 1, __ATOMIC_RELAXED)] = i;
+      }
+      putBlock(job->blocks[i]);
+    }
+  }
+
+  return NULL;
+}
+
+int compareInts(const void *a, const void *b)
+{
+  return *(int32_t *)a - *(int32_t *)b;
+}
+
+// checks every block of the files in the directory and in the snapshots against its
+// checksum, split up between a thread per CPU, and reports the corrupt ones
+void scrub()
+{
+  struct scrub_job job;
+  memset(&job, 0, sizeof(job));
+  job.blocks = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  job.owners = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  job.indexes = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  job.bad = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  job.seen = (uint8_t *)calloc(NUM_DATA_BLOCKS, 1);
+  job.file_size = 64;
+  job.files = (struct scrub_file *)malloc(job.file_size * sizeof(struct scrub_file));
+
+  struct entry_list list;
+  list.entries = (struct _directoryEntry *)malloc(MAX_NUM_FILES * sizeof(struct _directoryEntry));
+  list.count = 0;
+  directoryScan("", collectEntry, &list);
+
+  int32_t blocks[BLOCKS_PER_FILE];
+  for(int i = 0; i < list.count; i++)
+  {
+    if(list.entries[i].inUse)
+    {
+      loadBlockList(list.entries[i].inode, blocks);
+      scrubAdd(&job, list.entries[i].name, blocks, inodes[list.entries[i].inode].block_length);
+    }
+  }
+  free(list.entries);
+
+  for(int i = 0; i < MAX_SNAPSHOTS; i++)
+  {
+    struct snapshot *snap = &snapshots->entries[i];
+    if(snap->name[0] != 0)
+    {
+      uint8_t *record = readRecord(snap);
+      job.snapshot = snap->name;
+      forEachSnapshotFile(record, scrubSnapshotFile, &job);
+      free(record);
+    }
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count = cpus < 1 ? 1 : cpus > MAX_SCRUB_THREADS ? MAX_SCRUB_THREADS : cpus;
+
+  // in cache mode the chunks being read ahead may only take up half of the frames, a
+  // prefetch waits for free frames while holding the ones it already has
+  job.chunk = SCRUB_CHUNK;
+  if(cache_mode && job.chunk > num_frames / (2 * thread_count))
+  {
+    job.chunk = num_frames / (2 * thread_count) > 0 ? num_frames / (2 * thread_count) : 1;
+  }
+
+  pthread_t threads[MAX_SCRUB_THREADS];
+  for(int i = 0; i < thread_count; i++)
+  {
+    pthread_create(&threads[i], NULL, scrubWorker, &job);
+  }
+  for(int i = 0; i < thread_count; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  qsort(job.bad, job.bad_count, sizeof(int32_t), compareInts);
+  for(int i = 0; i < job.bad_count; i++)
+  {
+    int32_t position = job.bad[i];
+    struct scrub_file *file = &job.files[job.owners[position]];
+    if(file->snapshot != NULL)
+    {
+      fprintf(output, "ERROR: Block %d of %.64s in snapshot %s is corrupt.\n",
+        job.indexes[position], file->name, file->snapshot);
+    }
+    else
+    {
+      fprintf(output, "ERROR: Block %d of %.64s is corrupt.\n", job.indexes[position],
+        file->name);
+    }
+  }
+
+  fprintf(output, "Scrubbed %d blocks with %d thread%s, %d corrupt.\n", job.count,
+    thread_count, thread_count == 1 ? "" : "s", job.bad_count);
+
+  free(job.files);
+  free(job.seen);
+  free(job.bad);
+  free(job.indexes);
+  free(job.owners);
+  free(job.blocks);
+}
+
+#define MAX_GREP_THREADS 16
+#define MAX_PATTERN 255       // longest pattern grep searches for
+
+// the files grep searches and what it found in each of them
+struct grep_job
+{
+  char *pattern;
+  size_t length;
+  struct _directoryEntry *entries;
+  int count;
+  int next;                // first file no thread took yet
+  uint32_t **offsets;      // match offsets of each file
+  int *matches;
+  bool *corrupt;
+};
+
+// calls found for every position of pattern in the length bytes at text. on x86 sixteen
+// positions are tested at once for the first and the last byte of the pattern and only
+// where both match the rest is compared
+void findAll(uint8_t *text, size_t length, uint8_t *pattern, size_t pattern_length,
+  void (*found)(size_t, void *), void *arg)
+{
+  if(pattern_length == 0 || pattern_length > length)
+  {
+    return;
+  }
+
+  size_t i = 0;
+  size_t last = length - pattern_length;
+#if defined(__x86_64__) || defined(__SSE2__)
+  __m128i first_byte = _mm_set1_epi8(pattern[0]);
+  __m128i last_byte = _mm_set1_epi8(pattern[pattern_length - 1]);
+  for(; i + 16 <= last + 1; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((__m128i *)(text + i));
+    __m128i b = _mm_loadu_si128((__m128i *)(text + i + pattern_length - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first_byte),
+      _mm_cmpeq_epi8(b, last_byte)));
+    while(mask != 0)
+    {
+      size_t position = i + __builtin_ctz(mask);
+      if(pattern_length <= 2 || memcmp(text + position + 1, pattern + 1, pattern_length - 2) == 0)
+      {
+        found(position, arg);
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for(; i <= last; i++)
+  {
+    if(text[i] == pattern[0] && memcmp(text + i, pattern, pattern_length) == 0)
+    {
+      found(i, arg);
+    }
+  }
+}
+
+// the matches of one file, offsets are relative to base
+struct grep_matches
+{
+  uint32_t *offsets;
+  int count;
+  int size;
+  uint32_t base;
+  size_t limit;            // only matches starting before this count, -1 for all
+};
+
+void grepFound(size_t position, void *arg)
+{
+  struct grep_matches *m = arg;
+  if(position >= m->limit)
+  {
+    return;
+  }
+
+  if(m->count == m->size)
+  {
+    m->size = m->size == 0 ? 16 : m->size * 2;
+    m->offsets = (uint32_t *)realloc(m->offsets, m->size * sizeof(uint32_t));
+  }
+  m->offsets[m->count++] = m->base + position;
+}
+
+// searches one file for the pattern, a run of blocks consecutive in memory at a time.
+// the last pattern length - 1 bytes before each run are kept, matches starting in
+// them and ending in the run are found in those bytes joined with the run's first ones
+bool grepFile(struct grep_job *job, int32_t inode, struct grep_matches *m)
+{
+  int32_t blocks[BLOCKS_PER_FILE];
+  uint32_t size = inodes[inode].file_size;
+  int block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  size_t keep = job->length - 1;
+  uint8_t joined[2 * MAX_PATTERN];
+  size_t carried = 0;
+  uint32_t position = 0;
+  loadBlockList(inode, blocks);
+
+  for(int k = 0; k < block_count; )
+  {
+    // in cache mode the frames aren't next to each other, a block is a run
+    int end = k + 1;
+    while(!cache_mode && end < block_count && blocks[end] == blocks[end - 1] + 1)
+    {
+      end++;
+    }
+
+    uint8_t *run = getBlock(blocks[k], BLOCK_READ);
+    bool intact = true;
+    for(int j = k; j < end && verify_reads && intact; j++)
+    {
+      intact = checksumValid(blocks[j], run + (size_t)(j - k) * BLOCK_SIZE);
+    }
+    if(!intact)
+    {
+      putBlock(blocks[k]);
+      return false;
+    }
+
+    size_t length = (size_t)(end - k) * BLOCK_SIZE;
+    if(position + length > size)
+    {
+      length = size - position;
+    }
+
+    size_t head = length < keep ? length : keep;
+    memcpy(joined + carried, run, head);
+    m->base = position - carried;
+    m->limit = carried;
+    findAll(joined, carried + head, (uint8_t *)job->pattern, job->length, grepFound, m);
+
+    m->base = position;
+    m->limit = -1;
+    findAll(run, length, (uint8_t *)job->pattern, job->length, grepFound, m);
+
+    // the bytes kept for the next run are the last ones seen, which may still include
+    // some of the ones kept before when the run is short
+    if(length >= keep)
+    {
+      memcpy(joined, run + length - keep, keep);
+      carried = keep;
+    }
+    else
+    {
+      size_t total = carried + length;
+      size_t drop = total > keep ? total - keep : 0;
+      memmove(joined, joined + drop, total - drop);
+      carried = total - drop;
+    }
+
+    putBlock(blocks[k]);
+    position += length;
+    k = end;
+  }
+  return true;
+}
+
+// grep thread, takes the files one at a time until none are left
+void *grepWorker(void *arg)
+{
+  struct grep_job *job = arg;
+  int i;
+
+  while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+  {
+    int32_t inode = lockFile(job->entries[i].name, false);
+    if(inode == -1)
+    {
+      continue;
+    }
+
+    struct grep_matches m;
+    memset(&m, 0, sizeof(m));
+    job->corrupt[i] = !grepFile(job, inode, &m);
+    job->offsets[i] = m.offsets;
+    job->matches[i] = m.count;
+    unlockInode(inode);
+  }
+
+  return NULL;
+}
+
+// prints the name and byte offset of every place a file holds the pattern, of the
+// files matching the glob or all of them. the blocks are searched where they are, the
+// files split up between a thread per CPU
+void grep(char *pattern, char *glob)
+{
+  if(strlen(pattern) > MAX_PATTERN)
+  {
+    fprintf(output, "ERROR: The pattern is too long.\n");
+    return;
+  }
+
+  struct entry_list list;
+  list.entries = (struct _directoryEntry *)malloc(MAX_NUM_FILES * sizeof(struct _directoryEntry));
+  list.count = 0;
+  pthread_rwlock_rdlock(&directory_lock);
+  directoryScan("", collectEntry, &list);
+  pthread_rwlock_unlock(&directory_lock);
+
+  struct grep_job job;
+  memset(&job, 0, sizeof(job));
+  job.pattern = pattern;
+  job.length = strlen(pattern);
+  job.entries = list.entries;
+  for(int i = 0; i < list.count; i++)
+  {
+    if(list.entries[i].inUse && (glob == NULL || fnmatch(glob, list.entries[i].name, 0) == 0))
+    {
+      job.entries[job.count++] = list.entries[i];
+    }
+  }
+  job.offsets = (uint32_t **)calloc(job.count + 1, sizeof(uint32_t *));
+  job.matches = (int *)calloc(job.count + 1, sizeof(int));
+  job.corrupt = (bool *)calloc(job.count + 1, sizeof(bool));
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count = cpus < 1 ? 1 : cpus > MAX_GREP_THREADS ? MAX_GREP_THREADS : cpus;
+
+  pthread_t threads[MAX_GREP_THREADS];
+  for(int i = 0; i < thread_count; i++)
+  {
+    pthread_create(&threads[i], NULL, grepWorker, &job);
+  }
+  for(int i = 0; i < thread_count; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  int matches = 0;
+  int files = 0;
+  for(int i = 0; i < job.count; i++)
+  {
+    char name[65];
+    snprintf(name, sizeof(name), "%.64s", job.entries[i].name);
+    if(job.corrupt[i])
+    {
+      fprintf(output, "ERROR: %s is corrupt, a block doesn't match its checksum.\n", name);
+    }
+    for(int j = 0; j < job.matches[i]; j++)
+    {
+      fprintf(output, "%s:%u\n", name, job.offsets[i][j]);
+    }
+    matches += job.matches[i];
+    files += job.matches[i] > 0;
+    free(job.offsets[i]);
+  }
+
+  fprintf(output, "Found %d matches in %d of %d files.\n", matches, files, job.count);
+
+  free(job.offsets);
+  free(job.matches);
+  free(job.corrupt);
+  free(list.entries);
+}
+
+#define MAX_FSCK_THREADS 16
+#define FSCK_CHUNK 256        // inodes an fsck thread takes at a time
+#define MAP_WORDS ((NUM_DATA_BLOCKS + 63) / 64)
+
+// what fsck repaired in an inode
+#define FSCK_STATE 0x1        // the inode was in use and its entry deleted or the other way
+#define FSCK_TRUNCATED 0x2    // the block list left the data blocks and was cut short
+
+// users of a block other than the inodes, for reporting blocks used twice
+#define OWNER_NONE -1
+#define OWNER_DIRECTORY -2
+#define OWNER_SNAPSHOT -3     // snapshot i is OWNER_SNAPSHOT - i
+
+// data blocks in use as seen by fsck. used has a bit for every block referenced at least
+// once and shared one for every block referenced more than once
+struct block_map
+{
+  uint64_t used[MAP_WORDS];
+  uint64_t shared[MAP_WORDS];
+};
+
+// what fsck found so far. the threads share the directory entries and each fills its
+// own block map for a range of inodes, merged into map when it's done
+struct fsck_job
+{
+  struct _directoryEntry *entries;
+  int count;
+  int size;
+  int32_t *entry_of;          // entry pointing at each inode, -1 for none
+  uint8_t *problems;          // FSCK_ flags of each inode
+  int next;                   // first inode no thread took yet
+  struct block_map *map;      // blocks of the directory, records, index blocks and files
+  pthread_mutex_t lock;       // guards map while the threads merge into it
+  int32_t *tree_blocks;       // nodes of the directory tree
+  int tree_count;
+  int32_t next_leaf;          // where the last leaf links to, -2 before the first leaf
+  uint8_t *counts;            // references to each shared block
+  int32_t *owners;            // first user of each shared block
+  int fixed;
+};
+
+bool dataBlock(int32_t block)
+{
+  return block >= FIRST_DATA_BLOCK && block < NUM_BLOCKS;
+}
+
+bool mapBit(uint64_t *bits, int32_t block)
+{
+  int32_t i = block - FIRST_DATA_BLOCK;
+  return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+// marks a block in the map, it is shared if it was marked already
+void markBlock(struct block_map *map, int32_t block)
+{
+  int32_t i = block - FIRST_DATA_BLOCK;
+  uint64_t bit = (uint64_t)1 << (i % 64);
+  map->shared[i / 64] |= map->used[i / 64] & bit;
+  map->used[i / 64] |= bit;
+}
+
+// ORs the map of a thread into the job's, blocks in both of them are shared
+void mergeMaps(struct block_map *into, struct block_map *from)
+{
+  for(int w = 0; w < MAP_WORDS; w++)
+  {
+    into->shared[w] |= from->shared[w] | (into->used[w] & from->used[w]);
+    into->used[w] |= from->used[w];
+  }
+}
+
+// walks a subtree of the directory, collecting its nodes and the entries of its leaves.
+// returns false if a node is outside the data blocks, reached twice or overfull, or the
+// leaves aren't linked in order
+bool fsckTree(struct fsck_job *job, struct block_map *seen, int32_t node, int level)
+{
+  if(!dataBlock(node) || mapBit(seen->used, node))
+  {
+    return false;
+  }
+  markBlock(seen, node);
+  job->tree_blocks[job->tree_count++] = node;
+
+  if(level == 0)
+  {
+    struct directory_leaf leaf;
+    readNode(node, &leaf, sizeof(leaf));
+    if(leaf.count < 0 || leaf.count > LEAF_ENTRIES || job->count + leaf.count > job->size
+      || (job->next_leaf != -2 && job->next_leaf != node))
+    {
+      return false;
+    }
+
+    memcpy(&job->entries[job->count], leaf.entries, leaf.count * sizeof(struct _directoryEntry));
+    job->count += leaf.count;
+    job->next_leaf = leaf.next;
+    return true;
+  }
+
+  struct directory_node inner;
+  readNode(node, &inner, sizeof(inner));
+  if(inner.count < 0 || inner.count > NODE_KEYS)
+  {
+    return false;
+  }
+
+  for(int i = 0; i <= inner.count; i++)
+  {
+    if(!fsckTree(job, seen, inner.children[i], level - 1))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// follows the chain of blocks holding a snapshot record into chain, which has to hold
+// block_count entries. returns false if it leaves the data blocks
+bool fsckChain(struct snapshot *snap, int32_t *chain)
+{
+  int32_t block = snap->first_block;
+
+  for(int i = 0; i < snap->block_count; i++)
+  {
+    if(!dataBlock(block))
+    {
+      return false;
+    }
+
+    chain[i] = block;
+    memcpy(&block, getBlock(chain[i], BLOCK_READ) + RECORD_PAYLOAD, sizeof(block));
+    putBlock(chain[i]);
+  }
+
+  return true;
+}
+
+// adds a reference from a file in a snapshot to each of its blocks
+void countSnapshotFile(int32_t index, struct snapshot_file *file, int32_t *blocks, void *arg)
+{
+  uint8_t *snapshot_refs = arg;
+  for(int k = 0; k < file->block_length; k++)
+  {
+    snapshot_refs[blocks[k] - FIRST_DATA_BLOCK]++;
+  }
+}
+
+// checks that a snapshot record is made of whole files whose blocks are all data blocks,
+// then marks the blocks of the record in map and counts the references of its files in
+// snapshot_refs. returns false for a damaged snapshot, nothing is counted then
+bool fsckSnapshot(struct snapshot *snap, struct block_map *map, uint8_t *snapshot_refs)
+{
+  if(snap->block_count <= 0 || snap->block_count > NUM_DATA_BLOCKS)
+  {
+    return false;
+  }
+
+  int32_t *chain = (int32_t *)malloc(snap->block_count * sizeof(int32_t));
+  if(!fsckChain(snap, chain))
+  {
+    free(chain);
+    return false;
+  }
+
+  uint8_t *record = readRecord(snap);
+  size_t size = (size_t)snap->block_count * RECORD_PAYLOAD;
+  size_t position = sizeof(int32_t);
+  int32_t count;
+  memcpy(&count, record, sizeof(count));
+
+  bool valid = count >= 0;
+  for(int i = 0; i < count && valid; i++)
+  {
+    struct snapshot_file file;
+    valid = position + sizeof(file) <= size;
+    if(valid)
+    {
+      memcpy(&file, record + position, sizeof(file));
+      position += sizeof(file);
+      valid = file.block_length >= 0 && file.block_length <= BLOCKS_PER_FILE
+        && position + file.block_length * sizeof(int32_t) <= size;
+    }
+
+    for(int k = 0; valid && k < file.block_length; k++)
+    {
+      int32_t block;
+      memcpy(&block, record + position + k * sizeof(int32_t), sizeof(block));
+      valid = dataBlock(block);
+    }
+    position += valid ? file.block_length * sizeof(int32_t) : 0;
+  }
+
+  if(valid)
+  {
+    for(int i = 0; i < snap->block_count; i++)
+    {
+      markBlock(map, chain[i]);
+    }
+    forEachSnapshotFile(record, countSnapshotFile, snapshot_refs);
+  }
+
+  free(record);
+  free(chain);
+  return valid;
+}
+
+// checks the inode an entry points at. its state has to match the entry and its block
+// list is cut short at the first block outside the data blocks. its index blocks, and
+// the blocks of a file that isn't deleted, are marked in map
+void fsckInode(struct fsck_job *job, int32_t i, struct block_map *map)
+{
+  struct inode *node = &inodes[i];
+  bool live = job->entries[job->entry_of[i]].inUse;
+  if(node->inUse != live)
+  {
+    node->inUse = live;
+    job->problems[i] |= FSCK_STATE;
+  }
+
+  int length = node->block_length < 0 ? 0 : node->block_length > BLOCKS_PER_FILE
+    ? BLOCKS_PER_FILE : node->block_length;
+  for(int j = 0; j < indexBlocksFor(length); j++)
+  {
+    if(!dataBlock(node->index_blocks[j]))
+    {
+      length = j * POINTERS_PER_BLOCK;
+    }
+  }
+
+  int32_t blocks[BLOCKS_PER_FILE];
+  node->block_length = length;
+  loadBlockList(i, blocks);
+  for(int k = 0; k < length; k++)
+  {
+    if(!dataBlock(blocks[k]))
+    {
+      length = k;
+    }
+  }
+
+  if(length != node->block_length || node->file_size > (uint32_t)length * BLOCK_SIZE)
+  {
+    job->problems[i] |= FSCK_TRUNCATED;
+    node->block_length = length;
+    if(node->file_size > (uint32_t)length * BLOCK_SIZE)
+    {
+      node->file_size = length * BLOCK_SIZE;
+    }
+  }
+
+  // index blocks the shorter list doesn't need are left to the reference count rebuild
+  for(int j = 0; j < INDEX_BLOCKS; j++)
+  {
+    if(j < indexBlocksFor(length))
+    {
+      markBlock(map, node->index_blocks[j]);
+    }
+    else
+    {
+      node->index_blocks[j] = -1;
+    }
+  }
+
+  for(int k = 0; live && k < length; k++)
+  {
+    markBlock(map, blocks[k]);
+  }
+}
+
+// fsck thread, checks chunks of inodes into a map of its own until none are left
+void *fsckWorker(void *arg)
+{
+  struct fsck_job *job = arg;
+  struct block_map *map = (struct block_map *)calloc(1, sizeof(struct block_map));
+  int first;
+
+  while((first = __atomic_fetch_add(&job->next, FSCK_CHUNK, __ATOMIC_RELAXED)) < MAX_NUM_FILES)
+  {
+    for(int i = first; i < first + FSCK_CHUNK && i < MAX_NUM_FILES; i++)
+    {
+      if(job->entry_of[i] != -1)
+      {
+        fsckInode(job, i, map);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&job->lock);
+  mergeMaps(job->map, map);
+  pthread_mutex_unlock(&job->lock);
+
+  free(map);
+  return NULL;
+}
+
+// prints who uses a block, an inode, the directory or a snapshot record
+void ownerName(struct fsck_job *job, int32_t owner, char *name, size_t size)
+{
+  if(owner >= 0)
+  {
+    snprintf(name, size, "%.64s", job->entries[job->entry_of[owner]].name);
+  }
+  else if(owner == OWNER_DIRECTORY)
+  {
+    snprintf(name, size, "the directory");
+  }
+  else
+  {
+    snprintf(name, size, "snapshot %s", snapshots->entries[OWNER_SNAPSHOT - owner].name);
+  }
+}
+
+// counts a reference to a block the map found shared and reports every user of it
+// after the first
+void fsckShared(struct fsck_job *job, int32_t block, int32_t owner)
+{
+  int32_t i = block - FIRST_DATA_BLOCK;
+  if(!mapBit(job->map->shared, block))
+  {
+    return;
+  }
+
+  if(job->counts[i]++ == 0)
+  {
+    job->owners[i] = owner;
+    return;
+  }
+
+  char first[96];
+  char second[96];
+  ownerName(job, job->owners[i], first, sizeof(first));
+  ownerName(job, owner, second, sizeof(second));
+  fprintf(output, "ERROR: Block %d is used by both %s and %s.\n", block, first, second);
+  job->fixed++;
+}
+
+// true if another entry with the same name as entry i was kept already. the entries
+// are sorted by name, so they are next to it
+bool nameKept(struct fsck_job *job, int i)
+{
+  for(int step = -1; step <= 1; step += 2)
+  {
+    for(int j = i + step; j >= 0 && j < job->count
+      && strncmp(job->entries[j].name, job->entries[i].name, 64) == 0; j += step)
+    {
+      int32_t inode = job->entries[j].inode;
+      if(inode >= 0 && inode < MAX_NUM_FILES && job->entry_of[inode] == j)
+      {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+// cross-checks the directory, the inodes and the snapshots and rebuilds the free inode
+// map and the block reference counts from what they use. the inodes are checked by a
+// thread per CPU, each marking the blocks it finds in a bitmap of its own, and the
+// bitmaps are merged to find blocks used twice. damaged entries, inodes and snapshots
+// are dropped and the directory is rebuilt if its tree is damaged
+void fsck()
+{
+  struct fsck_job job;
+  memset(&job, 0, sizeof(job));
+  job.size = 2 * MAX_NUM_FILES;
+
+  // a damaged tree may fill all job.size entries, the lost inodes are added behind them
+  job.entries = (struct _directoryEntry *)malloc((job.size + MAX_NUM_FILES)
+    * sizeof(struct _directoryEntry));
+  job.entry_of = (int32_t *)malloc(MAX_NUM_FILES * sizeof(int32_t));
+  job.problems = (uint8_t *)calloc(MAX_NUM_FILES, 1);
+  job.map = (struct block_map *)calloc(1, sizeof(struct block_map));
+  job.tree_blocks = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  job.counts = (uint8_t *)calloc(NUM_DATA_BLOCKS, 1);
+  job.owners = (int32_t *)malloc(NUM_DATA_BLOCKS * sizeof(int32_t));
+  job.next_leaf = -2;
+  pthread_mutex_init(&job.lock, NULL);
+
+  // the directory, a damaged tree is rebuilt from the entries that could be read
+  struct block_map *seen = (struct block_map *)calloc(1, sizeof(struct block_map));
+  bool rebuild = super->directory_height < 0 || super->directory_height > MAX_TREE_HEIGHT
+    || !fsckTree(&job, seen, super->directory_root, super->directory_height)
+    || job.next_leaf != -1;
+  free(seen);
+  if(rebuild)
+  {
+    fprintf(output, "ERROR: The directory tree is damaged, rebuilding it.\n");
+    job.fixed++;
+  }
+
+  // entries with bad names or inodes, or with a name or inode another entry has, are
+  // dropped. files that aren't deleted go first so they keep their inode
+  qsort(job.entries, job.count, sizeof(struct _directoryEntry), compareEntryNames);
+  for(int i = 0; i < MAX_NUM_FILES; i++)
+  {
+    job.entry_of[i] = -1;
+  }
+
+  for(int pass = 0; pass < 2; pass++)
+  {
+    for(int i = 0; i < job.count; i++)
+    {
+      struct _directoryEntry *entry = &job.entries[i];
+      if(entry->inUse != (pass == 0) || entry->name[0] == 0)
+      {
+        continue;
+      }
+
+      if(entry->inode < 0 || entry->inode >= MAX_NUM_FILES)
+      {
+        fprintf(output, "ERROR: %.64s points at inode %d, removed it.\n", entry->name,
+          entry->inode);
+      }
+      else if(job.entry_of[entry->inode] != -1)
+      {
+        fprintf(output, "ERROR: %.64s shares its inode with %.64s, removed it.\n",
+          entry->name, job.entries[job.entry_of[entry->inode]].name);
+      }
+      else if(nameKept(&job, i))
+      {
+        fprintf(output, "ERROR: %.64s is in the directory twice, removed one.\n", entry->name);
+      }
+      else
+      {
+        job.entry_of[entry->inode] = i;
+        continue;
+      }
+
+      entry->name[0] = 0;
+      job.fixed++;
+      rebuild = true;
+    }
+  }
+
+  // inodes in use that no entry points at are put back in the directory
+  for(int32_t i = 0; i < MAX_NUM_FILES; i++)
+  {
+    if(job.entry_of[i] == -1 && inodes[i].inUse)
+    {
+      struct _directoryEntry *entry = &job.entries[job.count];
+      memset(entry, 0, sizeof(*entry));
+      snprintf(entry->name, 64, "lost.%d", i);
+      entry->inode = i;
+      entry->inUse = true;
+
+      fprintf(output, "ERROR: Inode %d has no directory entry, recovered it as %s.\n", i,
+        entry->name);
+      job.entry_of[i] = job.count++;
+      job.fixed++;
+      rebuild = true;
+    }
+  }
+
+  // the snapshots, their files hold references of their own next to the map
+  uint8_t *snapshot_refs = (uint8_t *)calloc(NUM_DATA_BLOCKS, 1);
+  for(int i = 0; i < MAX_SNAPSHOTS; i++)
+  {
+    struct snapshot *snap = &snapshots->entries[i];
+    if(snap->name[0] != 0 && !fsckSnapshot(snap, job.map, snapshot_refs))
+    {
+      fprintf(output, "ERROR: Snapshot %s is damaged, removed it.\n", snap->name);
+      memset(snap, 0, sizeof(*snap));
+      job.fixed++;
+    }
+  }
+
+  if(!rebuild)
+  {
+    for(int i = 0; i < job.tree_count; i++)
+    {
+      markBlock(job.map, job.tree_blocks[i]);
+    }
+  }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count = cpus < 1 ? 1 : cpus > MAX_FSCK_THREADS ? MAX_FSCK_THREADS : cpus;
+
+  pthread_t threads[MAX_FSCK_THREADS];
+  for(int i = 0; i < thread_count; i++)
+  {
+    pthread_create(&threads[i], NULL, fsckWorker, &job);
+  }
+  for(int i = 0; i < thread_count; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  for(int32_t i = 0; i < MAX_NUM_FILES; i++)
+  {
+    if(job.problems[i] & FSCK_STATE)
+    {
+      fprintf(output, "ERROR: The inode of %.64s didn't match its entry, fixed it.\n",
+        job.entries[job.entry_of[i]].name);
+      job.fixed++;
+    }
+    if(job.problems[i] & FSCK_TRUNCATED)
+    {
+      fprintf(output, "ERROR: %.64s has blocks outside the image, cut it to %u bytes.\n",
+        job.entries[job.entry_of[i]].name, inodes[i].file_size);
+      job.fixed++;
+    }
+  }
+
+  // blocks used twice are rare, only then all users are walked again to count them
+  bool shared = false;
+  for(int w = 0; w < MAP_WORDS; w++)
+  {
+    shared |= job.map->shared[w] != 0;
+  }
+
+  if(shared)
+  {
+    for(int i = 0; !rebuild && i < job.tree_count; i++)
+    {
+      fsckShared(&job, job.tree_blocks[i], OWNER_DIRECTORY);
+    }
+
+    for(int s = 0; s < MAX_SNAPSHOTS; s++)
+    {
+      struct snapshot *snap = &snapshots->entries[s];
+      if(snap->name[0] != 0)
+      {
+        int32_t *chain = (int32_t *)malloc(snap->block_count * sizeof(int32_t));
+        fsckChain(snap, chain);
+        for(int i = 0; i < snap->block_count; i++)
+        {
+          fsckShared(&job, chain[i], OWNER_SNAPSHOT - s);
+        }
+        free(chain);
+      }
+    }
+
+    int32_t blocks[BLOCKS_PER_FILE];
+    for(int32_t i = 0; i < MAX_NUM_FILES; i++)
+    {
+      if(job.entry_of[i] != -1)
+      {
+        for(int j = 0; j < indexBlocksFor(inodes[i].block_length); j++)
+        {
+          fsckShared(&job, inodes[i].index_blocks[j], i);
+        }
+
+        loadBlockList(i, blocks);
+        for(int k = 0; inodes[i].inUse && k < inodes[i].block_length; k++)
+        {
+          fsckShared(&job, blocks[k], i);
+        }
+      }
+    }
+  }
+
+  // the reference counts follow from the map and the snapshots
+  int leaked = 0;
+  int lost = 0;
+  int wrong = 0;
+  for(int32_t i = 0; i < NUM_DATA_BLOCKS; i++)
+  {
+    int32_t block = i + FIRST_DATA_BLOCK;
+    int refs = snapshot_refs[i] + (mapBit(job.map->shared, block) ? job.counts[i]
+      : mapBit(job.map->used, block));
+
+    if(block_refs[i] != refs)
+    {
+      leaked += refs == 0;
+      lost += refs != 0 && block_refs[i] == 0;
+      wrong += refs != 0 && block_refs[i] != 0;
+      block_refs[i] = refs;
+    }
+  }
+
+  if(leaked > 0)
+  {
+    fprintf(output, "ERROR: %d blocks were used by nothing, freed them.\n", leaked);
+  }
+  if(lost > 0)
+  {
+    fprintf(output, "ERROR: %d blocks in use were free, took them back.\n", lost);
+  }
+  if(wrong > 0)
+  {
+    fprintf(output, "ERROR: %d blocks had the wrong reference count, fixed them.\n", wrong);
+  }
+  job.fixed += leaked + lost + wrong;
+
+  int inode_fixes = 0;
+  for(int32_t i = 0; i < MAX_NUM_FILES; i++)
+  {
+    uint8_t free_inode = job.entry_of[i] == -1;
+    if(free_inodes[i] != free_inode)
+    {
+      free_inodes[i] = free_inode;
+      inode_fixes++;
+    }
+
+    if(free_inode)
+    {
+      memset(&inodes[i], 0, sizeof(struct inode));
+      for(int j = 0; j < INDEX_BLOCKS; j++)
+      {
+        inodes[i].index_blocks[j] = -1;
+      }
+    }
+  }
+
+  if(inode_fixes > 0)
+  {
+    fprintf(output, "ERROR: %d inodes were wrong in the free inode map, fixed them.\n",
+      inode_fixes);
+    job.fixed += inode_fixes;
+  }
+
+  // the files using a block after its first user get a copy of it, so changing one
+  // of them doesn't change the other
+  for(int32_t i = 0; shared && i < MAX_NUM_FILES; i++)
+  {
+    if(job.entry_of[i] == -1 || !inodes[i].inUse)
+    {
+      continue;
+    }
+
+    int32_t blocks[BLOCKS_PER_FILE];
+    bool copied = false;
+    loadBlockList(i, blocks);
+
+    // an index block is written again from blocks by storeBlockList, it only needs
+    // a block of its own
+    for(int j = 0; j < indexBlocksFor(inodes[i].block_length); j++)
+    {
+      int32_t index_block = inodes[i].index_blocks[j];
+      if(mapBit(job.map->shared, index_block) && job.owners[index_block - FIRST_DATA_BLOCK] != i)
+      {
+        int32_t fresh = findFreeBlock(index_block);
+        if(fresh == -1)
+        {
+          fprintf(output, "ERROR: Not enough free space to copy the blocks of %.64s.\n",
+            job.entries[job.entry_of[i]].name);
+          break;
+        }
+        releaseBlock(index_block);
+        inodes[i].index_blocks[j] = fresh;
+        copied = true;
+      }
+    }
+
+    for(int k = 0; k < inodes[i].block_length; k++)
+    {
+      if(mapBit(job.map->shared, blocks[k]) && job.owners[blocks[k] - FIRST_DATA_BLOCK] != i)
+      {
+        if(unshareBlock(blocks, k) == -1)
+        {
+          fprintf(output, "ERROR: Not enough free space to copy the blocks of %.64s.\n",
+            job.entries[job.entry_of[i]].name);
+          break;
+        }
+        copied = true;
+      }
+    }
+
+    if(copied)
+    {
+      storeBlockList(i, blocks, inodes[i].block_length);
+    }
+  }
+
+  int files = 0;
+  if(rebuild)
+  {
+    for(int i = 0; i < job.count; i++)
+    {
+      if(job.entries[i].name[0] != 0)
+      {
+        job.entries[files++] = job.entries[i];
+      }
+    }
+    qsort(job.entries, files, sizeof(struct _directoryEntry), compareEntryNames);
+
+    int32_t root = super->directory_root;
+    super->directory_root = -1;
+    if(directoryBuild(job.entries, files) == -1)
+    {
+      super->directory_root = root;
+      fprintf(output, "ERROR: Not enough free space to rebuild the directory.\n");
+    }
+  }
+  else
+  {
+    files = job.count;
+  }
+
+  indexRebuild();
+
+  // what was wrong may have come from changes the sync map never saw, like blocks a
+  // cache wrote back before the image was saved. the next sync-to digests every block
+  if(job.fixed > 0)
+  {
+    super->sync_point = 0;
+  }
+
+  fprintf(output, "Checked %d files and %d blocks with %d thread%s, %d problems fixed.\n",
+    files, NUM_DATA_BLOCKS - df() / BLOCK_SIZE, thread_count, thread_count == 1 ? "" : "s",
+    job.fixed);
+
+  pthread_mutex_destroy(&job.lock);
+  free(snapshot_refs);
+  free(job.owners);
+  free(job.counts);
+  free(job.tree_blocks);
+  free(job.map);
+  free(job.problems);
+  free(job.entry_of);
+  free(job.entries);
+}
+
+// splits the command line into tokens on whitespace. token has to hold
+// MAX_NUM_ARGUMENTS entries, returns the number of tokens parsed
+int tokenize(char *command_string, char **token)
+{
+  // Nulls out the token array
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
+  {
+    token[i] = NULL;
+  }
+
+  int token_count = 0;
+
+  // Pointer to point to the token
+  // parsed by strsep
+  char *argument_ptr = NULL;
+
+  char *working_string = strdup(command_string);
+
+  // we are going to move the working_string pointer so we
+  // keep track of its original value so we can deallocate
+  // the correct amount at the end
+  char *head_ptr = working_string;
+
+  // Tokenize the input strings with whitespace used as the delimiter
+  while (((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
+         (token_count < MAX_NUM_ARGUMENTS))
+  {
+    token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
+    if (strlen(token[token_count]) == 0)
+    {
+      free(token[token_count]);
+      token[token_count] = NULL;
+    }
+    token_count++;
+  }
+
+  free(head_ptr);
+
+  return token_count;
+}
+
+// frees the tokens allocated by tokenize()
+void free_tokens(char **token)
+{
+  for (int i = 0; i < MAX_NUM_ARGUMENTS; i++)
+  {
+    if (token[i] != NULL)
+    {
+      free(token[i]);
+      token[i] = NULL;
+    }
+  }
+}
+
+// runs a single parsed command against the image
+void dispatch(char **token, int token_count)
+{
+  if(strcmp(token[0], "open") == 0)
+  {
+    if(token_count != 2 && token_count != 3)
+    {
+      fprintf(output, "ERROR: usage open <disk name> [cache size in KB].\n");
+      return;
+    }
+    // open functionality
+    if(token[1] == NULL) //file exists
+    {
+      fprintf(output, "ERROR: File not found.\n");
+      return;
+    }
+
+    //open, with a block cache if a cache size was given
+    openfs(token[1], token[2] != NULL ? atoi(token[2]) : 0);
+  }
+
+  if(strcmp(token[0], "createfs") == 0 && token_count == 2)
+  {
+    // createfs functionality
+    if(token[1] == NULL)
+    {
+      fprintf(output, "ERROR: File name cannot be NULL.\n");
+      return;
+    }
+
+    createfs(token[1]);
+  }
+
+  if(strcmp(token[0], "use") == 0)
+  {
+    // use [image] functionality
+    if(token_count == 1 || token[1] == NULL)
+    {
+      listImages();
+    }
+    else if(token_count == 2)
+    {
+      useImage(token[1]);
+    }
+    else
+    {
+      fprintf(output, "ERROR: usage: use [image]\n");
+    }
+  }
+
+  if(strcmp(token[0], "apply") == 0)
+  {
+    // applies a sync-to delta to a backup image file, no image has to be open
+    if(token_count != 3 || token[1] == NULL || token[2] == NULL)
+    {
+      fprintf(output, "ERROR: usage: apply <backup image> <delta|->\n");
+      return;
+    }
+
+    if(strcmp(token[1], image_name) == 0 || findImage(token[1]) != -1)
+    {
+      fprintf(output, "ERROR: %s is open, close it first.\n", token[1]);
+      return;
+    }
+
+#ifdef MFSD
+    if(strcmp(token[2], "-") == 0)
+    {
+      fprintf(output, "ERROR: apply - only works in mfs, give a delta file.\n");
+      return;
+    }
+#endif
+
+    applyDelta(token[1], token[2]);
+  }
+
+  if(strcmp(token[0], "profile") == 0)
+  {
+    // profile [file|off] functionality
+    profile(token, token_count);
+  }
+
+  if(strcmp(token[0], "direct") == 0)
+  {
+    // direct [on|off] functionality
+    if(token_count == 2 && token[1] != NULL && strcmp(token[1], "on") == 0)
+    {
+      direct_io = true;
+    }
+    else if(token_count == 2 && token[1] != NULL && strcmp(token[1], "off") == 0)
+    {
+      direct_io = false;
+    }
+    else if(token_count != 1)
+    {
+      fprintf(output, "ERROR: usage: direct [on|off]\n");
+      return;
+    }
+
+    fprintf(output, direct_io ? "Full image loads and saves bypass the page cache.\n"
+      : "Full image loads and saves go through the page cache.\n");
+  }
+
+  if(strcmp(token[0], "flush") == 0)
+  {
+    // background flusher settings, the interval in seconds and the dirty block threshold
+    char *end = "";
+    char *rest = "";
+    long interval = token_count >= 2 && token[1] != NULL ? strtol(token[1], &end, 10) : 0;
+    long threshold = token_count == 3 && token[2] != NULL ? strtol(token[2], &rest, 10) : 0;
+    if(token_count == 1)
+    {
+      flushStatus();
+    }
+    else if(token_count == 2 && token[1] != NULL && strcmp(token[1], "off") == 0)
+    {
+      flushSettings(0, 0);
+    }
+    else if(token_count > 3 || *end != 0 || *rest != 0 || interval < 0 || threshold < 0
+      || threshold > NUM_DATA_BLOCKS || (interval == 0 && threshold == 0))
+    {
+      fprintf(output, "ERROR: usage: flush [seconds [dirty blocks]|off]\n");
+    }
+    else
+    {
+      flushSettings(interval, threshold);
+    }
+  }
+
+  if(image_open && (strcmp(token[0], "insert") == 0 || strcmp(token[0], "retrieve") == 0 
+  || strcmp(token[0], "read") == 0 || strcmp(token[0], "delete") == 0 
+  || strcmp(token[0], "undel") == 0 || strcmp(token[0], "list") == 0 
+  || strcmp(token[0], "df") == 0 || strcmp(token[0], "close") == 0 
+  || strcmp(token[0], "savefs") == 0 || strcmp(token[0], "attrib") == 0 
+  || strcmp(token[0], "encrypt") == 0 || strcmp(token[0], "decrypt") == 0
+  || strcmp(token[0], "defrag") == 0 || strcmp(token[0], "snapshot") == 0
+  || strcmp(token[0], "rollback") == 0 || strcmp(token[0], "scrub") == 0
+  || strcmp(token[0], "verify") == 0 || strcmp(token[0], "fsck") == 0
+  || strcmp(token[0], "update") == 0 || strcmp(token[0], "export") == 0
+  || strcmp(token[0], "import") == 0 || strcmp(token[0], "copy") == 0
+  || strcmp(token[0], "cat") == 0 || strcmp(token[0], "reserve") == 0
+  || strcmp(token[0], "sync") == 0 || strcmp(token[0], "sync-to") == 0
+  || strcmp(token[0], "grep") == 0))
+  {
+    if(strcmp(token[0], "insert") == 0)
+    {
+      // insert functionality, insert - <name> reads the file from stdin
+      if(token_count == 3 && token[1] != NULL && strcmp(token[1], "-") == 0
+        && token[2] != NULL)
+      {
+#ifdef MFSD
+        // the server's stdin isn't the client's
+        fprintf(output, "ERROR: insert - only works in mfs, give a file or a FIFO.\n");
+#else
+        insertStream(stdin, token[2]);
+#endif
+        return;
+      }
+
+      if(token_count != 2)
+      {
+        fprintf(output, "ERROR: usage: insert <filename>|insert - <name>\n");
+        return;
+      }
+
+      if(token[1] == NULL)
+      {
+        fprintf(output, "ERROR: No filename specified.\n");
+        return;
+      }
+
+      insert(token[1]);
+    }
+
+    if(strcmp(token[0], "sync") == 0)
+    {
+      syncImage();
+    }
+
+    if(strcmp(token[0], "sync-to") == 0)
+    {
+      // sync-to functionality, a stream needs a file for the digests
+      bool stream = token_count >= 2 && token[1] != NULL && strcmp(token[1], "-") == 0;
+      if(token_count != (stream ? 3 : 2) || token[1] == NULL || token[token_count - 1] == NULL)
+      {
+        fprintf(output, "ERROR: usage: sync-to <backup image>|sync-to - <sums file>\n");
+        return;
+      }
+
+#ifdef MFSD
+      // the server's stdout isn't the client's
+      if(stream)
+      {
+        fprintf(output, "ERROR: sync-to - only works in mfs, give a backup image.\n");
+        return;
+      }
+#endif
+
+      syncTo(token[1], stream ? token[2] : NULL);
+    }
+
+    if(strcmp(token[0], "reserve") == 0)
+    {
+      // reserve functionality
+      char *end = NULL;
+      unsigned long size = token_count == 3 ? strtoul(token[2], &end, 10) : 0;
+      if(end == NULL || *end != 0 || end == token[2] || size > UINT32_MAX)
+      {
+        fprintf(output, "ERROR: usage: reserve <filename> <size>\n");
+        return;
+      }
+
+      reserve(token[1], size);
+    }
+
+    if(strcmp(token[0], "update") == 0)
+    {
+      // update functionality
+      if(token_count != 2 || token[1] == NULL)
+      {
+        fprintf(output, "ERROR: usage: update <filename>\n");
+        return;
+      }
+
+      update(token[1]);
+    }
+
+    if(strcmp(token[0], "copy") == 0)
+    {
+      // copy functionality
+      if((token_count != 3 && token_count != 4) || token[1] == NULL || token[2] == NULL)
+      {
+        fprintf(output, "ERROR: usage: copy <filename> <image> [new name]\n");
+        return;
+      }
+
+      copyFile(token[1], token[2], token_count == 4 ? token[3] : NULL);
+    }
+
+    if(strcmp(token[0], "export") == 0 || strcmp(token[0], "import") == 0)
+    {
+      // export and import functionality
+      if(token_count != 2 || token[1] == NULL)
+      {
+        fprintf(output, "ERROR: usage: %s <archive|->\n", token[0]);
+        return;
+      }
+
+#ifdef MFSD
+      // the server's stdin and stdout aren't the client's
+      if(strcmp(token[1], "-") == 0)
+      {
+        fprintf(output, "ERROR: %s - only works in mfs, give an archive.\n", token[0]);
+        return;
+      }
+#endif
+
+      if(strcmp(token[0], "export") == 0)
+      {
+        exportArchive(token[1]);
+      }
+      else
+      {
+        importArchive(token[1]);
+      }
+    }
+
+    if(strcmp(token[0], "retrieve") == 0 && token_count == 2)
+    {
+      // retrieve #1 functionality
+      if(token[1] == NULL)
+      {
+        fprintf(output, "ERROR: File name cannot be NULL.\n");
+        return;
+      }
+
+      retrieve(token[1]);
+    }
+    else if(strcmp(token[0], "retrieve") == 0 && token_count == 3)
+    {
+      // retrieve #2 functionality
+      if(token[1] == NULL || token[2] == NULL)
+      {
+        fprintf(output, "ERROR: Both files must be specified.\n");
+      }
+
+      retrieve_to_file(token[1], token[2]);
+    }
+
+    if(strcmp(token[0], "read") == 0 && token_count == 4)
+    {
+      // read functionality
+      readfile(token[1], atoi(token[2]), atoi(token[3]));
+    }
+
+    if(strcmp(token[0], "cat") == 0)
+    {
+      // the offset and length are optional, the length defaults to the rest of the file
+      char *end = NULL;
+      unsigned long offset = token_count >= 3 ? strtoul(token[2], &end, 10) : 0;
+      bool valid = token_count >= 2 && token_count <= 4 && (end == NULL || *end == 0);
+      unsigned long length = token_count == 4 ? strtoul(token[3], &end, 10) : UINT32_MAX;
+      valid = valid && (end == NULL || *end == 0) && offset <= UINT32_MAX
+        && length <= UINT32_MAX;
+      if(!valid)
+      {
+        fprintf(output, "ERROR: usage: cat <filename> [offset] [length]\n");
+        return;
+      }
+
+      catFile(token[1], offset, length);
+    }
+
+    if(strcmp(token[0], "delete") == 0 && token_count == 2)
+    {
+      if(token[1] == NULL) //filename exists && not already deleted
+      {
+        fprintf(output, "ERROR: File not specified.\n");
+        return;
+      }
+
+      delete(token[1]);
+    }
+
+    if(strcmp(token[0], "undel") == 0 && token_count == 2)
+    {
+      if(token[1] == NULL) //checks if a filename was provided
+      {
+        fprintf(output, "ERROR: File not specified.\n");
+        return;
+      }
+      
+      undelete(token[1]);
+    }
+
+    if(strcmp(token[0], "list") == 0)
+    {
+      // list [-h] [-a] [-s name|size|time] [-r] [pattern] [--json|--csv] functionality
+      struct list_options options;
+      if(!listOptions(token, token_count, &options))
+      {
+        fprintf(output, "ERROR: usage: list [-h] [-a] [-s name|size|time] [-r] [pattern] "
+          "[--json|--csv] [--limit count] [--offset count]\n");
+        return;
+      }
+
+      list(&options);
+    }
+
+    if(strcmp(token[0], "df") == 0)
+    {
+      // df functionality
+      fprintf(output, "%d bytes free.\n", df());
+    }
+
+    if(strcmp(token[0], "close") == 0 && token_count == 1)
+    {
+      // close functionality
+      closefs();
+    }
+
+    if(strcmp(token[0], "savefs") == 0)
+    {
+      // savefs functionality
+      savefs(image_name);
+    }
+
+    if(strcmp(token[0], "attrib") == 0 && token_count == 3)
+    {
+      // attrib [+attribute][-attribute] functionality
+      if(strcmp(token[1], "-h") == 0 || strcmp(token[1], "+h") == 0 
+      || strcmp(token[1], "-r") == 0 || strcmp(token[1], "+r") == 0)
+      {   //checks provided attributes prior to function call
+        attribute(token[2], token[1]);
+      }
+      else
+      {
+        fprintf(output, "\nERROR: Invalid attribute entry.\n");
+      }
+    }
+
+    if(strcmp(token[0], "encrypt") == 0 && token_count == 3)
+    {
+      // encrypt functionality 
+      if(strlen(token[2]) == 1)   //checks if key is a single char
+      {
+        encrypt(token[1], token[2], 'e');
+      }
+      else
+      {
+        fprintf(output, "\nERROR: Invalid cipher.\n");
+      }
+    }
+
+    if(strcmp(token[0], "decrypt") == 0 && token_count == 3)
+    {
+      // decrypt functionality
+      if(strlen(token[2]) == 1) //checks if key is a single char
+      {
+        encrypt(token[1], token[2], 'd');
+      }
+      else
+      {
+        fprintf(output, "\nERROR: invalid cipher.\n");
+      }
+    }
+
+    if(strcmp(token[0], "defrag") == 0 && token_count <= 2)
+    {
+      // defrag [block budget] functionality
+      int budget = 0;
+      if(token[1] != NULL)
+      {
+        budget = atoi(token[1]);
+      }
+
+      int moved = defrag(budget);
+      if(budget > 0 && moved >= budget)
+      {
+        fprintf(output, "Moved %d blocks, run defrag again to continue.\n", moved);
+      }
+      else
+      {
+        fprintf(output, "Defragmentation complete, %d blocks moved.\n", moved);
+      }
+    }
+
+    if(strcmp(token[0], "snapshot") == 0)
+    {
+      // snapshot [-d] [name] functionality
+      if(token_count == 1 || token[1] == NULL)
+      {
+        listSnapshots();
+      }
+      else if(strcmp(token[1], "-d") == 0)
+      {
+        if(token_count != 3 || token[2] == NULL)
+        {
+          fprintf(output, "ERROR: usage: snapshot -d <name>\n");
+          return;
+        }
+
+        deleteSnapshot(token[2]);
+      }
+      else
+      {
+        snapshot(token[1]);
+      }
+    }
+
+    if(strcmp(token[0], "rollback") == 0)
+    {
+      // rollback functionality
+      if(token_count != 2 || token[1] == NULL)
+      {
+        fprintf(output, "ERROR: usage: rollback <name>\n");
+        return;
+      }
+
+      rollback(token[1]);
+    }
+
+    if(strcmp(token[0], "scrub") == 0 && token_count == 1)
+    {
+      // scrub functionality
+      scrub();
+    }
+
+    if(strcmp(token[0], "grep") == 0)
+    {
+      // grep <pattern> [glob] functionality
+      if(token_count < 2 || token_count > 3 || token[1] == NULL || token[1][0] == 0)
+      {
+        fprintf(output, "ERROR: usage: grep <pattern> [glob]\n");
+        return;
+      }
+
+      grep(token[1], token_count == 3 ? token[2] : NULL);
+    }
+
+    if(strcmp(token[0], "fsck") == 0 && token_count == 1)
+    {
+      // fsck functionality
+      fsck();
+    }
+
+    if(strcmp(token[0], "verify") == 0)
+    {
+      // verify [on|off] functionality
+      if(token_count == 2 && token[1] != NULL && strcmp(token[1], "on") == 0)
+      {
+        verify_reads = true;
+      }
+      else if(token_count == 2 && token[1] != NULL && strcmp(token[1], "off") == 0)
+      {
+        verify_reads = false;
+      }
+      else if(token_count != 1)
+      {
+        fprintf(output, "ERROR: usage: verify [on|off]\n");
+        return;
+      }
+
+      fprintf(output, verify_reads ? "Reads are verified against the block checksums.\n"
+        : "Reads are not verified, run scrub to check the image.\n");
+    }
+  }
+  else if(!image_open && (strcmp(token[0], "insert") == 0 || strcmp(token[0], "retrieve") == 0 
+  || strcmp(token[0], "read") == 0 || strcmp(token[0], "delete") == 0 
+  || strcmp(token[0], "undel") == 0 || strcmp(token[0], "list") == 0 
+  || strcmp(token[0], "df") == 0 || strcmp(token[0], "close") == 0 
+  || strcmp(token[0], "savefs") == 0 || strcmp(token[0], "attrib") == 0 
+  || strcmp(token[0], "encrypt") == 0 || strcmp(token[0], "decrypt") == 0
+  || strcmp(token[0], "defrag") == 0 || strcmp(token[0], "snapshot") == 0
+  || strcmp(token[0], "rollback") == 0 || strcmp(token[0], "scrub") == 0
+  || strcmp(token[0], "verify") == 0 || strcmp(token[0], "fsck") == 0
+  || strcmp(token[0], "update") == 0 || strcmp(token[0], "export") == 0
+  || strcmp(token[0], "import") == 0 || strcmp(token[0], "copy") == 0
+  || strcmp(token[0], "cat") == 0 || strcmp(token[0], "reserve") == 0
+  || strcmp(token[0], "sync") == 0 || strcmp(token[0], "sync-to") == 0
+  || strcmp(token[0], "grep") == 0))
+  {
+    fprintf(output, "ERROR: Disk image is not opened.\n");
+    return;
+  }
+}
+
+// true for the commands that work on the image as a whole rather than single files
+bool image_command(char *command)
+{
+  return strcmp(command, "open") == 0 || strcmp(command, "createfs") == 0
+    || strcmp(command, "close") == 0 || strcmp(command, "savefs") == 0
+    || strcmp(command, "defrag") == 0 || strcmp(command, "snapshot") == 0
+    || strcmp(command, "rollback") == 0 || strcmp(command, "scrub") == 0
+    || strcmp(command, "verify") == 0 || strcmp(command, "fsck") == 0
+    || strcmp(command, "use") == 0 || strcmp(command, "copy") == 0
+    || strcmp(command, "sync") == 0 || strcmp(command, "sync-to") == 0
+    || strcmp(command, "apply") == 0 || strcmp(command, "profile") == 0;
+}
+
+// true for the commands that only read the image, it isn't saved or flushed for them
+bool read_command(char *command)
+{
+  return strcmp(command, "list") == 0 || strcmp(command, "df") == 0
+    || strcmp(command, "retrieve") == 0 || strcmp(command, "read") == 0
+    || strcmp(command, "export") == 0 || strcmp(command, "scrub") == 0
+    || strcmp(command, "cat") == 0 || strcmp(command, "sync-to") == 0
+    || strcmp(command, "apply") == 0 || strcmp(command, "grep") == 0
+    || strcmp(command, "profile") == 0;
+}
+
+// runs a single parsed command holding the image lock. file commands share it and lock
+// the directory and the inodes they touch, so in mfsd they run in parallel unless
+// they work on the same file. whole image commands are serialized against everything
+void execute(char **token, int token_count)
+{
+  if(token[0] == NULL)
+  {
+    return;
+  }
+
+  bool whole_image = image_command(token[0]);
+  if(!whole_image)
+  {
+    pthread_rwlock_rdlock(&image_lock);
+  }
+  else
+  {
+    pthread_rwlock_wrlock(&image_lock);
+    pthread_mutex_lock(&flush_lock);
+  }
+
+  if(!read_command(token[0]))
+  {
+    __atomic_store_n(&image_changed, true, __ATOMIC_RELAXED);
+  }
+  dispatch(token, token_count);
+
+  if(whole_image)
+  {
+    pthread_mutex_unlock(&flush_lock);
+  }
+  pthread_rwlock_unlock(&image_lock);
+}
+
+// the host file a command reads or writes, NULL if it has none. traces record its size
+// so mfs-replay can make an input file of that size when it's missing
+char *hostFile(char **token, int token_count)
+{
+  if(token[0] == NULL || token_count < 2 || token[1] == NULL)
+  {
+    return NULL;
+  }
+
+  if(strcmp(token[0], "insert") == 0 || strcmp(token[0], "update") == 0)
+  {
+    return token[1];
+  }
+
+  if(strcmp(token[0], "retrieve") == 0)
+  {
+    return token_count == 3 && token[2] != NULL ? token[2] : token[1];
+  }
+
+  if((strcmp(token[0], "export") == 0 || strcmp(token[0], "import") == 0)
+    && strcmp(token[1], "-") != 0)
+  {
+    return token[1];
+  }
+
+  return NULL;
+}
+
+// microseconds from one point in time to a later one
+double microseconds(struct timespec *from, struct timespec *to)
+{
+  return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+#ifdef MFSD
+
+#define NUM_WORKERS 4      // threads executing client commands
+#define MAX_CLIENTS 256    // connections served at the same time
+
+// a connected client and the part of its input that isn't a full command line yet
+struct client
+{
+  int fd;
+  size_t length;
+  char buffer[MAX_COMMAND_SIZE * 4];
+};
+
+// clients with input waiting, filled by the epoll loop and drained by the workers.
+// epoll hands a client out once until it is re-armed, so it is never queued twice
+struct client *ready_clients[MAX_CLIENTS];
+int ready_head = 0;
+int ready_count = 0;
+int client_count = 0;
+pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+int epoll_fd;
+
+// writes the whole buffer to the socket, returns false if the client went away
+bool write_all(int fd, char *buffer, size_t size)
+{
+  while(size > 0)
+  {
+    ssize_t written = write(fd, buffer, size);
+    if(written <= 0)
+    {
+      return false;
+    }
+    buffer += written;
+    size -= written;
+  }
+  return true;
+}
+
+// drops the connection and frees the client
+void close_client(struct client *c)
+{
+  close(c->fd);
+  free(c);
+
+  pthread_mutex_lock(&ready_mutex);
+  client_count--;
+  pthread_mutex_unlock(&ready_mutex);
+}
+
+// runs every complete command line in the client's buffer and sends back the output
+// of each one followed by the prompt. returns false once the client quit
+bool serve_client(struct client *c)
+{
+  char *end;
+
+  // a line that doesn't fit in the buffer is run as is
+  if(c->length == sizeof(c->buffer) - 1 && memchr(c->buffer, '\n', c->length) == NULL)
+  {
+    c->buffer[c->length++] = '\n';
+  }
+
+  while((end = memchr(c->buffer, '\n', c->length)) != NULL)
+  {
+    *end = 0;
+    size_t line_length = end - c->buffer + 1;
+    c->buffer[strcspn(c->buffer, "\r")] = 0;
+
+    char *token[MAX_NUM_ARGUMENTS];
+    int token_count = tokenize(c->buffer, token);
+
+    memmove(c->buffer, c->buffer + line_length, c->length - line_length);
+    c->length -= line_length;
+
+    if(token[0] != NULL && strcmp(token[0], "quit") == 0)
+    {
+      free_tokens(token);
+      return false;
+    }
+
+    char *text;
+    size_t size;
+    output = open_memstream(&text, &size);
+
+    execute(token, token_count);
+    fprintf(output, "mfs> ");
+
+    fclose(output);
+    free_tokens(token);
+
+    bool sent = write_all(c->fd, text, size);
+    free(text);
+
+    if(!sent)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// worker thread, takes clients with pending input off the queue and serves them
+void *worker(void *arg)
+{
+  while(1)
+  {
+    pthread_mutex_lock(&ready_mutex);
+    while(ready_count == 0)
+    {
+      pthread_cond_wait(&ready_cond, &ready_mutex);
+    }
+    struct client *c = ready_clients[ready_head];
+    ready_head = (ready_head + 1) % MAX_CLIENTS;
+    ready_count--;
+    pthread_mutex_unlock(&ready_mutex);
+
+    ssize_t bytes = read(c->fd, c->buffer + c->length, sizeof(c->buffer) - 1 - c->length);
+
+    if(bytes <= 0)
+    {
+      close_client(c);
+      continue;
+    }
+
+    c->length += bytes;
+
+    if(!serve_client(c))
+    {
+      close_client(c);
+      continue;
+    }
+
+    // hand the client back to epoll for its next command
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+  }
+
+  return NULL;
+}
+
+// mfsd owns one image and serves the mfs commands to clients connecting to a UNIX
+// domain socket, e.g. with "nc -U <socket>". commands from different clients run on
+// a pool of worker threads, reads in parallel and changes to the image one at a time
+int main(int argc, char *argv[])
+{
+  if(argc < 2 || argc > 3)
+  {
+    fprintf(stderr, "usage: mfsd <socket path> [disk image]\n");
+    return EXIT_FAILURE;
+  }
+
+  output = stdout;
+  init_locks();
+  checksum_init();
+  init();
+  profileFromEnvironment();
+
+  if(argc == 3)
+  {
+    openfs(argv[2], 0);
+  }
+
+  // a client hanging up mid-reply shouldn't take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+  unlink(argv[1]);
+
+  if(listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1
+    || listen(listen_fd, MAX_CLIENTS) == -1)
+  {
+    perror("mfsd: could not listen on socket");
+    return EXIT_FAILURE;
+  }
+
+  epoll_fd = epoll_create1(0);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+
+  for(int i = 0; i < NUM_WORKERS; i++)
+  {
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, NULL);
+    pthread_detach(thread);
+  }
+
+  while(1)
+  {
+    struct epoll_event events[64];
+    int count = epoll_wait(epoll_fd, events, 64, -1);
+
+    for(int i = 0; i < count; i++)
+    {
+      // new connection
+      if(events[i].data.ptr == NULL)
+      {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd == -1)
+        {
+          continue;
+        }
+
+        pthread_mutex_lock(&ready_mutex);
+        bool full = client_count == MAX_CLIENTS;
+        if(!full)
+        {
+          client_count++;
+        }
+        pthread_mutex_unlock(&ready_mutex);
+
+        if(full || !write_all(fd, "mfs> ", 5))
+        {
+          if(!full)
+          {
+            pthread_mutex_lock(&ready_mutex);
+            client_count--;
+            pthread_mutex_unlock(&ready_mutex);
+          }
+          close(fd);
+          continue;
+        }
+
+        struct client *c = (struct client *)calloc(1, sizeof(struct client));
+        c->fd = fd;
+
+        struct epoll_event client_event;
+        client_event.events = EPOLLIN | EPOLLONESHOT;
+        client_event.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &client_event);
+        continue;
+      }
+
+      // a client sent something, queue it for the workers
+      pthread_mutex_lock(&ready_mutex);
+      ready_clients[(ready_head + ready_count) % MAX_CLIENTS] = events[i].data.ptr;
+      ready_count++;
+      pthread_cond_signal(&ready_cond);
+      pthread_mutex_unlock(&ready_mutex);
+    }
+  }
+
+  return 0;
+}
+
+#elif defined(MFS_REPLAY)
+
+#define MAX_COMMAND_KINDS 32
+#define REPLAY_OUTPUT (1024 * 1024)
+
+// what one kind of command did in a replay, the latency of each run in microseconds
+// in the replay and when it was recorded
+struct command_stats
+{
+  char name[16];
+  int count;
+  int errors;
+  double *replayed;
+  double *recorded;
+};
+
+struct command_stats stats[MAX_COMMAND_KINDS];
+int kinds = 0;
+
+// the stats of a kind of command, NULL once there are too many kinds
+struct command_stats *commandStats(char *name, int lines)
+{
+  for(int i = 0; i < kinds; i++)
+  {
+    if(strcmp(stats[i].name, name) == 0)
+    {
+      return &stats[i];
+    }
+  }
+
+  if(kinds == MAX_COMMAND_KINDS)
+  {
+    return NULL;
+  }
+
+  struct command_stats *kind = &stats[kinds++];
+  strncpy(kind->name, name, sizeof(kind->name) - 1);
+  kind->replayed = (double *)malloc(lines * sizeof(double));
+  kind->recorded = (double *)malloc(lines * sizeof(double));
+  return kind;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// the p-th percentile of count sorted latencies
+double percentile(double *sorted, int count, int p)
+{
+  int rank = (count * p + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// the input files the replay made, removed again at the end
+char **made_files = NULL;
+int made_count = 0;
+
+// makes the host file a recorded insert or update read when it isn't there with the
+// recorded size. files the replay made are made again for each update, so the update
+// has changed contents to write, files that were there already are never touched
+void makeInput(char *name, long long size, bool update, unsigned seed)
+{
+  bool made = false;
+  for(int i = 0; i < made_count && !made; i++)
+  {
+    made = strcmp(made_files[i], name) == 0;
+  }
+
+  struct stat buf;
+  bool exists = stat(name, &buf) == 0;
+  if(exists && (!made || (!update && buf.st_size == size)))
+  {
+    return;
+  }
+
+  FILE *file = fopen(name, "w");
+  if(file == NULL)
+  {
+    return;
+  }
+
+  // xorshift, the contents only have to differ from one version to the next
+  uint32_t state = seed * 2654435761u + 1;
+  for(long long i = 0; i < size; i += 4)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    fwrite(&state, 1, size - i < 4 ? size - i : 4, file);
+  }
+  fclose(file);
+
+  if(!made)
+  {
+    made_files = (char **)realloc(made_files, (made_count + 1) * sizeof(char *));
+    made_files[made_count++] = strdup(name);
+  }
+}
+
+// opens image for a trace that started with an image open, or creates it if the file
+// doesn't exist
+void openReplayImage(char *image)
+{
+  if(access(image, F_OK) == 0)
+  {
+    openfs(image, 0);
+  }
+  else
+  {
+    createfs(image);
+  }
+}
+
+void printCounter(char *name, uint64_t value)
+{
+  printf("  %-20s %12llu\n", name, (unsigned long long)value);
+}
+
+// mfs-replay <trace> [image] runs the commands of a trace recorded by mfs as fast as it
+// can and reports how long they took. with an image the trace works on that image
+// instead of the ones it opens or creates, a trace that started with an image open
+// opens it first. missing input files are made with the recorded sizes
+int main(int argc, char *argv[])
+{
+  if(argc != 2 && argc != 3)
+  {
+    fprintf(stderr, "ERROR: usage: mfs-replay <trace> [image]\n");
+    return EXIT_FAILURE;
+  }
+
+  FILE *trace = fopen(argv[1], "r");
+  if(trace == NULL)
+  {
+    fprintf(stderr, "ERROR: Could not open %s.\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  // command output is only looked at for errors
+  char *printed = (char *)malloc(REPLAY_OUTPUT);
+  output = fmemopen(printed, REPLAY_OUTPUT, "w");
+  init_locks();
+  checksum_init();
+  init();
+  profileFromEnvironment();
+
+  int lines = 0;
+  char line[MAX_COMMAND_SIZE + 64];
+  while(fgets(line, sizeof(line), trace))
+  {
+    lines++;
+  }
+  rewind(trace);
+
+  char *image = argc == 3 ? argv[2] : NULL;
+  int commands = 0;
+  int errors = 0;
+  long long host_bytes = 0;
+  double replay_time = 0;
+  double recorded_time = 0;
+
+  for(int number = 1; fgets(line, sizeof(line), trace); number++)
+  {
+    line[strcspn(line, "\n")] = 0;
+
+    char header[MAX_COMMAND_SIZE];
+    if(sscanf(line, "# mfs trace, image %255s", header) == 1)
+    {
+      if(argc == 2 && strcmp(header, "-") != 0)
+      {
+        image = strdup(header);
+      }
+      continue;
+    }
+
+    double offset;
+    double recorded;
+    long long size;
+    int length = 0;
+    if(line[0] == '#' || sscanf(line, "%lf %lf %lld %n", &offset, &recorded, &size, &length) < 3
+      || length == 0)
+    {
+      continue;
+    }
+
+    char *token[MAX_NUM_ARGUMENTS];
+    int token_count = tokenize(line + length, token);
+    if(token[0] == NULL)
+    {
+      free_tokens(token);
+      continue;
+    }
+
+    bool opens = strcmp(token[0], "open") == 0 || strcmp(token[0], "createfs") == 0;
+    if(opens && argc == 3 && token[1] != NULL)
+    {
+      free(token[1]);
+      token[1] = strdup(argv[2]);
+    }
+    if(!opens && !image_open && image != NULL && strcmp(token[0], "use") != 0)
+    {
+      openReplayImage(image);
+    }
+
+    char *host = hostFile(token, token_count);
+    if(host != NULL && size >= 0
+      && (strcmp(token[0], "insert") == 0 || strcmp(token[0], "update") == 0))
+    {
+      makeInput(host, size, strcmp(token[0], "update") == 0, number);
+    }
+
+    rewind(output);
+    printed[0] = 0;
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    execute(token, token_count);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fflush(output);
+    printed[REPLAY_OUTPUT - 1] = 0;
+    bool failed = strstr(printed, "ERROR") != NULL;
+
+    double took = microseconds(&start, &end);
+    struct command_stats *kind = commandStats(token[0], lines);
+    if(kind != NULL)
+    {
+      kind->replayed[kind->count] = took;
+      kind->recorded[kind->count] = recorded;
+      kind->count++;
+      kind->errors += failed;
+    }
+
+    commands++;
+    errors += failed;
+    replay_time += took;
+    recorded_time += recorded;
+    host_bytes += size > 0 ? size : 0;
+    free_tokens(token);
+  }
+
+  fclose(trace);
+  for(int i = 0; i < made_count; i++)
+  {
+    unlink(made_files[i]);
+  }
+
+  double seconds = replay_time / 1e6;
+  printf("Replayed %d commands in %.3f s, %.0f commands/s, %.1f MB/s of host files, "
+    "%d errors.\n", commands, seconds, seconds > 0 ? commands / seconds : 0,
+    seconds > 0 ? host_bytes / seconds / 1e6 : 0, errors);
+  printf("Recorded run took %.3f s, %.2fx the replay.\n", recorded_time / 1e6,
+    replay_time > 0 ? recorded_time / replay_time : 0);
+
+  printf("\n%-12s %8s %7s %10s %10s %10s %10s %14s\n", "command", "count", "errors",
+    "p50 us", "p90 us", "p99 us", "max us", "recorded p50");
+  for(int i = 0; i < kinds; i++)
+  {
+    struct command_stats *kind = &stats[i];
+    qsort(kind->replayed, kind->count, sizeof(double), compareDoubles);
+    qsort(kind->recorded, kind->count, sizeof(double), compareDoubles);
+    printf("%-12s %8d %7d %10.1f %10.1f %10.1f %10.1f %14.1f\n", kind->name, kind->count,
+      kind->errors, percentile(kind->replayed, kind->count, 50),
+      percentile(kind->replayed, kind->count, 90), percentile(kind->replayed, kind->count, 99),
+      kind->replayed[kind->count - 1], percentile(kind->recorded, kind->count, 50));
+  }
+
+  printf("\nCounters:\n");
+  printCounter("run searches", counters.run_searches);
+  printCounter("run fallbacks", counters.run_fallbacks);
+  printCounter("block searches", counters.block_searches);
+  printCounter("block probes", counters.block_probes);
+  printCounter("blocks allocated", counters.blocks_allocated);
+  printCounter("inode searches", counters.inode_searches);
+  printCounter("inode probes", counters.inode_probes);
+  printCounter("directory walks", counters.directory_walks);
+  printCounter("directory nodes", counters.directory_nodes);
+  printCounter("directory splits", counters.directory_splits);
+  printCounter("cache hits", counters.cache_hits);
+  printCounter("cache misses", counters.cache_misses);
+
+  return EXIT_SUCCESS;
+}
+
+#else
+
+// the trace the shell records for mfs-replay, NULL while not tracing. a header names
+// the image open when the trace started, then each command is a line with its start in
+// microseconds since then, how long it took, the size of its host file (-1 if it has
+// none) and the command itself
+FILE *trace_file = NULL;
+char trace_name[MAX_COMMAND_SIZE];
+struct timespec trace_start;
+
+// trace <file> appends the commands that follow to file, trace off stops, trace alone
+// tells whether the session is being traced
+void trace(char **token, int token_count)
+{
+  if(token_count == 1 || token[1] == NULL)
+  {
+    if(trace_file != NULL)
+    {
+      fprintf(output, "Tracing to %s.\n", trace_name);
+    }
+    else
+    {
+      fprintf(output, "Not tracing.\n");
+    }
+    return;
+  }
+
+  if(token_count != 2)
+  {
+    fprintf(output, "ERROR: usage: trace [file|off]\n");
+    return;
+  }
+
+  if(trace_file != NULL)
+  {
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+
+  if(strcmp(token[1], "off") == 0)
+  {
+    return;
+  }
+
+  trace_file = fopen(token[1], "a");
+  if(trace_file == NULL)
+  {
+    fprintf(output, "ERROR: Could not open %s for writing.\n", token[1]);
+    return;
+  }
+
+  // a line at a time, so a trace is complete up to the last command if mfs dies
+  setvbuf(trace_file, NULL, _IOLBF, 0);
+  strncpy(trace_name, token[1], sizeof(trace_name) - 1);
+  clock_gettime(CLOCK_MONOTONIC, &trace_start);
+  fprintf(trace_file, "# mfs trace, image %s\n", image_open ? image_name : "-");
+}
+
+// runs a command, adding it to the trace when the session is traced
+void traced(char **token, int token_count)
+{
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  execute(token, token_count);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if(trace_file == NULL || token[0] == NULL)
+  {
+    return;
+  }
+
+  struct stat buf;
+  char *host = hostFile(token, token_count);
+  long long size = host != NULL && stat(host, &buf) == 0 ? (long long)buf.st_size : -1;
+
+  fprintf(trace_file, "%.0f %.0f %lld", microseconds(&trace_start, &start),
+    microseconds(&start, &end), size);
+  for(int i = 0; i < token_count && i < MAX_NUM_ARGUMENTS; i++)
+  {
+    if(token[i] != NULL)
+    {
+      fprintf(trace_file, " %s", token[i]);
+    }
+  }
+  fprintf(trace_file, "\n");
+}
+
+// runs one command given on the command line against an image, without a prompt, and
+// saves the image afterwards unless the command only reads it. an image that doesn't
+// exist yet is created for import. returns the exit status
+int run_once(char *image, char **args, int count)
+{
+  // a delta goes into the image file as it is, without loading the image
+  if(strcmp(args[0], "apply") == 0)
+  {
+    if(count != 2)
+    {
+      fprintf(stderr, "ERROR: usage: mfs <backup image> apply <delta|->\n");
+      return EXIT_FAILURE;
+    }
+    applyDelta(image, args[1]);
+    return EXIT_SUCCESS;
+  }
+
+  if(access(image, F_OK) != 0 && strcmp(args[0], "import") == 0)
+  {
+    createfs(image);
+  }
+  else
+  {
+    openfs(image, 0);
+  }
+
+  if(!image_open || count > MAX_NUM_ARGUMENTS)
+  {
+    fprintf(stderr, "ERROR: usage: mfs <image> <command> [arguments]\n");
+    return EXIT_FAILURE;
+  }
+
+  char *token[MAX_NUM_ARGUMENTS];
+  for(int i = 0; i < MAX_NUM_ARGUMENTS; i++)
+  {
+    token[i] = i < count ? strdup(args[i]) : NULL;
+  }
+
+  execute(token, count);
+
+  // a read command that still changed the metadata, like sync-to moving the sync point,
+  // only has the metadata written. stdout may hold its output, errors go to stderr
+  if(!read_command(args[0]))
+  {
+    savefs();
+  }
+  else if(image_changed)
+  {
+    output = stderr;
+    struct flush f;
+    if(flushCopy(&f) && flushWrite(&f, true) == -1)
+    {
+      fprintf(output, "ERROR: Could not write the disk image.\n");
+    }
+    output = stdout;
+  }
+
+  free_tokens(token);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+  char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
+
+  output = stdout;
+  init_locks();
+  checksum_init();
+  init();
+  profileFromEnvironment();
+
+  // mfs <image> <command> [arguments] runs a single command, so images can be used
+  // in scripts and pipes, ex. mfs old.img export - | mfs new.img import -
+  if(argc >= 3)
+  {
+    free(command_string);
+    return run_once(argv[1], &argv[2], argc - 2);
+  }
+
+  while (1)
+  {
+    // Print out the mfs prompt
+    printf("mfs> ");
+
+    // Read the command from the commandline.  The
+    // maximum command that will be read is MAX_COMMAND_SIZE
+    // fgets blocks until the user inputs something and only
+    // returns NULL at the end of the input, which ends the
+    // session just like quit
+    if (!fgets(command_string, MAX_COMMAND_SIZE, stdin))
+    {
+      break;
+    }
+
+    // Checks to see if the user entered nothing
+    if(strcmp(command_string, "\n") == 0)
+      continue;
+
+    command_string[strlen(command_string) - 1] = 0;
+
+    /* Parse input */
+    char *token[MAX_NUM_ARGUMENTS];
+    int token_count = tokenize(command_string, token);
+
+    if(token[0] != NULL && strcmp(token[0], "quit") == 0)
+    {
+      // Cleanup allocated memory
+      free_tokens(token);
+      break;
+    }
+
+    if(token[0] != NULL && strcmp(token[0], "trace") == 0)
+    {
+      trace(token, token_count);
+    }
+    else
+    {
+      traced(token, token_count);
+    }
+    free_tokens(token);
+  }
+
+  free(command_string);
+
+  return(EXIT_SUCCESS);
+}
+
+#endif